@@ -0,0 +1,547 @@
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include "bam_pileup.h"
+#include "evidence_store.h"
+
+#define CIGAR_MATCH 0
+#define CIGAR_DEL 2
+#define CIGAR_SKIP 3
+#define CIGAR_EQUAL 7
+#define CIGAR_DIFF 8
+
+Bam_Pileup bam_pileup;
+
+//4 bit read bases
+static const char Bam_bases[] = "=ACMGRSVTWYHKDBN";
+
+static inline bool cigar_ref(uint32_t op)
+{
+	op &= 0xf;
+	return (op == CIGAR_MATCH) || (op == CIGAR_DEL) || (op == CIGAR_SKIP) || (op == CIGAR_EQUAL) || (op == CIGAR_DIFF);
+}
+
+//M, I, S, = and X
+static inline bool cigar_query(uint32_t op)
+{
+	op &= 0xf;
+	return (op == CIGAR_MATCH) || (op == 1) || (op == 4) || (op == CIGAR_EQUAL) || (op == CIGAR_DIFF);
+}
+
+//Qualities as mpileup prints them
+static inline char pileup_qual(unsigned int qual)
+{
+	return (qual + 33 < 126) ? (char) (qual + 33) : (char) 126;
+}
+
+Bgzf_Reader::Bgzf_Reader()
+{
+	Offset = 0;
+	Bytes = 0;
+	Error = false;
+	memset(&Stream, 0, sizeof(Stream));
+	inflateInit2(&Stream, -15);
+}
+
+Bgzf_Reader::~Bgzf_Reader()
+{
+	inflateEnd(&Stream);
+}
+
+int Bgzf_Reader::Open(const string &filename)
+{
+	Name = filename;
+	In.open(filename, ios::in | ios::binary);
+	if (!In)
+	{
+		cerr << "Open BAM error : " << filename << endl;
+		return 1;
+	}
+	Block.clear();
+	Offset = 0;
+	Bytes = 0;
+	Error = false;
+	return 0;
+}
+
+void Bgzf_Reader::Close()
+{
+	In.close();
+	Block.clear();
+	Offset = 0;
+}
+
+//Returns 1 for a block, 0 at the end of the file and -1 on error
+int Bgzf_Reader::Load_Block()
+{
+	unsigned char header[12];
+	In.read((char *) header, 12);
+	if (In.gcount() == 0)
+		return 0;
+	if ((In.gcount() != 12) || (header[0] != 31) || (header[1] != 139) || (header[2] != 8) || !(header[3] & 4))
+	{
+		cerr << "Not a BGZF file : " << Name << endl;
+		Error = true;
+		return -1;
+	}
+
+	//BSIZE is in the BC field of the gzip extra fields
+	unsigned int xlen = header[10] | (header[11] << 8);
+	Compressed.resize(xlen);
+	In.read((char *) Compressed.data(), xlen);
+	int bsize = -1;
+	for (unsigned int k = 0; k + 4 <= xlen; k += 4 + (Compressed[k + 2] | (Compressed[k + 3] << 8)))
+		if ((Compressed[k] == 'B') && (Compressed[k + 1] == 'C') && (k + 6 <= xlen))
+			bsize = Compressed[k + 4] | (Compressed[k + 5] << 8);
+	if (!In || (bsize < 0) || (bsize + 1 < (int) (12 + xlen + 8)))
+	{
+		cerr << "BGZF block error : " << Name << endl;
+		Error = true;
+		return -1;
+	}
+
+	size_t rest = bsize + 1 - 12 - xlen;
+	Compressed.resize(rest);
+	In.read((char *) Compressed.data(), rest);
+	uint32_t crc, isize;
+	memcpy(&crc, Compressed.data() + rest - 8, 4);
+	memcpy(&isize, Compressed.data() + rest - 4, 4);
+	Block.resize(isize);
+
+	inflateReset(&Stream);
+	Stream.next_in = Compressed.data();
+	Stream.avail_in = rest - 8;
+	Stream.next_out = (Bytef *) &Block[0];
+	Stream.avail_out = isize;
+	if (!In || (inflate(&Stream, Z_FINISH) != Z_STREAM_END) || (Stream.total_out != isize)
+			|| (crc32(crc32(0L, Z_NULL, 0), (const Bytef *) Block.data(), isize) != crc))
+	{
+		cerr << "BGZF decompression error : " << Name << endl;
+		Error = true;
+		return -1;
+	}
+	Bytes += 12 + xlen + rest;
+	Offset = 0;
+	return 1;
+}
+
+size_t Bgzf_Reader::Read(void *data, size_t length)
+{
+	size_t done = 0;
+	while (done < length)
+	{
+		if (Offset == Block.size())
+		{
+			if (Load_Block() <= 0)
+				break;
+			continue;
+		}
+		size_t part = min(length - done, Block.size() - Offset);
+		memcpy((char *) data + done, Block.data() + Offset, part);
+		Offset += part;
+		done += part;
+	}
+	return done;
+}
+
+int Bam_File::Open(const string &filename)
+{
+	Name = filename;
+	if (Bgzf.Open(filename) != 0)
+		return 1;
+
+	char magic[4];
+	int32_t l_text, n_ref;
+	bool valid = (Bgzf.Read(magic, 4) == 4) && (memcmp(magic, BAM_MAGIC, 4) == 0) && (Bgzf.Read(&l_text, 4) == 4) && (l_text >= 0);
+	if (valid)
+	{
+		Record.resize(l_text);
+		valid = (Bgzf.Read(&Record[0], l_text) == (size_t) l_text) && (Bgzf.Read(&n_ref, 4) == 4) && (n_ref >= 0);
+	}
+	Names.clear();
+	for (int32_t i = 0; valid && (i < n_ref); i++)
+	{
+		int32_t l_name, l_ref;
+		valid = (Bgzf.Read(&l_name, 4) == 4) && (l_name > 0);
+		if (!valid)
+			break;
+		Record.resize(l_name);
+		valid = (Bgzf.Read(&Record[0], l_name) == (size_t) l_name) && (Bgzf.Read(&l_ref, 4) == 4);
+		Names.push_back(string(Record.c_str()));
+	}
+	if (!valid)
+	{
+		cerr << "Not a BAM file : " << filename << endl;
+		return 1;
+	}
+	return 0;
+}
+
+int Bam_File::Next(bam_read &read, int &contig)
+{
+	while (true)
+	{
+		int32_t block_size;
+		size_t got = Bgzf.Read(&block_size, 4);
+		if ((got == 0) && !Bgzf.Failed())
+			return 0;
+		if ((got != 4) || (block_size < 32))
+		{
+			cerr << "Truncated BAM file : " << Name << endl;
+			return -1;
+		}
+		Record.resize(block_size);
+		if (Bgzf.Read(&Record[0], block_size) != (size_t) block_size)
+		{
+			cerr << "Truncated BAM file : " << Name << endl;
+			return -1;
+		}
+
+		const char *r = Record.data();
+		int32_t ref_id, pos, l_seq;
+		uint16_t n_cigar, flag;
+		uint8_t l_read_name = r[8];
+		memcpy(&ref_id, r, 4);
+		memcpy(&pos, r + 4, 4);
+		memcpy(&n_cigar, r + 12, 2);
+		memcpy(&flag, r + 14, 2);
+		memcpy(&l_seq, r + 16, 4);
+
+		//Reads without a position come last
+		if (ref_id < 0)
+			return 0;
+		if ((ref_id >= (int32_t) Names.size()) || (pos < 0) || (l_seq < 0)
+				|| (32 + l_read_name + 4 * n_cigar + (l_seq + 1) / 2 + l_seq > block_size))
+		{
+			cerr << "BAM record error : " << Name << endl;
+			return -1;
+		}
+		if ((flag & BAM_SKIP_FLAGS) || ((flag & BAM_FLAG_PAIRED) && !(flag & BAM_FLAG_PROPER_PAIR)) || (n_cigar == 0))
+			continue;
+
+		const char *at = r + 32 + l_read_name;
+		read.cigar.resize(n_cigar);
+		memcpy(read.cigar.data(), at, 4 * n_cigar);
+		at += 4 * n_cigar;
+		read.pos = pos;
+		read.end = pos;
+		for (uint16_t k = 0; k < n_cigar; k++)
+			if (cigar_ref(read.cigar[k]))
+				read.end += read.cigar[k] >> 4;
+		if (read.end == read.pos)
+			continue;
+
+		read.seq.resize(l_seq);
+		for (int32_t k = 0; k < l_seq; k++)
+			read.seq[k] = Bam_bases[((unsigned char) at[k / 2] >> ((k & 1) ? 0 : 4)) & 0xf];
+		at += (l_seq + 1) / 2;
+		read.qual.assign(at, l_seq);
+		read.mq = r[9];
+		read.reverse = (flag & BAM_FLAG_REVERSE) != 0;
+		read.op = 0;
+		read.op_pos = pos;
+		read.op_query = 0;
+		contig = ref_id;
+		return 1;
+	}
+}
+
+Bam_Pileup::Bam_Pileup()
+{
+	Sequence_contig = -1;
+	Contig = 0;
+	Pos = 0;
+	Next_valid = false;
+	Failed = false;
+}
+
+int Bam_Pileup::Open(const vector<string> &bams, const string &reference)
+{
+	for (unsigned int i = 0; i < bams.size(); i++)
+	{
+		unique_ptr<bam_sample> sample(new bam_sample);
+		sample->filename = bams[i];
+		if (sample->file.Open(bams[i]) != 0)
+			return 1;
+		if ((i > 0) && (sample->file.Get_Names() != Samples[0]->file.Get_Names()))
+		{
+			cerr << "BAM contigs differ from those of " << bams[0] << " : " << bams[i] << endl;
+			return 1;
+		}
+		sample->pending = false;
+		sample->next_contig = 0;
+		sample->next_pos = 0;
+		sample->next = NULL;
+		Samples.push_back(move(sample));
+	}
+	if (Samples.empty())
+	{
+		cerr << "No BAM file given" << endl;
+		return 1;
+	}
+	Names = Samples[0]->file.Get_Names();
+
+	//Sequence offsets from the faidx index if there is one, else from the FASTA headers
+	Fasta_name = reference;
+	Fasta.open(reference, ios::in | ios::binary);
+	if (!Fasta)
+	{
+		cerr << "Open reference error : " << reference << endl;
+		return 1;
+	}
+	ifstream fai(reference + ".fai");
+	string line;
+	if (fai)
+	{
+		while (getline(fai, line))
+		{
+			istringstream fields(line);
+			string name;
+			long long length, offset;
+			if (fields >> name >> length >> offset)
+				Fasta_index[name] = offset;
+		}
+	}
+	else
+	{
+		while (getline(Fasta, line))
+			if (!line.empty() && (line[0] == '>'))
+				Fasta_index[line.substr(1, line.find_first_of(" \t\r", 1) - 1)] = Fasta.tellg();
+		Fasta.clear();
+	}
+
+	Contig = 0;
+	Pos = 0;
+	Failed = false;
+	for (unsigned int i = 0; i < Samples.size(); i++)
+		Fetch(*Samples[i]);
+	Advance();
+	return 0;
+}
+
+int Bam_Pileup::Close()
+{
+	for (unsigned int i = 0; i < Samples.size(); i++)
+		Samples[i]->file.Close();
+	Samples.clear();
+	Reads.clear();
+	Free.clear();
+	Fasta.close();
+	Fasta_index.clear();
+	Sequence.clear();
+	Sequence_contig = -1;
+	Next_valid = false;
+	return Failed ? 1 : 0;
+}
+
+unsigned long long Bam_Pileup::Get_File_Bytes()
+{
+	unsigned long long bytes = 0;
+	for (unsigned int i = 0; i < Samples.size(); i++)
+		bytes += file_size(Samples[i]->filename);
+	return bytes;
+}
+
+unsigned long long Bam_Pileup::Get_Bytes()
+{
+	unsigned long long bytes = 0;
+	for (unsigned int i = 0; i < Samples.size(); i++)
+		bytes += Samples[i]->file.Get_Bytes();
+	return bytes;
+}
+
+void Bam_Pileup::Fetch(bam_sample &sample)
+{
+	if (sample.next == NULL)
+	{
+		if (Free.empty())
+		{
+			Reads.push_back(unique_ptr<bam_read>(new bam_read));
+			Free.push_back(Reads.back().get());
+		}
+		sample.next = Free.back();
+		Free.pop_back();
+	}
+
+	int contig = 0;
+	int result = sample.file.Next(*sample.next, contig);
+	sample.pending = (result == 1);
+	if (result < 0)
+		Failed = true;
+	if (!sample.pending)
+		return;
+	if ((contig < sample.next_contig) || ((contig == sample.next_contig) && (sample.next->pos < sample.next_pos)))
+	{
+		cerr << "BAM file is not sorted by coordinate : " << sample.filename << endl;
+		Failed = true;
+		sample.pending = false;
+		return;
+	}
+	sample.next_contig = contig;
+	sample.next_pos = sample.next->pos;
+}
+
+void Bam_Pileup::Load_Sequence()
+{
+	Sequence.clear();
+	Sequence_contig = Contig;
+	unordered_map<string, streampos>::iterator it = Fasta_index.find(Names[Contig]);
+	if (it == Fasta_index.end())
+		return;
+
+	Fasta.clear();
+	Fasta.seekg(it->second);
+	string line;
+	while (getline(Fasta, line) && (line.empty() || (line[0] != '>')))
+		for (unsigned int k = 0; k < line.size(); k++)
+			if (!isspace((unsigned char) line[k]))
+				Sequence += toupper((unsigned char) line[k]);
+}
+
+//Moves Pos to the first position from Pos on that a read covers, across contigs
+void Bam_Pileup::Advance()
+{
+	while (!Failed)
+	{
+		bool covered = false;
+		int start = INT_MAX;
+		int contig = INT_MAX;
+		for (unsigned int i = 0; i < Samples.size(); i++)
+		{
+			bam_sample &sample = *Samples[i];
+			unsigned int kept = 0;
+			for (unsigned int k = 0; k < sample.active.size(); k++)
+			{
+				if (sample.active[k]->end > Pos)
+					sample.active[kept++] = sample.active[k];
+				else
+					Free.push_back(sample.active[k]);
+			}
+			sample.active.resize(kept);
+			covered = covered || (kept > 0);
+			if (sample.pending && (sample.next_contig == Contig))
+				start = min(start, sample.next->pos);
+			else if (sample.pending)
+				contig = min(contig, sample.next_contig);
+		}
+
+		if (!covered)
+		{
+			if (start == INT_MAX)
+			{
+				if (contig == INT_MAX)
+					break;
+				Contig = contig;
+				Pos = 0;
+				continue;
+			}
+			Pos = max(Pos, start);
+		}
+
+		for (unsigned int i = 0; i < Samples.size(); i++)
+		{
+			bam_sample &sample = *Samples[i];
+			while (sample.pending && (sample.next_contig == Contig) && (sample.next->pos <= Pos))
+			{
+				sample.active.push_back(sample.next);
+				sample.next = NULL;
+				Fetch(sample);
+			}
+		}
+		Next_valid = true;
+		return;
+	}
+	Next_valid = false;
+}
+
+//One entry per read of the sample at Pos, as the bases and qualities of an mpileup column
+void Bam_Pileup::Column(bam_sample &sample, char ref)
+{
+	Bases.clear();
+	Base_quals.clear();
+	Map_quals.clear();
+	for (unsigned int k = 0; k < sample.active.size(); k++)
+	{
+		bam_read *read = sample.active[k];
+		while (true)
+		{
+			uint32_t op = read->cigar[read->op];
+			int length = op >> 4;
+			if (cigar_ref(op) && (read->op_pos + length > Pos))
+				break;
+			if (cigar_ref(op))
+				read->op_pos += length;
+			if (cigar_query(op))
+				read->op_query += length;
+			read->op++;
+		}
+
+		uint32_t op = read->cigar[read->op] & 0xf;
+		unsigned int query = read->op_query;
+		char base;
+		if (op == CIGAR_DEL)
+			base = '*';
+		else if (op == CIGAR_SKIP)
+			base = read->reverse ? '<' : '>';
+		else
+		{
+			query += Pos - read->op_pos;
+			base = (query < read->seq.size()) ? read->seq[query] : 'N';
+			if ((base == '=') || (base == ref))
+				base = read->reverse ? ',' : '.';
+			else if (read->reverse)
+				base = tolower(base);
+		}
+		Bases += base;
+		Base_quals += (query < read->qual.size()) ? pileup_qual((unsigned char) read->qual[query]) : pileup_qual(0xff);
+		Map_quals += pileup_qual(read->mq);
+	}
+}
+
+int Bam_Pileup::Next_Site(site_record &record, Site_Arena *arena)
+{
+	Stat_Timer timer(STAT_PARSE);
+	clear_record(record, params);
+	if (Sequence_contig != Contig)
+		Load_Sequence();
+	char ref = (Pos < (int) Sequence.size()) ? Sequence[Pos] : 'N';
+	record.gene = Names[Contig];
+	record.pos = to_string(Pos + 1);
+	record.ref.assign(1, ref);
+
+	int candidate = 0;
+	if (ref == 'N')
+		stats.Add(COUNT_REF_N);
+	else
+	{
+		Site_Arena::mark start;
+		if (arena != NULL)
+			start = arena->Get_Mark();
+		Multi_Seq_Obj* mso = arena_new<Multi_Seq_Obj>(arena, params.sample_count, params.type, arena);
+		unsigned int contig = intern_contig(record.gene);
+		for (unsigned int i = 0; i < Samples.size(); i++)
+		{
+			Column(*Samples[i], ref);
+			if (Bases.empty())
+			{
+				stats.Add(COUNT_SAMPLE_NO_COVERAGE);
+				continue;
+			}
+			record.cov_vec[i] = Bases.size();
+			record.ref_vec[i] = Bases;
+			Seq_Obj *seq_obj = arena_new<Seq_Obj>(arena, contig, Pos + 1, ref, Bases.size(), Bases, Base_quals, Map_quals,
+					params.type, params.step, params.end_condition, arena);
+			add_sample(mso, seq_obj, i, arena, params);
+		}
+		if (evidence_store.Writing())
+			evidence_store.Write_Site(record, mso, false);
+		candidate = candidate_site(record, mso, arena, start, params);
+	}
+
+	Pos++;
+	Advance();
+	return candidate;
+}
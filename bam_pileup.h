@@ -0,0 +1,189 @@
+/*
+ * bam_pileup.h
+ *
+ * Native input from one coordinate sorted BAM file per sample (--bam) and
+ * the reference FASTA (--ref), in place of samtools mpileup text. The
+ * reads of all samples are piled up together, position by position and
+ * contig by contig in the order of the BAM headers. Every read covering a
+ * position gives one base (. or , for the reference, the read base, * in
+ * a deletion, > or < in a reference skip), its base quality and mapping
+ * quality, and the samples go through the same filters and packing as the
+ * pileup columns, -b and -m included. The pileup is that of
+ *
+ *   samtools mpileup -s -B -Q 0 -x -d 0 -f ref.fa
+ *
+ * reads unmapped, secondary, QC failed, duplicate, or paired but not in a
+ * proper pair are skipped, and no BAQ, base quality threshold, overlap
+ * correction or depth cap is applied. Reference bases are upper cased,
+ * contigs missing from the FASTA read as N and are skipped. The bases
+ * printed in the output have no read start, read end or indel marks.
+ */
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <zlib.h>
+#include "core_functions.h"
+
+#ifndef BAM_PILEUP_H
+#define BAM_PILEUP_H
+
+#define BAM_MAGIC "BAM\1"
+//Reads skipped as by samtools mpileup: unmapped, secondary, QC failed and duplicate
+#define BAM_SKIP_FLAGS 0x704
+#define BAM_FLAG_PAIRED 0x1
+#define BAM_FLAG_PROPER_PAIR 0x2
+#define BAM_FLAG_REVERSE 0x10
+
+using namespace std;
+
+//Reads the BGZF blocks of a file as one stream
+class Bgzf_Reader {
+public:
+	Bgzf_Reader();
+	~Bgzf_Reader();
+
+	int Open(const string &filename);
+	void Close();
+	//Returns the bytes read, fewer than length only at the end of the file
+	size_t Read(void *data, size_t length);
+
+	//Compressed bytes consumed
+	inline unsigned long long Get_Bytes()
+	{
+		return Bytes;
+	}
+
+	inline bool Failed()
+	{
+		return Error;
+	}
+
+private:
+	ifstream In;
+	string Name;
+	string Block;
+	size_t Offset;
+	unsigned long long Bytes;
+	vector<unsigned char> Compressed;
+	z_stream Stream;
+	bool Error;
+
+	int Load_Block();
+};
+
+//A read being piled up, with its cigar walked forward as the position moves
+typedef struct _bam_read {
+	int pos;
+	int end; //One past the last reference base
+	unsigned char mq;
+	bool reverse;
+	vector<uint32_t> cigar;
+	string seq;
+	string qual;
+	unsigned int op;
+	int op_pos;   //Reference position of cigar op
+	int op_query; //Query position of cigar op
+} bam_read;
+
+class Bam_File {
+public:
+	int Open(const string &filename);
+
+	inline void Close()
+	{
+		Bgzf.Close();
+	}
+
+	inline const vector<string> &Get_Names()
+	{
+		return Names;
+	}
+
+	inline unsigned long long Get_Bytes()
+	{
+		return Bgzf.Get_Bytes();
+	}
+
+	//The next read kept for the pileup, returns 1, 0 after the last mapped read, -1 on error
+	int Next(bam_read &read, int &contig);
+
+private:
+	Bgzf_Reader Bgzf;
+	string Name;
+	vector<string> Names;
+	string Record;
+};
+
+class Bam_Pileup {
+public:
+	Bam_Pileup();
+
+	int Open(const vector<string> &bams, const string &reference);
+
+	inline bool Reading()
+	{
+		return !Samples.empty();
+	}
+
+	inline unsigned int Get_Samples()
+	{
+		return Samples.size();
+	}
+
+	inline bool Has_Next()
+	{
+		return Next_valid && !Failed;
+	}
+
+	//Compressed bytes of the BAM files, and those consumed
+	unsigned long long Get_File_Bytes();
+	unsigned long long Get_Bytes();
+
+	//The site at the next covered position, returns 1 if it is a candidate as parse_site
+	int Next_Site(site_record &record, Site_Arena *arena = NULL);
+
+	//Returns 1 if a BAM file could not be read to its end
+	int Close();
+
+private:
+	typedef struct _bam_sample {
+		string filename;
+		Bam_File file;
+		bool pending; //next holds the first read not yet piled up
+		int next_contig;
+		int next_pos;
+		bam_read *next;
+		vector<bam_read*> active; //In file order, as mpileup lists them
+	} bam_sample;
+
+	vector<unique_ptr<bam_sample>> Samples;
+	vector<string> Names;
+	vector<unique_ptr<bam_read>> Reads; //Every read allocated, reused through Free
+	vector<bam_read*> Free;
+
+	ifstream Fasta;
+	string Fasta_name;
+	unordered_map<string, streampos> Fasta_index;
+	string Sequence; //Of contig Sequence_contig, upper cased
+	int Sequence_contig;
+
+	int Contig;
+	int Pos;
+	bool Next_valid;
+	bool Failed;
+	string Bases;
+	string Base_quals;
+	string Map_quals;
+
+	void Fetch(bam_sample &sample);
+	void Load_Sequence();
+	void Advance();
+	void Column(bam_sample &sample, char ref);
+};
+
+extern Bam_Pileup bam_pileup;
+
+#endif
@@ -0,0 +1,313 @@
+#include <cmath>
+#include <algorithm>
+#include "batch_em.h"
+#include "stats.h"
+#include "math_kernels.h"
+#include "isa_kernels.h"
+
+Batch_EM::Batch_EM(unsigned int tile, unsigned int type, float end, float step, float eps)
+{
+	this->Max_tile = tile;
+	this->Tile = 0;
+	this->Sample = 0;
+	this->Rows = 0;
+	this->Type = type;
+	this->End = end;
+	this->Step = step;
+	this->Eps = eps;
+
+	//Same grid as Basic_EM
+	float grid_end = end - step / 10.0;
+	float test_p = step;
+	while (test_p < grid_end)
+	{
+		Grid_p.push_back(test_p);
+		Grid_index.push_back(floor((test_p - step / 10) / step));
+		test_p += step;
+	}
+	this->Grid = Grid_p.size();
+}
+
+//Tables for sites of up to rows covered samples. Rows are added to the end of the tables, rows a lane
+//does not use stay zero. A tile narrowed by BATCH_EM_TABLE_BYTES lays the tables out again
+void Batch_EM::Reserve(unsigned int rows)
+{
+	if ((Tile > 0) && (rows <= Sample))
+		return;
+	rows = (rows > Sample) ? rows : Sample;
+
+	size_t lane_bytes = (size_t) rows * (Grid * Grid + 2 * Grid) * sizeof(float);
+	unsigned int tile = (Max_tile == 0) ? 1 : ((Max_tile > MAX_TILE) ? MAX_TILE : Max_tile);
+	while ((tile > 1) && (lane_bytes * tile > BATCH_EM_TABLE_BYTES))
+		tile--;
+
+	if (tile != Tile)
+	{
+		Tile = tile;
+		Lane_site.assign(Tile, NULL);
+		Lane_loop.assign(Tile, 0);
+		Lane_first.assign(Tile, 0);
+		Lane_active.assign(Tile, 0);
+		Lane_rows.assign(Tile, 0);
+
+		Count.assign(Tile, 0.0);
+		Init_value.assign(Type * Tile, 0.0);
+		Calc_value.assign(Type * Tile, 0.0);
+		Init_p.assign(Tile, 0.0);
+		Init_p_2.assign(Tile, 0.0);
+		Calc_p.assign(Tile, 0.0);
+		Calc_p_2.assign(Tile, 0.0);
+		Sum.assign(Grid * Grid * Tile, 0.0);
+		Sum_max.assign(Tile, MIN);
+		Best.assign(Tile, -1);
+
+		Present.clear();
+		E.clear();
+		FS.clear();
+		T1.clear();
+		T2.clear();
+		T3.clear();
+	}
+
+	Sample = rows;
+	Present.resize(Sample * Tile, 0.0);
+	E.resize(Sample * Type * Tile, 0.0);
+	FS.resize(Sample * Type * Tile, 0.0);
+	T1.resize(Sample * Grid * Tile, 0.0);
+	T2.resize(Sample * Grid * Tile, 0.0);
+	T3.resize((size_t) Sample * Grid * Grid * Tile, 0.0);
+}
+
+int Batch_EM::Run(vector<Multi_Seq_Obj*> &sites)
+{
+	Stat_Timer timer(STAT_EM);
+	int loops = 0;
+	unsigned int next = 0;
+
+	unsigned int rows = 0;
+	for (Multi_Seq_Obj *site : sites)
+		rows = (site->Sample_Count > rows) ? site->Sample_Count : rows;
+	Reserve(rows);
+
+	for (unsigned int l = 0; l < Tile; l++)
+	{
+		Lane_active[l] = 0;
+		while ((next < sites.size()) && (Load_Lane(l, sites[next++]) == 0));
+	}
+
+	while (find(Lane_active.begin(), Lane_active.end(), 1) != Lane_active.end())
+	{
+		//Sample rows used by the active lanes
+		Rows = 0;
+		for (unsigned int l = 0; l < Tile; l++)
+			if (Lane_active[l] && (Lane_rows[l] > Rows))
+				Rows = Lane_rows[l];
+		E_Step();
+		M_Step();
+		Check_Lanes(sites, next, loops);
+	}
+
+	return loops;
+}
+
+int Batch_EM::Load_Lane(unsigned int lane, Multi_Seq_Obj *site)
+{
+	vector<float> E_value;
+	vector<float> Init(Type, 0.0);
+
+	//Sites without samples or with a single sample are finished here
+	if (site->EM_Prepare(End, Step, E_value, Init) == 0)
+		return 0;
+
+	Lane_site[lane] = site;
+	Lane_loop[lane] = 0;
+	Lane_first[lane] = 1;
+	Lane_active[lane] = 1;
+	Count[lane] = site->Sample_Count;
+
+	//Row k holds covered sample k, the rows left from the previous site are cleared
+	unsigned int rows = (site->Sample_Count > Lane_rows[lane]) ? site->Sample_Count : Lane_rows[lane];
+	Lane_rows[lane] = site->Sample_Count;
+	for (unsigned int i = 0; i < rows; i++)
+	{
+		Seq_Obj *seq_obj = (i < site->Sample_Count) ? site->Seq_obj_s[i] : NULL;
+		Present[i * Tile + lane] = (seq_obj != NULL) ? 1.0 : 0.0;
+
+		for (unsigned int j = 0; j < Type; j++)
+		{
+			E[(i * Type + j) * Tile + lane] = (seq_obj != NULL) ? E_value[i * Type + j] : 0.0;
+			FS[(i * Type + j) * Tile + lane] = 0.0;
+		}
+
+		size_t n = (seq_obj != NULL) ? seq_obj->typeoneVec.size() : 0;
+		for (unsigned int a = 0; a < Grid; a++)
+		{
+			T1[(i * Grid + a) * Tile + lane] = (seq_obj != NULL) ? seq_obj->typeoneVec[Grid_index[a]] : 0.0;
+			T2[(i * Grid + a) * Tile + lane] = (seq_obj != NULL) ? seq_obj->typetwoVec[Grid_index[a]] : 0.0;
+			for (unsigned int b = 0; b < Grid; b++)
+				T3[(((size_t) i * Grid + a) * Grid + b) * Tile + lane] =
+						(seq_obj != NULL) ? seq_obj->typethreeVec[n * Grid_index[a] + Grid_index[b]] : 0.0;
+		}
+	}
+
+	for (unsigned int j = 0; j < Type; j++)
+	{
+		Init_value[j * Tile + lane] = Init[j];
+		Calc_value[j * Tile + lane] = 0.0;
+	}
+	Init_p[lane] = 0.0;
+	Init_p_2[lane] = 0.0;
+	Calc_p[lane] = 0.0;
+	Calc_p_2[lane] = 0.0;
+
+	return 1;
+}
+
+void Batch_EM::Store_Lane(unsigned int lane)
+{
+	vector<float> E_value(Lane_rows[lane] * Type, 0.0);
+	vector<float> Value(Type, 0.0);
+
+	for (unsigned int i = 0; i < Lane_rows[lane] * Type; i++)
+		E_value[i] = E[i * Tile + lane];
+	for (unsigned int j = 0; j < Type; j++)
+		Value[j] = Calc_value[j * Tile + lane];
+
+	Lane_site[lane]->EM_Finish(Value, E_value, Calc_p[lane], Calc_p_2[lane]);
+}
+
+void Batch_EM::E_Step()
+{
+	//Lanes that have had their first M-step
+	float update[MAX_TILE];
+	for (unsigned int l = 0; l < Tile; l++)
+		update[l] = (Lane_active[l] && !Lane_first[l]) ? 1.0 : 0.0;
+
+	for (unsigned int i = 0; i < Rows; i++)
+	{
+		float *present = &Present[i * Tile];
+		for (unsigned int j = 0; j < Type; j++)
+		{
+			float *e = &E[(i * Type + j) * Tile];
+			float *fs = &FS[(i * Type + j) * Tile];
+			float *init = &Init_value[j * Tile];
+			for (unsigned int l = 0; l < Tile; l++)
+			{
+				float value = math_exp(fs[l]) * init[l];
+				e[l] = ((update[l] != 0.0) && (present[l] != 0.0)) ? value : e[l];
+			}
+		}
+
+		//Matrix_Norm
+		double sum[MAX_TILE];
+		for (unsigned int l = 0; l < Tile; l++)
+			sum[l] = 0.0;
+		for (unsigned int j = 0; j < Type; j++)
+		{
+			float *e = &E[(i * Type + j) * Tile];
+			#pragma omp simd
+			for (unsigned int l = 0; l < Tile; l++)
+				sum[l] += e[l];
+		}
+		for (unsigned int j = 0; j < Type; j++)
+		{
+			float *e = &E[(i * Type + j) * Tile];
+			#pragma omp simd
+			for (unsigned int l = 0; l < Tile; l++)
+				e[l] = ((update[l] != 0.0) && (sum[l] != 0.0)) ? e[l] / sum[l] : e[l];
+		}
+	}
+
+	//Matrix_Ave
+	for (unsigned int j = 0; j < Type; j++)
+	{
+		double sum[MAX_TILE];
+		for (unsigned int l = 0; l < Tile; l++)
+			sum[l] = 0.0;
+		for (unsigned int i = 0; i < Rows; i++)
+		{
+			float *e = &E[(i * Type + j) * Tile];
+			#pragma omp simd
+			for (unsigned int l = 0; l < Tile; l++)
+				sum[l] += e[l];
+		}
+		float *calc = &Calc_value[j * Tile];
+		for (unsigned int l = 0; l < Tile; l++)
+			calc[l] = (update[l] != 0.0) ? sum[l] / Count[l] : calc[l];
+	}
+}
+
+void Batch_EM::M_Step()
+{
+	//Basic_EM for all lanes, summed over samples in the same order
+	isa->tile_sum(T1.data(), T2.data(), T3.data(), E.data(), Rows, Grid, Tile, Sum.data());
+
+	//Grid argmax
+	for (unsigned int l = 0; l < Tile; l++)
+	{
+		Sum_max[l] = MIN;
+		Best[l] = -1;
+	}
+	isa->tile_argmax(Sum.data(), Grid * Grid, Tile, Sum_max.data(), Best.data());
+
+	for (unsigned int l = 0; l < Tile; l++)
+	{
+		if (!Lane_active[l] || (Best[l] < 0))
+			continue;
+		unsigned int a = Best[l] / Grid;
+		unsigned int b = Best[l] % Grid;
+		Calc_p[l] = Grid_p[a];
+		Calc_p_2[l] = Grid_p[b];
+		for (unsigned int i = 0; i < Lane_rows[l]; i++)
+		{
+			FS[(i * Type + 0) * Tile + l] = T1[(i * Grid + a) * Tile + l];
+			FS[(i * Type + 1) * Tile + l] = T2[(i * Grid + b) * Tile + l];
+			FS[(i * Type + 2) * Tile + l] = T3[(((size_t) i * Grid + a) * Grid + b) * Tile + l];
+		}
+	}
+}
+
+void Batch_EM::Check_Lanes(vector<Multi_Seq_Obj*> &sites, unsigned int &next, int &loops)
+{
+	for (unsigned int l = 0; l < Tile; l++)
+	{
+		if (!Lane_active[l])
+			continue;
+
+		if (Lane_first[l])
+		{
+			Init_p[l] = Calc_p[l];
+			Init_p_2[l] = Calc_p_2[l];
+			Lane_first[l] = 0;
+			continue;
+		}
+
+		float diff = 0.0;
+		float temp = 0.0;
+		for (unsigned int j = 0; j < Type; j++)
+		{
+			temp = fabs(Init_value[j * Tile + l] - Calc_value[j * Tile + l]);
+			diff = (diff > temp) ? diff : temp;
+		}
+		temp = fabs(Init_p[l] - Calc_p[l]);
+		diff = (diff > temp) ? diff : temp;
+		temp = fabs(Init_p_2[l] - Calc_p_2[l]);
+		diff = (diff > temp) ? diff : temp;
+
+		for (unsigned int j = 0; j < Type; j++)
+			Init_value[j * Tile + l] = Calc_value[j * Tile + l];
+		Init_p[l] = Calc_p[l];
+		Init_p_2[l] = Calc_p_2[l];
+		Lane_loop[l]++;
+
+		if ((diff > Eps) && (Lane_loop[l] < MAX_LOOP))
+			continue;
+
+		//Converged, refill the lane
+		Store_Lane(l);
+		loops += Lane_loop[l];
+		stats.Add_Iterations(Lane_loop[l]);
+		Lane_active[l] = 0;
+		while ((next < sites.size()) && (Load_Lane(l, sites[next++]) == 0));
+	}
+}
@@ -0,0 +1,89 @@
+/*
+ * batch_em.h
+ *
+ * EM of a tile of sites run in lockstep. The per-site state is kept in
+ * structure-of-arrays form with the site (lane) index innermost, so the
+ * E-step, normalization, grid search and convergence check of all lanes
+ * are vector loops. A lane whose site converges is refilled with the next
+ * pending site. Sample rows hold the covered samples of each site, so
+ * the loops run to the widest lane rather than the cohort size, and the
+ * tables are sized by the widest site run so far. An engine is kept by
+ * its worker across batches (em_worker) and only grows. Results are the
+ * same as Multi_Seq_Obj::Calc_EM.
+ */
+#include <vector>
+#include "multi_seq_obj.h"
+
+#ifndef BATCH_EM_H
+#define BATCH_EM_H
+
+#define MAX_TILE 16
+//Upper bound of the transposed likelihood tables held by one engine
+#define BATCH_EM_TABLE_BYTES (256 * 1024 * 1024)
+
+using namespace std;
+
+class Batch_EM {
+public:
+	Batch_EM(unsigned int tile, unsigned int type, float end, float step, float eps);
+
+	int Run(vector<Multi_Seq_Obj*> &sites);
+
+	inline unsigned int Get_Tile()
+	{
+		return Tile;
+	}
+
+	inline bool Same(unsigned int tile, unsigned int type, float end, float step, float eps)
+	{
+		return (tile == Max_tile) && (type == Type) && (end == End) && (step == Step) && (eps == Eps);
+	}
+
+private:
+	unsigned int Max_tile;
+	unsigned int Tile;
+	unsigned int Sample;      //Rows the tables hold
+	unsigned int Type;
+	unsigned int Grid;
+	float End;
+	float Step;
+	float Eps;
+
+	//Basic_EM grid points and their table indices
+	vector<float> Grid_p;
+	vector<unsigned int> Grid_index;
+
+	vector<Multi_Seq_Obj*> Lane_site;
+	vector<int> Lane_loop;
+	vector<char> Lane_first;
+	vector<char> Lane_active;
+	vector<unsigned int> Lane_rows;
+	unsigned int Rows;        //Covered samples of the widest active lane
+
+	vector<float> Present;    //[sample][lane]
+	vector<float> Count;      //[lane]
+	vector<float> E;          //[sample][type][lane]
+	vector<float> FS;         //[sample][type][lane]
+	vector<float> Init_value; //[type][lane]
+	vector<float> Calc_value; //[type][lane]
+	vector<float> Init_p;
+	vector<float> Init_p_2;
+	vector<float> Calc_p;
+	vector<float> Calc_p_2;
+
+	vector<float> T1;         //[sample][p][lane]
+	vector<float> T2;         //[sample][p_2][lane]
+	vector<float> T3;         //[sample][p][p_2][lane]
+	vector<float> Sum;        //[p][p_2][lane]
+	vector<float> Sum_max;
+	vector<int> Best;
+
+	void Reserve(unsigned int rows);
+	int Load_Lane(unsigned int lane, Multi_Seq_Obj *site);
+	void Store_Lane(unsigned int lane);
+	void E_Step();
+	void M_Step();
+	void Check_Lanes(vector<Multi_Seq_Obj*> &sites, unsigned int &next, int &loops);
+};
+
+#endif
@@ -0,0 +1,341 @@
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <zlib.h>
+#include "bcf_writer.h"
+
+//Header dictionary, PASS is always 0
+#define BCF_PASS 0
+#define BCF_NS 1
+#define BCF_P0 2
+#define BCF_P1 3
+#define BCF_MV 4
+#define BCF_LFDR 5
+#define BCF_GT 6
+#define BCF_GM 7
+#define BCF_DP 8
+
+#define BCF_INT8 1
+#define BCF_INT16 2
+#define BCF_INT32 3
+#define BCF_FLOAT 5
+#define BCF_CHAR 7
+
+#define BCF_INT8_MISSING ((int8_t) 0x80)
+
+//Values are written little endian, as BCF requires
+static inline void Put_Bytes(string &out, const void *data, size_t length)
+{
+	out.append((const char *) data, length);
+}
+
+static inline void Put_Int32(string &out, int32_t value)
+{
+	Put_Bytes(out, &value, 4);
+}
+
+static inline void Put_Float(string &out, float value)
+{
+	Put_Bytes(out, &value, 4);
+}
+
+static inline void Put_Type(string &out, int type, int count)
+{
+	if (count < 15)
+		out += (char) ((count << 4) | type);
+	else
+	{
+		out += (char) ((15 << 4) | type);
+		if (count <= 127)
+		{
+			out += (char) ((1 << 4) | BCF_INT8);
+			out += (char) count;
+		}
+		else
+		{
+			out += (char) ((1 << 4) | BCF_INT32);
+			Put_Int32(out, count);
+		}
+	}
+}
+
+static inline void Put_Typed_Int(string &out, int32_t value)
+{
+	if ((value > -120) && (value <= 127))
+	{
+		Put_Type(out, BCF_INT8, 1);
+		out += (char) value;
+	}
+	else
+	{
+		Put_Type(out, BCF_INT32, 1);
+		Put_Int32(out, value);
+	}
+}
+
+static inline void Put_Typed_String(string &out, const string &value)
+{
+	Put_Type(out, BCF_CHAR, value.size());
+	out += value;
+}
+
+static inline void Put_Typed_Floats(string &out, const float *values, int count)
+{
+	Put_Type(out, BCF_FLOAT, count);
+	Put_Bytes(out, values, count * 4);
+}
+
+Bgzf_Writer::Bgzf_Writer(ostream &out) : Out(out)
+{
+	Block.reserve(BGZF_BLOCK_SIZE);
+	this->Failed = false;
+}
+
+int Bgzf_Writer::Write(const char *data, size_t length)
+{
+	if (Failed)
+		return -1;
+	while (length > 0)
+	{
+		size_t part = BGZF_BLOCK_SIZE - Block.size();
+		part = (part < length) ? part : length;
+		Block.append(data, part);
+		data += part;
+		length -= part;
+		if ((Block.size() == BGZF_BLOCK_SIZE) && (Flush_Block() != 0))
+			return -1;
+	}
+	return 0;
+}
+
+int Bgzf_Writer::Flush_Block()
+{
+	if (Block.empty())
+		return 0;
+
+	unsigned char compressed[BGZF_BLOCK_SIZE + 1024];
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		cerr << "BGZF compression error" << endl;
+		Failed = true;
+		return -1;
+	}
+	zs.next_in = (Bytef *) Block.data();
+	zs.avail_in = Block.size();
+	zs.next_out = compressed + 18;
+	zs.avail_out = sizeof(compressed) - 18 - 8;
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+	{
+		cerr << "BGZF compression error" << endl;
+		deflateEnd(&zs);
+		Failed = true;
+		return -1;
+	}
+	size_t block_size = 18 + zs.total_out + 8;
+	deflateEnd(&zs);
+
+	//gzip member header with the BC extra field holding the block size
+	const unsigned char header[16] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0};
+	memcpy(compressed, header, 16);
+	uint16_t bsize = block_size - 1;
+	memcpy(compressed + 16, &bsize, 2);
+	uint32_t crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *) Block.data(), Block.size());
+	uint32_t isize = Block.size();
+	memcpy(compressed + block_size - 8, &crc, 4);
+	memcpy(compressed + block_size - 4, &isize, 4);
+
+	Out.write((const char *) compressed, block_size);
+	Block.clear();
+	if (!Out)
+	{
+		Failed = true;
+		return -1;
+	}
+	return 0;
+}
+
+int Bgzf_Writer::Close()
+{
+	if (Failed || (Flush_Block() != 0))
+		return -1;
+	//Empty end-of-file block
+	const unsigned char eof[28] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	Out.write((const char *) eof, 28);
+	Out.flush();
+	return Out ? 0 : -1;
+}
+
+Bcf_Writer::Bcf_Writer(const string &filename, unsigned int samples)
+{
+	this->Filename = filename;
+	this->Records_name = filename + ".records.tmp";
+	this->Samples = samples;
+}
+
+int Bcf_Writer::Add_Contig(const string &name)
+{
+	map<string, int>::iterator it = Contig_index.find(name);
+	if (it != Contig_index.end())
+		return it->second;
+	int id = Contigs.size();
+	Contig_index[name] = id;
+	Contigs.push_back(name);
+	return id;
+}
+
+void Bcf_Writer::Encode(string &out, Multi_Seq_Obj *mso, const string &chrom, unsigned int pos,
+		const string &ref, const vector<int> &depth)
+{
+	string shared;
+	string indiv;
+	float w = mso->Get_W();
+
+	//Same allele test as the Ti/Tv count of output_values
+	char alt = mso->Get_Max_Allele();
+	bool has_alt = (alt != 'N') && (alt != toupper(ref[0]));
+
+	Put_Int32(shared, Contig_index.find(chrom)->second);
+	Put_Int32(shared, pos - 1);
+	Put_Int32(shared, ref.size());
+	Put_Float(shared, (w < pow(10, -100)) ? 999.999 : -10 * log(w));
+	Put_Int32(shared, ((has_alt ? 2 : 1) << 16) | 5);
+	Put_Int32(shared, (3 << 24) | Samples);
+
+	Put_Type(shared, BCF_CHAR, 0);
+	Put_Typed_String(shared, ref);
+	if (has_alt)
+		Put_Typed_String(shared, string(1, alt));
+	Put_Type(shared, BCF_INT8, 1);
+	shared += (char) BCF_PASS;
+
+	float p[2] = {mso->Get_P(0), mso->Get_P(1)};
+	float value[3] = {mso->Get_Value(0), mso->Get_Value(1), mso->Get_Value(2)};
+	Put_Typed_Int(shared, BCF_NS);
+	Put_Typed_Int(shared, mso->Get_Sample_Count());
+	Put_Typed_Int(shared, BCF_P0);
+	Put_Typed_Floats(shared, &p[0], 1);
+	Put_Typed_Int(shared, BCF_P1);
+	Put_Typed_Floats(shared, &p[1], 1);
+	Put_Typed_Int(shared, BCF_MV);
+	Put_Typed_Floats(shared, value, 3);
+	Put_Typed_Int(shared, BCF_LFDR);
+	Put_Typed_Floats(shared, &w, 1);
+
+	//GT from the genotype model, RR 0/0, NN 1/1, RN 0/1, haploid sites R 0 and N 1
+	int ploidy = (mso->Get_Type() == 2) ? 1 : 2;
+	Put_Typed_Int(indiv, BCF_GT);
+	Put_Type(indiv, BCF_INT8, ploidy);
+	for (unsigned int i = 0; i < Samples; i++)
+	{
+		int model = mso->Get_E_Value_Max(i);
+		if ((model == 0) || ((model > 0) && has_alt))
+		{
+			indiv += (char) (((model == 1) ? 2 : 1) << 1);
+			if (ploidy == 2)
+				indiv += (char) (((model == 0) ? 1 : 2) << 1);
+		}
+		else
+		{
+			indiv += (char) 0;
+			if (ploidy == 2)
+				indiv += (char) 0;
+		}
+	}
+
+	Put_Typed_Int(indiv, BCF_GM);
+	Put_Type(indiv, BCF_INT8, 1);
+	for (unsigned int i = 0; i < Samples; i++)
+	{
+		int model = mso->Get_E_Value_Max(i);
+		indiv += (model < 0) ? (char) BCF_INT8_MISSING : (char) (model + 1);
+	}
+
+	Put_Typed_Int(indiv, BCF_DP);
+	Put_Type(indiv, BCF_INT32, 1);
+	for (unsigned int i = 0; i < Samples; i++)
+		Put_Int32(indiv, (i < depth.size()) ? depth[i] : 0);
+
+	Put_Int32(out, shared.size());
+	Put_Int32(out, indiv.size());
+	out += shared;
+	out += indiv;
+}
+
+string Bcf_Writer::Header_Text()
+{
+	time_t rawtime;
+	struct tm * timeinfo;
+	char buffer [9];
+	time(&rawtime);
+	timeinfo = localtime(&rawtime);
+	strftime(buffer, 9, "%Y%m%d", timeinfo);
+
+	stringstream out;
+	out << "##fileformat=VCFv4.2\n";
+	out << "##fileDate=" << buffer << "\n";
+	out << "##source=multiGeMSV2.0\n";
+	out << "##reference=UNKNOWN\n";
+	out << "##FILTER=<ID=PASS,Description=\"All filters passed\",IDX=" << BCF_PASS << ">\n";
+	out << "##INFO=<ID=NS,Number=1,Type=Integer,Description=\"Number of samples analyzed\",IDX=" << BCF_NS << ">\n";
+	out << "##INFO=<ID=P0,Number=1,Type=Float,Description=\"Error rate estimate P0\",IDX=" << BCF_P0 << ">\n";
+	out << "##INFO=<ID=P1,Number=1,Type=Float,Description=\"Error rate estimate P1\",IDX=" << BCF_P1 << ">\n";
+	out << "##INFO=<ID=MV,Number=3,Type=Float,Description=\"Genotype model proportions of RR, NN and RN\",IDX=" << BCF_MV << ">\n";
+	out << "##INFO=<ID=LFDR,Number=1,Type=Float,Description=\"Estimated lFDR of the site\",IDX=" << BCF_LFDR << ">\n";
+	out << "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\",IDX=" << BCF_GT << ">\n";
+	out << "##FORMAT=<ID=GM,Number=1,Type=Integer,Description=\"Genotype model, 1 RR, 2 NN, 3 RN\",IDX=" << BCF_GM << ">\n";
+	out << "##FORMAT=<ID=DP,Number=1,Type=Integer,Description=\"Pileup depth\",IDX=" << BCF_DP << ">\n";
+	for (unsigned int i = 0; i < Contigs.size(); i++)
+		out << "##contig=<ID=" << Contigs[i] << ">\n";
+	out << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT";
+	for (unsigned int i = 0; i < Samples; i++)
+		out << "\t" << i;
+	out << "\n";
+	return out.str();
+}
+
+int Bcf_Writer::Finish()
+{
+	ofstream output_file(Filename, ios::out | ios::binary);
+	if (!output_file)
+	{
+		cerr << "Open outfile error : " << Filename << endl;
+		return -1;
+	}
+	ifstream records(Records_name, ios::in | ios::binary);
+	if (!records)
+	{
+		cerr << "Open record file error : " << Records_name << endl;
+		return -1;
+	}
+
+	Bgzf_Writer bgzf(output_file);
+	string text = Header_Text();
+	uint32_t text_length = text.size() + 1;
+	int failed = bgzf.Write("BCF\2\2", 5);
+	failed |= bgzf.Write((const char *) &text_length, 4);
+	failed |= bgzf.Write(text.c_str(), text_length);
+
+	vector<char> buffer(1 << 20);
+	while (records && (failed == 0))
+	{
+		records.read(&buffer[0], buffer.size());
+		failed |= bgzf.Write(&buffer[0], records.gcount());
+	}
+	if (records.bad())
+	{
+		cerr << "Read record file error : " << Records_name << endl;
+		failed = -1;
+	}
+	records.close();
+	remove(Records_name.c_str());
+
+	if ((failed != 0) || (bgzf.Close() != 0))
+		return -1;
+	return 0;
+}
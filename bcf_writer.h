@@ -0,0 +1,63 @@
+/*
+ * bcf_writer.h
+ *
+ * BCF2.2 output with BGZF compression. Records are encoded into plain
+ * buffers (so they can go through Output_Writer to a temporary record
+ * file) and Finish() writes the header, which needs every contig seen,
+ * followed by the records as BGZF blocks.
+ */
+#include <ostream>
+#include <string>
+#include <vector>
+#include <map>
+#include "multi_seq_obj.h"
+
+#ifndef BCF_WRITER_H
+#define BCF_WRITER_H
+
+//Uncompressed bytes per BGZF block, as in htslib
+#define BGZF_BLOCK_SIZE 0xff00
+
+using namespace std;
+
+class Bgzf_Writer {
+public:
+	Bgzf_Writer(ostream &out);
+
+	//Returns -1 once a block could not be compressed or written, nothing more is written after
+	int Write(const char *data, size_t length);
+	int Close();
+
+private:
+	ostream &Out;
+	string Block;
+	bool Failed;
+
+	int Flush_Block();
+};
+
+class Bcf_Writer {
+public:
+	Bcf_Writer(const string &filename, unsigned int samples);
+
+	inline const string &Get_Records_Name()
+	{
+		return Records_name;
+	}
+
+	int Add_Contig(const string &name);
+	void Encode(string &out, Multi_Seq_Obj *mso, const string &chrom, unsigned int pos,
+			const string &ref, const vector<int> &depth);
+	int Finish();
+
+private:
+	string Filename;
+	string Records_name;
+	unsigned int Samples;
+	map<string, int> Contig_index;
+	vector<string> Contigs;
+
+	string Header_Text();
+};
+
+#endif
@@ -0,0 +1,301 @@
+/*
+ * bench.cpp
+ *
+ * Kernel micro-benchmarks, built and run by "make bench".
+ * Pileup lines are generated deterministically so the numbers are comparable
+ * between builds. Arguments are depth, samples and 1/step (and the
+ * --fast-math-level and --isa path for pre_Calc_Value); every benchmark reports time_per_site
+ * and reads_per_second, Tokenizer also the heap allocations per parsed line.
+ *
+ * Filter arguments, e.g. ./multigems_bench --benchmark_filter=Basic_EM
+ */
+#include <random>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <benchmark/benchmark.h>
+#include "core_functions.h"
+#include "synthetic_pileup.h"
+
+using namespace std;
+
+//Access to the private EM kernels
+class Kernel_Bench {
+public:
+	static int Prepare(Multi_Seq_Obj *mso, vector<float> &E_value, vector<float> &Init_value)
+	{
+		return mso->EM_Prepare(params.end_condition, params.step, E_value, Init_value);
+	}
+
+	static void Basic_EM(Multi_Seq_Obj *mso, vector<float> &FS_value, vector<float> &E_value, float &p, float &p_2)
+	{
+		mso->Basic_EM(FS_value, E_value, params.end_condition, params.step, p, p_2);
+	}
+};
+
+//Heap allocations of the whole process, for allocations_per_site
+//new and delete are replaced together, sized and unsized, so every pair goes through malloc and free.
+//Not inlined, so gcc does not see free() called on what a new expression returned
+static atomic<unsigned long> heap_allocations(0);
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+	heap_allocations.fetch_add(1, memory_order_relaxed);
+	void *p = malloc(size ? size : 1);
+	if (p == NULL)
+		throw bad_alloc();
+	return p;
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	operator delete(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	operator delete(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+	operator delete(p);
+}
+
+//Objects rebuilt per timed round, so the per-round setup outside the timer is amortized
+#define BENCH_ROUND 32
+
+static void bench_params(int samples, int inverse_step)
+{
+	default_parameters(params);
+	params.sample_count = samples;
+	params.step = 1.0f / inverse_step;
+}
+
+//Samples cycle through the RN, NN and RR genotypes so every sample count has a variant
+static void make_sample(mt19937 &rng, int sample, char alt, int depth, string &bases, string &bq, string &mq)
+{
+	static const float genotypes[3] = {0.5, 1.0, 0.0};
+	synthetic_sample(rng, genotypes[sample % 3], alt, depth, bases, bq, mq);
+}
+
+static string make_line(int samples, int depth, unsigned seed)
+{
+	mt19937 rng(seed);
+	string line = "chr1\t1000\tA";
+	string bases, bq, mq;
+	for (int i = 0; i < samples; i++)
+	{
+		make_sample(rng, i, 'G', depth, bases, bq, mq);
+		line += "\t" + to_string(depth) + "\t" + bases + "\t" + bq + "\t" + mq;
+	}
+	return line;
+}
+
+static Seq_Obj make_seq_obj(mt19937 &rng, int sample, int depth)
+{
+	string bases, bq, mq;
+	make_sample(rng, sample, 'G', depth, bases, bq, mq);
+	return Seq_Obj(intern_contig("chr1"), 1000, 'A', depth, bases, bq, mq, params.type, params.step, params.end_condition);
+}
+
+static Seq_Obj filtered_seq_obj(mt19937 &rng, int sample, int depth)
+{
+	Seq_Obj seq_obj = make_seq_obj(rng, sample, depth);
+	seq_obj.Seq_Init_Filter();
+	seq_obj.Seq_Qual_Filter(params.bp, params.mp);
+	seq_obj.Seq_Max_Filter(params.max_count);
+	return seq_obj;
+}
+
+//A site with every sample inserted, without the candidate coverage rule of parse_site
+static Multi_Seq_Obj *make_site(int samples, int depth)
+{
+	mt19937 rng(1);
+	Multi_Seq_Obj *mso = new Multi_Seq_Obj(samples, params.type);
+	for (int i = 0; i < samples; i++)
+	{
+		mso->Insert(new Seq_Obj(filtered_seq_obj(rng, i, depth)), i);
+		mso->Enable();
+	}
+	return mso;
+}
+
+//time_per_site is printed with an SI prefix, e.g. 350ns
+static void set_counters(benchmark::State &state, long sites, long reads)
+{
+	state.counters["time_per_site"] = benchmark::Counter(sites, benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+	state.counters["reads_per_second"] = benchmark::Counter(reads, benchmark::Counter::kIsRate);
+}
+
+/*
+ * Per sample kernels, arguments {depth, 1/step}, pre_Calc_Value adds the math level
+ */
+
+static void BM_Seq_Init_Filter(benchmark::State &state)
+{
+	bench_params(1, state.range(1));
+	mt19937 rng(1);
+	Seq_Obj prototype = make_seq_obj(rng, 0, state.range(0));
+	vector<Seq_Obj> round(BENCH_ROUND);
+	long sites = 0;
+	for (auto _ : state)
+	{
+		state.PauseTiming();
+		round.assign(BENCH_ROUND, prototype);
+		state.ResumeTiming();
+		for (int i = 0; i < BENCH_ROUND; i++)
+			benchmark::DoNotOptimize(round[i].Seq_Init_Filter());
+		sites += BENCH_ROUND;
+	}
+	set_counters(state, sites, sites * state.range(0));
+}
+
+static void BM_Seq_Qual_Filter(benchmark::State &state)
+{
+	bench_params(1, state.range(1));
+	mt19937 rng(1);
+	Seq_Obj prototype = make_seq_obj(rng, 0, state.range(0));
+	prototype.Seq_Init_Filter();
+	vector<Seq_Obj> round(BENCH_ROUND);
+	long sites = 0;
+	for (auto _ : state)
+	{
+		state.PauseTiming();
+		round.assign(BENCH_ROUND, prototype);
+		state.ResumeTiming();
+		for (int i = 0; i < BENCH_ROUND; i++)
+			benchmark::DoNotOptimize(round[i].Seq_Qual_Filter(params.bp, params.mp));
+		sites += BENCH_ROUND;
+	}
+	set_counters(state, sites, sites * state.range(0));
+}
+
+static void BM_Calc_Value(benchmark::State &state)
+{
+	bench_params(1, state.range(1));
+	mt19937 rng(1);
+	Seq_Obj seq_obj = filtered_seq_obj(rng, 0, state.range(0));
+	long sites = 0;
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(seq_obj.Calc_Value(params.end_condition, params.step));
+		sites++;
+	}
+	set_counters(state, sites, sites * seq_obj.Get_Ref_Length());
+}
+
+static const char *Bench_isa[] = {"generic", "sse4.2", "avx2", "avx512"};
+
+static void BM_pre_Calc_Value(benchmark::State &state)
+{
+	bench_params(1, state.range(1));
+	if (isa_select(Bench_isa[state.range(3)]) != 0)
+	{
+		state.SkipWithError("instruction set not supported");
+		return;
+	}
+	math_select(state.range(2), false);
+	mt19937 rng(1);
+	Seq_Obj seq_obj = filtered_seq_obj(rng, 0, state.range(0));
+	seq_obj.Calc_Value(params.end_condition, params.step);
+	long sites = 0;
+	for (auto _ : state)
+	{
+		seq_obj.pre_Calc_Value();
+		sites++;
+	}
+	set_counters(state, sites, sites * seq_obj.Get_Ref_Length());
+	math_select(0, false);
+	isa_select("auto");
+}
+
+/*
+ * Per site kernels, arguments {depth, samples, 1/step}
+ */
+
+static void BM_Tokenizer(benchmark::State &state)
+{
+	bench_params(state.range(1), state.range(2));
+	string line = make_line(state.range(1), state.range(0), 1);
+	site_record record;
+	Site_Arena arena;
+	//The first line sizes the scratch buffers and the arena blocks, later lines reuse them
+	parse_site(line, record, &arena);
+	arena.Reset();
+	unsigned long allocations = heap_allocations.load();
+	long sites = 0;
+	for (auto _ : state)
+	{
+		parse_site(line, record, &arena);
+		arena.Reset();
+		sites++;
+	}
+	set_counters(state, sites, sites * state.range(0) * state.range(1));
+	state.counters["allocations_per_site"] = (double) (heap_allocations.load() - allocations) / sites;
+}
+
+static void BM_Basic_EM(benchmark::State &state)
+{
+	bench_params(state.range(1), state.range(2));
+	Multi_Seq_Obj *mso = make_site(state.range(1), state.range(0));
+	vector<float> E_value, Init_value(params.type, 0.0);
+	Kernel_Bench::Prepare(mso, E_value, Init_value);
+	vector<float> FS_value(E_value.size(), 0.0);
+	float p = 0.0, p_2 = 0.0;
+	long sites = 0;
+	for (auto _ : state)
+	{
+		Kernel_Bench::Basic_EM(mso, FS_value, E_value, p, p_2);
+		benchmark::DoNotOptimize(p);
+		sites++;
+	}
+	delete mso;
+	set_counters(state, sites, sites * state.range(0) * state.range(1));
+}
+
+static void BM_Calc_EM(benchmark::State &state)
+{
+	bench_params(state.range(1), state.range(2));
+	Multi_Seq_Obj *mso = make_site(state.range(1), state.range(0));
+	//Calc_EM starts from the sample tables every time, so the site can be reused
+	mso->Calc_EM(params.end_condition, params.step, params.eps);
+	long sites = 0;
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(mso->Calc_EM(params.end_condition, params.step, params.eps));
+		sites++;
+	}
+	delete mso;
+	set_counters(state, sites, sites * state.range(0) * state.range(1));
+}
+
+//Depth x samples grid, capped at 10000 reads per site
+static void site_grid(benchmark::internal::Benchmark *b)
+{
+	for (int depth : {10, 100, 1000})
+		for (int samples : {1, 10, 100, 1000})
+			for (int inverse_step : {100, 200})
+				if ((long) depth * samples <= 10000)
+					b->Args({depth, samples, inverse_step});
+}
+
+BENCHMARK(BM_Seq_Init_Filter)->ArgsProduct({{10, 100, 1000}, {100}});
+BENCHMARK(BM_Seq_Qual_Filter)->ArgsProduct({{10, 100, 1000}, {100}});
+BENCHMARK(BM_Calc_Value)->ArgsProduct({{10, 100, 1000}, {100, 200, 1000}});
+BENCHMARK(BM_pre_Calc_Value)->ArgsProduct({{10, 100, 1000}, {100, 200}, {0, 1, 2}, {0, 1, 2, 3}});
+BENCHMARK(BM_Tokenizer)->ArgsProduct({{10, 100, 1000}, {1, 10, 100}, {100}});
+BENCHMARK(BM_Basic_EM)->Apply(site_grid);
+BENCHMARK(BM_Calc_EM)->Apply(site_grid);
+
+BENCHMARK_MAIN();
@@ -12,14 +12,18 @@
 #include <memory>
 #include <queue>
 #include <array>
+#include <atomic>
 
 #include <omp.h>
 
 #include "core_functions.h"
+#include "evidence_store.h"
+#include "bam_pileup.h"
+#include "table_cache.h"
 
 using namespace std;
 
-map<unsigned int, shared_ptr<Multi_Seq_Obj>> pos_samples_map;
+map<unsigned int, unique_ptr<Multi_Seq_Obj>> pos_samples_map;
 Parameters params;
 
 int printhelp(){
@@ -102,7 +106,7 @@ int Get_Name_List(const string &listname, vector<string> &infilename)
 int calculate_values(double end)
 {
 	int count = 0;
-	for (map<unsigned int, shared_ptr<Multi_Seq_Obj>>::iterator it = pos_samples_map.begin(); it != pos_samples_map.end(); it++)
+	for (map<unsigned int, unique_ptr<Multi_Seq_Obj>>::iterator it = pos_samples_map.begin(); it != pos_samples_map.end(); it++)
 	{
 		count++;
 		it->second.get()->Calc_EM(end, params.step, params.eps);
@@ -113,26 +117,195 @@ int calculate_values(double end)
 
 int calculate_values_omp(double end, int thread)
 {
+	vector<Multi_Seq_Obj*> sites;
+	for (map<unsigned int, unique_ptr<Multi_Seq_Obj>>::iterator it = pos_samples_map.begin(); it != pos_samples_map.end(); it++)
+	{
+		if (params.debug) {
+			cout << it->first << endl << endl;
+		}
+		sites.push_back(it->second.get());
+	}
+
+	vector<em_worker> workers(thread);
+	calculate_sites(sites, end, thread, workers);
+
+	return sites.size();
+}
+
+//The defaults of multigems, an Engine takes a copy after the fields it changes
+void default_parameters(Parameters &p)
+{
+	p.debug = false;
+	p.reference = false;
+	p.tile = 0;
+	p.output_type = 'v';
+	p.stats_batch = false;
+	p.progress_interval = 0;
+	p.mem_budget = 0;
+	p.fast_math_level = 0;
+	p.fast_math_verify = false;
+	p.isa = "auto";
+	p.wide_site = 0;
+	p.table_cache_bytes = 0;
+	p.prune = false;
+	p.screen_margin = 0;
+	p.screen_verify = false;
+	p.coarse_step = 0;
+	p.refine_band = 0.35;
+	p.store_samples = 0;
+	p.sample_count = 3;
+	p.type = 3; //polidy
+	p.max_count = 255; //Max allele count
+	p.thread = 1;
+	p.ratio_nchar = 0.1;
+	p.ratio_del = 0.5;
+	p.step = 0.01; //Steps
+	p.eps = 0.001;
+	p.p_snp = 0.1;
+	//lFDR output filter, only sites with an estimated lFDR below it are output, 1 outputs all analyzed sites
+	p.result_filter = 0.5;
+	p.one_circle_limit = 200;
+	p.end_condition = 0.5;
+	p.bp = 17;
+	p.mp = 20;
+	p.min = 1;
+	p.max = 200;
+	p.start_position = 16691745;
+}
+
+//The reference run keeps to the scalar site by site kernels, every fast path is switched off here
+void reference_parameters(Parameters &p)
+{
+	p.reference = true;
+	p.tile = 0;
+	p.fast_math_level = 0;
+	p.isa = "generic";
+	p.wide_site = 0;
+	p.table_cache_bytes = 0;
+	p.prune = false;
+	p.screen_margin = 0;
+	p.screen_verify = false;
+	p.coarse_step = 0;
+}
+
+//Math level, vector kernels and table cache, which every site of the process shares
+void kernel_select(const Parameters &p)
+{
+	math_select(p.fast_math_level, p.fast_math_verify);
+	isa_select(p.isa);
+	table_cache.Set_Capacity(p.table_cache_bytes);
+}
+
+//EM of the sites on one grid step
+static int run_sites(const Parameters &p, vector<Multi_Seq_Obj*> &all_sites, double end, float step, int thread, vector<em_worker> &workers)
+{
+	int loops = 0;
+
+	//Sites with at least --wide-site reads over their samples split their own EM across the threads,
+	//the others share the threads site by site
+	vector<Multi_Seq_Obj*> narrow, wide;
+	bool split = (p.wide_site > 0) && (thread > 1);
+	if (split)
+		for (Multi_Seq_Obj *site : all_sites)
+		{
+			if ((unsigned long) site->Get_Load() >= p.wide_site)
+				wide.push_back(site);
+			else
+				narrow.push_back(site);
+		}
+	vector<Multi_Seq_Obj*> &sites = split ? narrow : all_sites;
+	int count = sites.size();
+
+	//Tiles hold the RN table, so haploid sites run one at a time
+	if ((p.tile > 0) && (p.type == 3))
+	{
+		//Each thread runs its own engine over a contiguous share of the sites, the engine of the grid step
+		//is kept by the thread's worker for the next batch
+		#pragma omp parallel reduction(+:loops)
+		{
+			long share = omp_get_num_threads();
+			long id = omp_get_thread_num();
+			vector<Multi_Seq_Obj*> share_sites(sites.begin() + count * id / share, sites.begin() + count * (id + 1) / share);
+			vector<shared_ptr<Batch_EM>> &engines = workers[id].engines;
+			unsigned int k = 0;
+			while ((k < engines.size()) && !engines[k]->Same(p.tile, p.type, end, step, p.eps))
+				k++;
+			if (k == engines.size())
+				engines.push_back(make_shared<Batch_EM>(p.tile, p.type, end, step, p.eps));
+			loops += engines[k]->Run(share_sites);
+		}
+	}
+	else
+	{
+		#pragma omp parallel for schedule(dynamic) reduction(+:loops)
+		for (int i = 0; i < count; i++)
+			loops += sites[i]->Calc_EM(end, step, p.eps);
+	}
+
+	for (Multi_Seq_Obj *site : wide)
+	{
+		site->Set_Threads(thread);
+		loops += site->Calc_EM(end, step, p.eps);
+		site->Set_Threads(1);
+	}
+
+	return loops;
+}
+
+int calculate_sites(vector<Multi_Seq_Obj*> &all_sites, double end, int thread, vector<em_worker> &workers)
+{
+	kernel_select(params);
+	return calculate_sites(params, all_sites, end, thread, workers);
+}
+
+//The sites hold p (Set_Parameters), the kernels are those selected last
+int calculate_sites(const Parameters &p, vector<Multi_Seq_Obj*> &all_sites, double end, int thread, vector<em_worker> &workers)
+{
+	int loops = 0;
 	omp_set_num_threads(thread);
-	unsigned int pos_list[pos_samples_map.size()];
-	int count = 0;
-	for (map<unsigned int, shared_ptr<Multi_Seq_Obj>>::iterator it = pos_samples_map.begin(); it != pos_samples_map.end(); it++)
+
+	//With --coarse-step every site runs on the coarse grid first, and only the sites whose W lands
+	//below -f plus --refine-band run again on the -s grid. The coarse W of a call can be far off on
+	//either side: down to 0 below the output range, and measured up to 0.33 above it at step 0.05
+	if (p.coarse_step > p.step)
 	{
-		pos_list[count] = it->first;
-		count++;
+		for (Multi_Seq_Obj *site : all_sites)
+			site->Set_Step(p.coarse_step, true);
+		loops += run_sites(p, all_sites, end, p.coarse_step, thread, workers);
+
+		vector<Multi_Seq_Obj*> refine;
+		for (Multi_Seq_Obj *site : all_sites)
+		{
+			float w = site->Calc_W(2, 200);
+			if (w < p.result_filter + p.refine_band)
+			{
+				site->Set_Step(p.step, false);
+				refine.push_back(site);
+			}
+		}
+		stats.Add(COUNT_SITE_REFINED, refine.size());
+		loops += run_sites(p, refine, end, p.step, thread, workers);
 	}
+	else
+		loops += run_sites(p, all_sites, end, p.step, thread, workers);
 
-	#pragma omp parallel for schedule(dynamic)
+	int count = all_sites.size();
+	#pragma omp parallel for schedule(static)
 	for (int i = 0; i < count; i++)
 	{
-		if (params.debug) {
-			cout << pos_list[i] << endl << endl;
+		Multi_Seq_Obj *site = all_sites[i];
+		site->Calc_W(2, 200);
+		if (p.screen_verify && (site->Get_W() > 0.1) && (site->Get_W() < p.result_filter))
+		{
+			stats.Add(COUNT_SCREEN_CALLS);
+			if (site->Get_Screened())
+			{
+				stats.Add(COUNT_SCREEN_MISSED);
+			}
 		}
-		pos_samples_map[pos_list[i]].get()->Calc_EM(end, params.step, params.eps);
-		pos_samples_map[pos_list[i]].get()->Calc_W(2, 200);
 	}
 
-	return count;
+	return loops;
 }
 
 int String_Split(const string &buffer, array<string, 7> &obj, int n)
@@ -166,6 +339,11 @@ void calculate_preprocess(const vector<string> &infilename, string &outfilename)
 		exit(0);
 	}
 
+	long total_bytes = 0;
+	for (int i = 0; i < params.sample_count; i++)
+		total_bytes += file_size(infilename[i]);
+	progress.Start(params.progress_interval, params.progress_file, total_bytes);
+
 	//Let us circle
 	core_calculate(ifstream_array, buffer_queue, output_file);
 
@@ -197,15 +375,66 @@ void output_header(ofstream &out)
 	    << "QUAL" << "\t" << "FILTER" << "\t" << "INFO" << endl;
 }
 
+long file_size(const string &filename)
+{
+	ifstream in(filename, ios::in | ios::binary | ios::ate);
+	return in ? (long) in.tellg() : 0;
+}
+
+//Byte count with an optional K, M or G suffix
+unsigned long long parse_bytes(const string &value)
+{
+	size_t end = 0;
+	double bytes = stod(value, &end);
+	switch ((end < value.size()) ? toupper(value[end]) : 'B')
+	{
+		case 'G':
+			bytes *= 1024;
+		case 'M':
+			bytes *= 1024;
+		case 'K':
+			bytes *= 1024;
+		case 'B':
+			break;
+		default:
+			cerr << "Unrec byte count : " << value << endl;
+			exit(0);
+	}
+	return (bytes > 0) ? (unsigned long long) bytes : 0;
+}
+
+void screen_report(ostream &out)
+{
+	unsigned long long calls = stats.Get(COUNT_SCREEN_CALLS);
+	unsigned long long missed = stats.Get(COUNT_SCREEN_MISSED);
+	out << "Screen missed " << missed << " of " << calls << " calls (false negative rate "
+	    << ((calls > 0) ? (double) missed / calls : 0) << ")" << endl;
+}
+
+void stats_report(long batch)
+{
+	static bool started = false;
+	if (!stats.Enabled())
+		return;
+	ofstream out(params.stats_file, started ? ios::app : ios::out);
+	started = true;
+	if (!out)
+	{
+		cerr << "Open stats file error : " << params.stats_file << endl;
+		return;
+	}
+	stats.Report(out, batch);
+}
+
 void core_calculate(ifstream* ifstream_array, vector<queue<string>> &buffer_queue, ofstream &output_file)
 {
 	srand((int)time(NULL));
 	vector<unsigned int> count_vector(params.sample_count, 0);
-	cout << "Sample number : " << params.sample_count << endl;
 	vector<bool> queue_flag(params.sample_count, true);
 	int true_flag_count = params.sample_count;
 
 	output_header(output_file);
+	Output_Writer writer(output_file);
 
 	int circle_count = 0;
 	while (true_flag_count > 0)
@@ -227,7 +456,6 @@ void core_calculate(ifstream* ifstream_array, vector<queue<string>> &buffer_queu
 
 		if (true_flag_count != 0)
 			checkin_limit = min_last_element(buffer_queue);
-		cout << "checkin_limit = " << checkin_limit << endl;
 		for (int i = 0; i < params.sample_count; i++)
 		{
 			if (buffer_queue[i].size() > 0)
@@ -238,18 +466,25 @@ void core_calculate(ifstream* ifstream_array, vector<queue<string>> &buffer_queu
 
 		}
 
-		cout << endl << ++circle_count << " Loading finished" << endl;
-		cout << pos_samples_map.size() << " Pos loaded" << endl;
-		cout << position_reduce() << " Pos Removed" << endl;
-		cout << pos_samples_map.size() << " Pos remained"<< endl;
+		++circle_count;
+		position_reduce();
 
 		//calculate_values(params.end_condition);
 		calculate_values_omp(params.end_condition, params.thread);
 
-		cout << "Writing results.." << endl;
+		output_values(writer);
 
-		output_values(output_file);
+		if (params.stats_batch)
+			stats_report(circle_count);
 	}
+	progress.Stop();
+	writer.Finish();
+	stats.Add(COUNT_BYTES_WRITTEN, writer.Get_Bytes());
+	stats_report(-1);
+	if (params.fast_math_verify)
+		math_report(cerr);
+	if (params.screen_verify)
+		screen_report(cerr);
 }
 
 int new_read(ifstream &in, queue<string> &buffer, int len)
@@ -257,6 +492,10 @@ int new_read(ifstream &in, queue<string> &buffer, int len)
 	string line;
 	while((len < params.one_circle_limit) && (getline(in, line)))
 	{
+		stats.Add(COUNT_LINES);
+		stats.Add(COUNT_BYTES_READ, line.size() + 1);
+		if (progress.Enabled())
+			progress.Add_Line(line.size() + 1, 0);
 		//stringstream ss(line);
 		//string temp;
 		//ss >> temp;
@@ -290,7 +529,7 @@ long min_last_element(vector<queue<string>> &buffer_queue)
 	return min;
 }
 
-void position_add(vector<unsigned int> &count_vector, shared_ptr<Seq_Obj> &seq_obj, int sample)
+void position_add(vector<unsigned int> &count_vector, unique_ptr<Seq_Obj> &seq_obj, int sample)
 {
 	unsigned int pos = seq_obj.get()->Get_Pos();
 
@@ -298,7 +537,7 @@ void position_add(vector<unsigned int> &count_vector, shared_ptr<Seq_Obj> &seq_o
 	{
 		pos_samples_map[pos].reset(new Multi_Seq_Obj(params.sample_count, params.type));
 	}
-	pos_samples_map[pos].get()->Insert(seq_obj, sample);
+	pos_samples_map[pos].get()->Insert(seq_obj.release(), sample);
 	count_vector[sample]++;
 }
 
@@ -314,9 +553,9 @@ void data_checkin(queue<string> &buffer, vector<unsigned int> &count_vector, lon
 			break;
 		//Check if qual_bq_length = qual_mq_length
 		if (obj[5].size() != obj[6].size()) cout <<"Qual Seq error : " << buffer.front()<< endl;
-		shared_ptr<Seq_Obj> seq_obj(new Seq_Obj(obj, params.type, params.step, params.end_condition));
+		unique_ptr<Seq_Obj> seq_obj(new Seq_Obj(obj, params.type, params.step, params.end_condition));
 
-		if (seq_obj.get()->Get_Ref() == "N") {
+		if (seq_obj.get()->Get_Ref() == 'N') {
 			buffer.pop();
 			continue;
 		}
@@ -346,12 +585,12 @@ unsigned int position_reduce()
 	unsigned int reduce_count = 0;
 
 	//Remove disabled
-	map<unsigned int, shared_ptr<Multi_Seq_Obj>>::iterator it = pos_samples_map.begin();
+	map<unsigned int, unique_ptr<Multi_Seq_Obj>>::iterator it = pos_samples_map.begin();
 	while (it != pos_samples_map.end())
 	{
 		if (!it->second.get()->Get_Is_Qual())
 		{
-			map<unsigned int, shared_ptr<Multi_Seq_Obj>>::iterator toErase = it;
+			map<unsigned int, unique_ptr<Multi_Seq_Obj>>::iterator toErase = it;
 			it++;
 			reduce_count++;
 			pos_samples_map.erase(toErase);
@@ -365,99 +604,114 @@ unsigned int position_reduce()
 	return reduce_count;
 }
 
-void output_values(ofstream &out)
+void output_values(Output_Writer &writer)
 {
 	char Consensus_letter[11] = "ACGTMRWSYK";
 
 	unsigned int Ti = 0;
 	unsigned int Tv = 0;
 
-	map<unsigned int, shared_ptr<Multi_Seq_Obj>>::iterator it = pos_samples_map.begin();
+	vector<pair<unsigned int, Multi_Seq_Obj*>> sites;
+	for (map<unsigned int, unique_ptr<Multi_Seq_Obj>>::iterator it = pos_samples_map.begin(); it != pos_samples_map.end(); it++)
+		sites.push_back(make_pair(it->first, it->second.get()));
 
-	while (it != pos_samples_map.end())
-	{
-		unsigned int pos = it->first;
+	//Each thread formats a contiguous chunk, committed in position order
+	int count = sites.size();
+	int chunks = (count + OUTPUT_SITES_PER_CHUNK - 1) / OUTPUT_SITES_PER_CHUNK;
+	unsigned long sequence = writer.Reserve(chunks);
 
-		//Let the filter effect
-		if (pos_samples_map.at(pos).get()->Get_Is_Qual()
-			&& (pos_samples_map.at(pos).get()->Get_W() < params.result_filter))
+	omp_set_num_threads(params.thread);
+	#pragma omp parallel for schedule(dynamic) reduction(+:Ti,Tv)
+	for (int c = 0; c < chunks; c++)
+	{
+		string out;
+		out.reserve(OUTPUT_CHUNK_SIZE);
+		int last = (c + 1) * OUTPUT_SITES_PER_CHUNK;
+		for (int s = c * OUTPUT_SITES_PER_CHUNK; (s < last) && (s < count); s++)
 		{
-			out << pos_samples_map.at(pos).get()->Get_Chrom() << "\t";
-			out << pos << "\tNA\t" << pos_samples_map.at(pos).get()->Get_Ref() << "\tNA\t";
+			unsigned int pos = sites[s].first;
+			Multi_Seq_Obj *mso = sites[s].second;
+			char ref = mso->Get_Ref();
+			float w = mso->Get_W();
 
-			if ((pos_samples_map.at(pos).get()->Get_Sample_Count() >= 1)
-				&& (pos_samples_map.at(pos).get()->Get_W() >= 0))
+			//Let the filter effect
+			if (mso->Get_Is_Qual() && (w < params.result_filter))
 			{
-				if (pos_samples_map.at(pos).get()->Get_W() < pow(10, -100))
+				out.append(mso->Get_Chrom().data(), mso->Get_Chrom().size());
+				out += "\t";
+				Append_Int(out, pos);
+				out += "\tNA\t";
+				out += ref;
+				out += "\tNA\t";
+
+				if ((mso->Get_Sample_Count() >= 1) && (w >= 0))
 				{
-					out << "\t" << 999.999 << "\tPASS\t";
+					out += "\t";
+					if (w < pow(10, -100))
+						Append_Float(out, 999.999);
+					else
+						Append_Float(out, -10 * log(w));
+					out += "\tPASS\t";
 				}
 				else
+					out += "\tNA\tNA\t";
+				for (unsigned int i = 0; i < params.sample_count; i++)
 				{
-					out << "\t" << -10 * log(pos_samples_map.at(pos).get()->Get_W()) << "\tPASS\t";
+					Append_Int(out, i);
+					if (mso->Get_Is_Sample(i)) {
+						out += ":";
+						Append_Int(out, mso->Get_E_Value_Max(i) + 1);
+						out += ",";
+					} else
+						out += ":NA,";
 				}
+				out += "P0:";
+				Append_Float(out, mso->Get_P(0));
+				out += ",P1:";
+				Append_Float(out, mso->Get_P(1));
+
+				out += "\tSample Number: ";
+				Append_Int(out, mso->Get_Sample_Count());
+				out += "\t";
+				Append_Float(out, mso->Get_P(0));
+				out += "\t";
+				Append_Float(out, mso->Get_P(1));
+				out += "\t";
+				Append_Float(out, mso->Get_Value(0));
+				out += "\t";
+				Append_Float(out, mso->Get_Value(1));
+				out += "\t";
+				Append_Float(out, mso->Get_Value(2));
+				out += "\t";
+				Append_Float(out, w);
+				out += "\n";
 			}
-			else
-				out << "\tNA\tNA\t";
-			for (unsigned int i = 0; i < params.sample_count; i++)
+			//Ext info
+			char ref_allele = ref;
+			char consensus = Consensus_letter[mso->Get_Value_Max()];
+
+			if ((mso->Get_P(0) <= params.p_snp) && (ref_allele != consensus)) //Count Ti/Tv
 			{
-				if (pos_samples_map.at(pos).get()->Get_Is_Sample(i)) {
-					out << i << ":" << pos_samples_map.at(pos).get()->Get_E_Value_Max(i) + 1 << ",";
-				} else
-					out << i << ":NA,";
+				if (((ref_allele == 'A') && (consensus == 'G'))
+						|| ((ref_allele == 'G') && (consensus == 'A'))
+						|| ((ref_allele == 'C') && (consensus == 'T'))
+						|| ((ref_allele == 'T') && (consensus == 'C')))
+
+					Ti++;
+
+				else if (((ref_allele == 'A') && (consensus == 'C'))
+						|| ((ref_allele == 'C') && (consensus == 'A'))
+						|| ((ref_allele == 'A') && (consensus == 'T'))
+						|| ((ref_allele == 'T') && (consensus == 'A'))
+						|| ((ref_allele == 'C') && (consensus == 'G'))
+						|| ((ref_allele == 'G') && (consensus == 'C'))
+						|| ((ref_allele == 'G') && (consensus == 'T'))
+						|| ((ref_allele == 'T') && (consensus == 'G')))
+
+					Tv++;
 			}
-			out << "P0:" << pos_samples_map.at(pos).get()->Get_P(0)
-			    << ",P1:" << pos_samples_map.at(pos).get()->Get_P(1);
-
-			out << "\t" << "Sample Number: " << pos_samples_map.at(pos).get()->Get_Sample_Count();
-			out << "\t" << pos_samples_map.at(pos).get()->Get_P(0);
-			out << "\t" << pos_samples_map.at(pos).get()->Get_P(1);
-			out << "\t" << pos_samples_map.at(pos).get()->Get_Value(0);
-			out << "\t" << pos_samples_map.at(pos).get()->Get_Value(1);
-			out << "\t" << pos_samples_map.at(pos).get()->Get_Value(2);
-			out << "\t" << pos_samples_map.at(pos).get()->Get_W();
-			out << endl;
-
-
-		}
-		//Ext info
-		int max_value = pos_samples_map.at(pos).get()->Get_Value_Max();
-
-		if ((pos_samples_map.at(pos).get()->Get_P(0) <= params.p_snp)
-				&& ((pos_samples_map.at(pos).get()->Get_Ref())[0]
-						!= Consensus_letter[max_value])) //Count Ti/Tv
-		{
-			if ((((pos_samples_map.at(pos).get()->Get_Ref())[0] == 'A')
-					&& (Consensus_letter[max_value] == 'G'))
-					|| (((pos_samples_map.at(pos).get()->Get_Ref())[0] == 'G')
-							&& (Consensus_letter[max_value] == 'A'))
-					|| (((pos_samples_map.at(pos).get()->Get_Ref())[0] == 'C')
-							&& (Consensus_letter[max_value] == 'T'))
-					|| (((pos_samples_map.at(pos).get()->Get_Ref())[0] == 'T')
-							&& (Consensus_letter[max_value] == 'C')))
-
-				Ti++;
-
-			else if ((((pos_samples_map.at(pos).get()->Get_Ref())[0] == 'A')
-					&& (Consensus_letter[max_value] == 'C'))
-					|| (((pos_samples_map.at(pos).get()->Get_Ref())[0] == 'C')
-							&& (Consensus_letter[max_value] == 'A'))
-					|| (((pos_samples_map.at(pos).get()->Get_Ref())[0] == 'A')
-							&& (Consensus_letter[max_value] == 'T'))
-					|| (((pos_samples_map.at(pos).get()->Get_Ref())[0] == 'T')
-							&& (Consensus_letter[max_value] == 'A'))
-					|| (((pos_samples_map.at(pos).get()->Get_Ref())[0] == 'C')
-							&& (Consensus_letter[max_value] == 'G'))
-					|| (((pos_samples_map.at(pos).get()->Get_Ref())[0] == 'G')
-							&& (Consensus_letter[max_value] == 'C'))
-					|| (((pos_samples_map.at(pos).get()->Get_Ref())[0] == 'G')
-							&& (Consensus_letter[max_value] == 'T'))
-					|| (((pos_samples_map.at(pos).get()->Get_Ref())[0] == 'T')
-							&& (Consensus_letter[max_value] == 'G')))
-
-				Tv++;
 		}
-		it++;
+		writer.Commit(sequence + c, out);
 	}
 	pos_samples_map.clear();
 }
@@ -533,140 +787,435 @@ void test()
 	//cout << "55580488 finish " << endl << endl;
 }
 
-void constrains(string &infilename, string &outfilename)
+//Token buffers of one parsing thread, reused from line to line so their capacity is kept
+typedef struct _parse_scratch {
+	string cov;
+	string ref_str;
+	string q_str1;
+	string q_str2;
+} parse_scratch;
+
+//Next whitespace separated field of line from at into token, empty at the end of the line as with >>
+static void next_field(const string &line, size_t &at, string &token)
+{
+	size_t length = line.size();
+	while ((at < length) && isspace((unsigned char) line[at]))
+		at++;
+	size_t start = at;
+	while ((at < length) && !isspace((unsigned char) line[at]))
+		at++;
+	token.assign(line, start, at - start);
+}
+
+//Assigned element by element, so record strings keep their capacity too
+void clear_record(site_record &record, const Parameters &p)
 {
-	ifstream input_file(infilename, ifstream::in);
-	if (!input_file)
+	record.mso = NULL;
+	record.ref_vec.resize(p.sample_count);
+	for (int i = 0; i < p.sample_count; i++)
+		record.ref_vec[i] = "*";
+	record.cov_vec.assign(p.sample_count, 0);
+}
+
+//The site is a candidate if a sample passed the filters and the covered samples average over 10 reads
+int candidate_site(site_record &record, Multi_Seq_Obj *mso, Site_Arena *arena, const Site_Arena::mark &start, const Parameters &p)
+{
+	int cov_sum = 0;
+	int cov_num = 0;
+	for (int i = 0; i < p.sample_count; i++) {
+		if (record.cov_vec[i] > 0) {
+			cov_num++;
+			cov_sum += record.cov_vec[i];
+		}
+	}
+
+	if ((mso->Get_Is_Qual()) && (cov_sum > cov_num * 10))
 	{
-		cerr << "Open infile error: " << infilename << endl;
-		exit(0);
+		record.mso = mso;
+		stats.Add(COUNT_SITE_CANDIDATE);
+		return 1;
 	}
 
-	ofstream output_file(outfilename, ios::out);
-	if (!output_file)
+	stats.Add(mso->Get_Is_Qual() ? COUNT_SITE_LOW_COVERAGE : COUNT_SITE_NOT_ENABLED);
+	arena_delete(arena, mso);
+	if (arena != NULL)
+		arena->Rewind(start);
+	return 0;
+}
+
+//Filters the reads of one sample and adds it to the site, or drops it, returns 1 if added
+int add_sample(Multi_Seq_Obj *mso, Seq_Obj *seq_obj, int sample, Site_Arena *arena, const Parameters &p)
+{
+	if (seq_obj->Seq_Init_Filter() == 1)
 	{
-		cerr << "Open outfile error : " << outfilename << endl;
-		exit(0);
+		stats.Add(COUNT_SAMPLE_INIT_FILTER);
+		arena_delete(arena, seq_obj);
+		return 0;
 	}
 
-	int counter = 0;
+	if ((seq_obj->Get_Ratio_nchar() >= p.ratio_nchar)&&(seq_obj->Get_Ratio_del() < p.ratio_del))
+	{
+		seq_obj->Seq_Qual_Filter(p.bp, p.mp);
+		seq_obj->Seq_Max_Filter(p.max_count);
+		mso->Insert(seq_obj, sample);
+		mso->Enable();
+		return 1;
+	}
 
-	string line;
-	while (getline(input_file, line))
-	{
-		stringstream strin(line);
-		string ss;
-		string gene;
-		string pos;
-		string ref;
-		string cov;
-		string ref_str;
-		string q_str1;
-		string q_str2;
-
-		vector<string> ref_vec(params.sample_count, "*");
-		vector<int> cov_vec(params.sample_count, 0);
-
-		Multi_Seq_Obj* mso = new Multi_Seq_Obj(params.sample_count, params.type);
-
-		strin >> gene;
-		strin >> pos;
-		strin >> ref;
-		//cout << line << endl;
-		//cout << gene << "\t" << pos << "\t" << ref << endl;
-		if (ref == "N")
-		{
-			continue;
-		}
-		try
+	stats.Add(COUNT_SAMPLE_RATIO_FILTER);
+	arena_delete(arena, seq_obj);
+	return 0;
+}
+
+int parse_site(const string &line, site_record &record, Site_Arena *arena)
+{
+	Stat_Timer timer(STAT_PARSE);
+	static thread_local parse_scratch scratch;
+	string &cov = scratch.cov;
+	string &ref_str = scratch.ref_str;
+	string &q_str1 = scratch.q_str1;
+	string &q_str2 = scratch.q_str2;
+	size_t at = 0;
+
+	clear_record(record, params);
+
+	next_field(line, at, record.gene);
+	next_field(line, at, record.pos);
+	next_field(line, at, record.ref);
+	//cout << line << endl;
+	//cout << gene << "\t" << pos << "\t" << ref << endl;
+	if (record.ref == "N")
+	{
+		stats.Add(COUNT_REF_N);
+		return 0;
+	}
+
+	Site_Arena::mark start;
+	if (arena != NULL)
+		start = arena->Get_Mark();
+	Multi_Seq_Obj* mso = arena_new<Multi_Seq_Obj>(arena, params.sample_count, params.type, arena);
+	unsigned int contig = intern_contig(record.gene);
+	bool dropped = false;
+
+	//Stored samples first, the pileup columns hold the samples after them
+	if (evidence_store.Reading() && evidence_store.Stored_Same(record.gene, strtoul(record.pos.c_str(), NULL, 10)))
+		dropped = (evidence_store.Load_Site(record, mso, arena) == 0);
+
+	try
+	{
+		for (int i = params.store_samples; i < params.sample_count; i++)
 		{
-			for (int i = 0; i < params.sample_count; i++) 
+			next_field(line, at, cov);
+			if (0 == stoi(cov))
 			{
-				strin >> cov;
-				if (0 == stoi(cov))
+				next_field(line, at, ref_str);
+				if (ref_str == "*")
 				{
-					strin >> ref_str;
-					if (ref_str == "*")
-					{
-						strin >> q_str1;
-					}
-					continue;
+					next_field(line, at, q_str1);
 				}
-				else
+				stats.Add(COUNT_SAMPLE_NO_COVERAGE);
+				continue;
+			}
+			else
+			{
+				next_field(line, at, ref_str);
+				next_field(line, at, q_str1);
+				next_field(line, at, q_str2);
+				record.cov_vec[i] = stoi(cov);
+				record.ref_vec[i] = ref_str;
+				if (q_str1.size() != q_str2.size())
 				{
-					strin >> ref_str;
-					strin >> q_str1;
-					strin >> q_str2;
-					cov_vec[i] = stoi(cov);
-					ref_vec[i] = ref_str;
-					if (q_str1.size() != q_str2.size()) continue;
+					stats.Add(COUNT_SAMPLE_QUAL_LENGTH);
+					continue;
 				}
+			}
 
-				shared_ptr<Seq_Obj> seq_obj(new Seq_Obj(gene, stoi(pos), ref, stoi(cov), ref_str, q_str1, q_str2, params.type, params.step, params.end_condition));
+			Seq_Obj *seq_obj = arena_new<Seq_Obj>(arena, contig, stoi(record.pos), record.ref[0], stoi(cov), ref_str, q_str1, q_str2, params.type, params.step, params.end_condition, arena);
 
-				if (seq_obj.get()->Seq_Init_Filter() == 1) continue;
+			//ref_vec[i] = seq_obj->Get_Ref_Info();
+			//cov_vec[i] = seq_obj->Get_Ref_Length();
 
-				//ref_vec[i] = seq_obj.get()->Get_Ref_Info();
-				//cov_vec[i] = seq_obj.get()->Get_Ref_Length();
+			add_sample(mso, seq_obj, i, arena, params);
+		}
+	} catch (std::invalid_argument &)
+	{
+		//cerr << line << endl;
+		stats.Add(COUNT_PARSE_ERROR);
+		dropped = true;
+	}
 
-				if ((seq_obj.get()->Get_Ratio_nchar() >= params.ratio_nchar)&&(seq_obj.get()->Get_Ratio_del() < params.ratio_del))
-				{
-					seq_obj.get()->Seq_Qual_Filter(params.bp, params.mp);
-					seq_obj.get()->Seq_Max_Filter(params.max_count);
-					mso->Insert(seq_obj, i);
-					mso->Enable();
-				}
+	if (evidence_store.Writing())
+		evidence_store.Write_Site(record, mso, dropped);
+	if (dropped)
+	{
+		arena_delete(arena, mso);
+		if (arena != NULL)
+			arena->Rewind(start);
+		return 0;
+	}
+	return candidate_site(record, mso, arena, start, params);
+}
+
+//The next site of the evidence store, when the pileup has no line for it
+int stored_site(site_record &record, Site_Arena *arena)
+{
+	Stat_Timer timer(STAT_PARSE);
+	clear_record(record, params);
+	evidence_store.Site_Header(record);
+
+	Site_Arena::mark start;
+	if (arena != NULL)
+		start = arena->Get_Mark();
+	Multi_Seq_Obj* mso = arena_new<Multi_Seq_Obj>(arena, params.sample_count, params.type, arena);
+	bool dropped = (evidence_store.Load_Site(record, mso, arena) == 0);
+
+	if (evidence_store.Writing())
+		evidence_store.Write_Site(record, mso, dropped);
+	if (dropped)
+	{
+		arena_delete(arena, mso);
+		if (arena != NULL)
+			arena->Rewind(start);
+		return 0;
+	}
+	return candidate_site(record, mso, arena, start, params);
+}
+
+string site_chrom(const string &gene)
+{
+	string chrom;
+	append_site_chrom(chrom, gene);
+	return chrom;
+}
+
+void append_site_chrom(string &out, const string &gene)
+{
+	int epos = gene.find_last_of("|") - 1;
+	int spos = gene.find_last_of("|", epos);
+	out.append(gene, spos + 1, epos - spos);
+}
+
+void format_site(string &out, site_record &record)
+{
+	Multi_Seq_Obj* mso = record.mso;
+
+	if ((mso->Get_W() > 0.1) && (mso->Get_W() < params.result_filter))
+	{
+		//output_file << mso->Get_W() << "\t" << line << endl;
+		//output_file << line.find_last_of("|") 
+		//			<< "\t"
+		//			<< line.find_last_of("|", line.find_last_of("|") - 1) 
+		//			<< "\t"
+		append_site_chrom(out, record.gene);
+		out += "\t";
+		out += record.pos;
+		out += "\t";
+		out += record.ref;
+		out += "\t";
+		Append_Int(out, record.cov_vec[0]);
+
+		for (int i = 1; i < params.sample_count; i++)
+		{
+			out += ",";
+			Append_Int(out, record.cov_vec[i]);
+		}
+
+		out += "\t";
+		out += record.ref_vec[0];
+
+		for (int i = 1; i < params.sample_count; i++)
+		{
+			out += "|";
+			out += record.ref_vec[i];
+		}
+
+		out += "\n";
+		stats.Add(COUNT_SITE_OUTPUT);
+	}
+}
+
+//The next stored site comes before the pileup line
+static bool stored_first(const string &line, string &gene, string &pos)
+{
+	size_t at = 0;
+	next_field(line, at, gene);
+	next_field(line, at, pos);
+	return evidence_store.Stored_First(gene, strtoul(pos.c_str(), NULL, 10));
+}
+
+//Stats and progress of one pileup line
+static void count_line(site_record &record, unsigned long long bytes, string &progress_contig)
+{
+	stats.Add(COUNT_LINES);
+	stats.Add(COUNT_BYTES_READ, bytes);
+	if (progress.Enabled())
+	{
+		if (record.gene != progress_contig)
+		{
+			progress_contig = record.gene;
+			progress.Set_Contig(site_chrom(progress_contig));
+		}
+		progress.Add_Line(bytes, strtoul(record.pos.c_str(), NULL, 10));
+	}
+}
+
+void constrains(string &infilename, string &outfilename)
+{
+	//Without a pileup every site comes from --store-in or --bam
+	ifstream input_file;
+	if (!infilename.empty())
+	{
+		input_file.open(infilename, ifstream::in);
+		if (!input_file)
+		{
+			cerr << "Open infile error: " << infilename << endl;
+			exit(0);
+		}
+	}
+
+	//BCF records go to a temporary file until the contigs for the header are known
+	Bcf_Writer *bcf = NULL;
+	string records_name = outfilename;
+	if (params.output_type == 'b')
+	{
+		bcf = new Bcf_Writer(outfilename, params.sample_count);
+		records_name = bcf->Get_Records_Name();
+	}
+
+	ofstream output_file(records_name, ios::out | ios::binary);
+	if (!output_file)
+	{
+		cerr << "Open outfile error : " << records_name << endl;
+		exit(0);
+	}
+
+	Output_Writer writer(output_file);
+	progress.Start(params.progress_interval, params.progress_file, bam_pileup.Reading() ? bam_pileup.Get_File_Bytes() : file_size(infilename));
+
+	int counter = 0;
+	long batch = 0;
+	vector<em_worker> workers(params.thread);
+
+	//Sites are parsed in order, calculated -C at a time, and written in order
+	//Under --mem-budget a cycle takes as many sites as fit, but never fewer than the threads can share
+	int min_batch = params.thread * max((int) params.tile, 1) * MIN_SITES_PER_WORKER;
+	bool account = (params.mem_budget > 0) || stats.Enabled();
+	vector<site_record> records(params.one_circle_limit);
+	vector<Multi_Seq_Obj*> sites;
+	Site_Arena arena;
+	bool more = true;
+	bool pending = false; //A line read but held back behind earlier stored sites
+
+	string line;
+	string line_gene, line_pos;
+	string progress_contig;
+	while (more)
+	{
+		chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+		int loaded = 0;
+		unsigned long long bytes = 0;
+		while ((params.mem_budget == 0) ? (loaded < params.one_circle_limit) : ((bytes < params.mem_budget) || (loaded < min_batch)))
+		{
+			if (!pending && !bam_pileup.Reading())
+				pending = (bool) getline(input_file, line);
+			if (!pending && !evidence_store.Has_Next() && !bam_pileup.Has_Next())
+			{
+				more = false;
+				break;
 			}
 
-			int cov_sum = 0;
-			int cov_num = 0;
-			for (int i = 0; i < params.sample_count; i++) {
-				if (cov_vec[i] > 0) {
-					cov_num++;
-					cov_sum += cov_vec[i];
-				}
+			if (loaded == records.size())
+				records.resize(2 * records.size());
+			int candidate;
+			if (bam_pileup.Reading())
+			{
+				//A BAM position counts as a pileup line of the compressed bytes it took
+				unsigned long long read = bam_pileup.Get_Bytes();
+				candidate = bam_pileup.Next_Site(records[loaded], &arena);
+				count_line(records[loaded], bam_pileup.Get_Bytes() - read, progress_contig);
 			}
-			
-			if ((mso->Get_Is_Qual()) && (cov_sum > cov_num * 10))
+			else if (evidence_store.Has_Next() && (!pending || stored_first(line, line_gene, line_pos)))
+				candidate = stored_site(records[loaded], &arena);
+			else
 			{
-				counter++;
-				mso->Calc_EM(params.end_condition, params.step, params.eps);
-				mso->Calc_W(2, 200);
+				pending = false;
+				candidate = parse_site(line, records[loaded], &arena);
+				count_line(records[loaded], line.size() + 1, progress_contig);
+			}
+			if (candidate == 1)
+			{
+				if (account)
+					bytes = arena.Get_Bytes();
+				sites.push_back(records[loaded].mso);
+				loaded++;
+			}
+		}
+		counter += loaded;
+
+		calculate_sites(sites, params.end_condition, params.thread, workers);
+
+		if (bcf != NULL)
+			for (int i = 0; i < loaded; i++)
+				if ((i == 0) || (records[i].gene != records[i - 1].gene))
+					bcf->Add_Contig(site_chrom(records[i].gene));
 
-				if ((mso->Get_W() > 0.1) && (mso->Get_W() < params.result_filter))
+		//Formatted per thread, written in order while the next batch is calculated
+		int chunks = (loaded + OUTPUT_SITES_PER_CHUNK - 1) / OUTPUT_SITES_PER_CHUNK;
+		unsigned long sequence = writer.Reserve(chunks);
+
+		#pragma omp parallel for schedule(dynamic)
+		for (int c = 0; c < chunks; c++)
+		{
+			Stat_Timer timer(STAT_OUTPUT);
+			string out;
+			out.reserve(OUTPUT_CHUNK_SIZE);
+			int last = (c + 1) * OUTPUT_SITES_PER_CHUNK;
+			for (int i = c * OUTPUT_SITES_PER_CHUNK; (i < last) && (i < loaded); i++)
+			{
+				if (bcf == NULL)
+					format_site(out, records[i]);
+				else if ((records[i].mso->Get_W() > 0.1) && (records[i].mso->Get_W() < params.result_filter))
 				{
-					//output_file << mso->Get_W() << "\t" << line << endl;
-					//output_file << line.find_last_of("|") 
-					//			<< "\t"
-					//			<< line.find_last_of("|", line.find_last_of("|") - 1) 
-					//			<< "\t"
-					int epos = gene.find_last_of("|") - 1;
-					int spos = gene.find_last_of("|", epos);
-					output_file << gene.substr(spos + 1, epos - spos) << "\t" << pos << "\t" << ref << "\t" << cov_vec[0];
-
-					for (int i = 1; i < params.sample_count; i++)
-					{
-						output_file << "," << cov_vec[i];
-					}
-
-					output_file << "\t" << ref_vec[0];
-
-					for (int i = 1; i < params.sample_count; i++)
-					{
-						output_file << "|" << ref_vec[i];
-					}
-					
-					output_file << endl;
+					bcf->Encode(out, records[i].mso, site_chrom(records[i].gene), stoi(records[i].pos), records[i].ref, records[i].cov_vec);
+					stats.Add(COUNT_SITE_OUTPUT);
 				}
+				records[i].mso = NULL;
 			}
-		} catch (std::invalid_argument)
-		{
-			//cerr << line << endl;
+			writer.Commit(sequence + c, out);
 		}
+		sites.clear();
+		arena.Reset();
 
-		delete mso;
+		stats.Set_Batch(loaded, bytes, chrono::duration<double>(chrono::steady_clock::now() - begin).count());
+		if (params.stats_batch)
+			stats_report(batch);
+		batch++;
 	}
 	//cout << "counter = " << counter << endl;
+	progress.Stop();
+	writer.Finish();
 	input_file.close();
 	output_file.close();
+	if (evidence_store.Close() != 0)
+		exit(0);
+	if (bam_pileup.Close() != 0)
+		exit(0);
+
+	if (bcf != NULL)
+	{
+		int failed = bcf->Finish();
+		delete bcf;
+		if (failed != 0)
+		{
+			cerr << "Write BCF error : " << outfilename << endl;
+			exit(0);
+		}
+	}
+
+	stats.Add(COUNT_BYTES_WRITTEN, file_size(outfilename));
+	stats_report(-1);
+	if (params.fast_math_verify)
+		math_report(cerr);
+	if (params.screen_verify)
+		screen_report(cerr);
 }
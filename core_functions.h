@@ -8,53 +8,67 @@
 #include <queue>
 #include <array>
 #include <climits>
+#include "parameters.h"
 #include "multi_seq_obj.h"
+#include "batch_em.h"
+#include "output_writer.h"
+#include "bcf_writer.h"
+#include "stats.h"
+#include "progress.h"
+#include "math_kernels.h"
+#include "isa_kernels.h"
 
 #ifndef CORE_FUNCTIONS_H_
 #define CORE_FUNCTIONS_H_
 
 #define MAX_NUM 1000000000000
 #define MIN_NUM 0
-
-typedef struct FORSIMPLE
-{
-	bool debug;
-	int type;
-	int bp;
-	int mp;
-	int min;
-	int max;
-	int thread;
-	int one_circle_limit;
-	int start_position;
-	unsigned int max_count;
-	unsigned int sample_count;
-	float ratio_nchar;
-	float ratio_del;
-	float step;
-	float eps;
-	float p_snp;
-	float result_filter;
-	float end_condition;
-} Parameters;
-
-extern Parameters params;
+#define OUTPUT_SITES_PER_CHUNK 4096
+#define MIN_SITES_PER_WORKER 8 //Smallest batch under --mem-budget, per thread and tile lane
 
 using namespace std;
 
+//One input line of constrains() waiting for its EM and output
+typedef struct _site_record
+{
+	Multi_Seq_Obj *mso;
+	string gene;
+	string pos;
+	string ref;
+	vector<int> cov_vec;
+	vector<string> ref_vec;
+} site_record;
+
 int printhelp();
 void output_header(ofstream &out);
 int Get_Name_List(const string &listname, vector<string> &infilename);
 int String_Split(const string &buffer, array<string, 7> &obj, int n);
 int calculate_values(double end);
 int calculate_values(double end, int thread);
+void default_parameters(Parameters &p);
+void reference_parameters(Parameters &p);
+void kernel_select(const Parameters &p);
+int calculate_sites(vector<Multi_Seq_Obj*> &sites, double end, int thread, vector<em_worker> &workers); //Selects the kernels of params first
+int calculate_sites(const Parameters &p, vector<Multi_Seq_Obj*> &sites, double end, int thread, vector<em_worker> &workers);
 int new_read(ifstream &in, queue<string> &buffer, int len);
 long min_last_element(vector<queue<string>> &buffer_queue);
 void data_checkin(queue<string> &buffer, vector<unsigned int> &count_vector, long checkin_limit, int sample);
 unsigned int position_reduce();
-void output_values(ofstream &out);
+void output_values(Output_Writer &writer);
+long file_size(const string &filename);
+unsigned long long parse_bytes(const string &value);
+void stats_report(long batch);
+void screen_report(ostream &out);
 void core_calculate(ifstream* ifstream_array, vector<queue<string>> &buffer_queue, ofstream &output_file);
 void calculate_preprocess(const vector<string> &infilename, string &outfilename);
 void test();
+void clear_record(site_record &record, const Parameters &p);
+int add_sample(Multi_Seq_Obj *mso, Seq_Obj *seq_obj, int sample, Site_Arena *arena, const Parameters &p);
+int candidate_site(site_record &record, Multi_Seq_Obj *mso, Site_Arena *arena, const Site_Arena::mark &start, const Parameters &p);
+int parse_site(const string &line, site_record &record, Site_Arena *arena = NULL); //With an arena the site belongs to it, else to the caller
+int stored_site(site_record &record, Site_Arena *arena = NULL);
+string site_chrom(const string &gene);
+void append_site_chrom(string &out, const string &gene);
+void format_site(string &out, site_record &record);
 void constrains(string &infilename, string &outfilename);
 #endif /* CORE_FUNCTIONS_H_ */
@@ -0,0 +1,571 @@
+/*
+ * diff_check.cpp
+ *
+ * Differential check of the optimized kernels against the reference
+ * (scalar, site by site) kernels, built and run by "make diff-check".
+ * Every site is parsed and calculated twice, once with the reference
+ * parameters and once with the options given, and W, P, Value and the
+ * per sample genotype calls are compared against the tolerances. Sites
+ * the optimized run pruned (--prune) only hold the W bound, which must not
+ * be above the reference W. Sites the screen finished without the EM
+ * (--screen) are only compared on the call (in full with --screen-verify),
+ * and so are the sites --coarse-step did not refine, while the refined
+ * sites must match the reference exactly. The calls the screen and the
+ * coarse grid lose must not be more than --tol-calls. With
+ * --engine 1 the sites are pushed to an Engine (engine.h) instead, and
+ * compared against the multigems text path with the same options. With --bam 1 reads of -S samples over two contigs
+ * of -g and -g/2 positions are generated and written as BAM files and a
+ * FASTA reference, and the sites of the BAM pileup (bam_pileup.h) are
+ * compared against the text path over the mpileup lines of those reads.
+ *
+ * Usage: multigems_diff (-i input.pileup | -g SITES) -S INT [OPTIONS]
+ *        Options are those of multigems that change the calculation,
+ *        plus -D INT (generated depth, default 30), -r INT (generator seed),
+ *        --tol-w, --tol-p, --tol-value FLOAT (absolute, default 0),
+ *        --tol-calls INT (calls the approximate options may lose, default 0),
+ *        --report INT (differing sites printed, default 20), --engine 0/1,
+ *        --bam 0/1 and --bam-prefix PATH (generated files, default
+ *        multigems_diff, removed after the check).
+ *        Exits with 1 if any site is out of tolerance.
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cmath>
+#include "core_functions.h"
+#include "engine.h"
+#include "bam_pileup.h"
+#include "synthetic_bam.h"
+#include "synthetic_pileup.h"
+
+using namespace std;
+
+typedef struct _diff_options {
+	string input;
+	long generate;
+	int depth;
+	unsigned int seed;
+	float tol_w;
+	float tol_p;
+	float tol_value;
+	long tol_calls;
+	long report;
+	bool engine;
+	bool bam;
+	string bam_prefix;
+} diff_options;
+
+typedef struct _diff_summary {
+	long sites;
+	long candidate_mismatch;
+	long column_mismatch;
+	long w_over;
+	long p_over;
+	long value_over;
+	long genotype_mismatch;
+	long call_mismatch;
+	long pruned;
+	long bound_over;
+	long screened;
+	long coarse;
+	long lost_calls;
+	long reported;
+	float max_w;
+	float max_p;
+	float max_value;
+} diff_summary;
+
+//The values compared of one site
+typedef struct _site_values {
+	float w;
+	float p[2];
+	float value[3];
+	vector<int> genotype;
+	char alt;
+	bool pruned;
+	bool screened;
+	bool coarse;
+} site_values;
+
+static void parse_options(int argc, char *argv[], diff_options &options)
+{
+	options.generate = 0;
+	options.depth = 30;
+	options.seed = 1;
+	options.tol_w = 0;
+	options.tol_p = 0;
+	options.tol_value = 0;
+	options.tol_calls = 0;
+	options.report = 20;
+	options.engine = false;
+	options.bam = false;
+	options.bam_prefix = "multigems_diff";
+
+	for (int arg_pos = 1; arg_pos + 1 < argc; arg_pos += 2)
+	{
+		string option = argv[arg_pos];
+		char *value = argv[arg_pos + 1];
+		if (option == "-i") options.input = value;
+		else if (option == "-g") options.generate = stol(value);
+		else if (option == "-D") options.depth = stoi(value);
+		else if (option == "-r") options.seed = stoul(value);
+		else if (option == "--tol-w") options.tol_w = stof(value);
+		else if (option == "--tol-p") options.tol_p = stof(value);
+		else if (option == "--tol-value") options.tol_value = stof(value);
+		else if (option == "--tol-calls") options.tol_calls = stol(value);
+		else if (option == "--report") options.report = stol(value);
+		else if (option == "--engine") options.engine = (stoi(value) != 0);
+		else if (option == "--bam") options.bam = (stoi(value) != 0);
+		else if (option == "--bam-prefix") options.bam_prefix = value;
+		else if (option == "-S") params.sample_count = stoi(value);
+		else if (option == "-s") params.step = stof(value);
+		else if (option == "-e") params.eps = stof(value);
+		else if (option == "-b") params.bp = stoi(value);
+		else if (option == "-m") params.mp = stoi(value);
+		else if (option == "-n") params.ratio_nchar = stof(value);
+		else if (option == "-l") params.ratio_del = stof(value);
+		else if (option == "-M") params.max_count = stoi(value);
+		else if (option == "-f") params.result_filter = stof(value);
+		else if (option == "-t") params.thread = stoi(value);
+		else if (option == "-C") params.one_circle_limit = stoi(value);
+		else if (option == "-B") params.tile = stoi(value);
+		else if (option == "-d") params.type = (stoi(value) == 0) ? 3 : 2;
+		else if (option == "--fast-math-level") params.fast_math_level = stoi(value);
+		else if (option == "--fast-math-verify") params.fast_math_verify = (stoi(value) != 0);
+		else if (option == "--isa") params.isa = value;
+		else if (option == "--wide-site") params.wide_site = stoul(value);
+		else if (option == "--table-cache") params.table_cache_bytes = parse_bytes(value);
+		else if (option == "--prune") params.prune = (stoi(value) != 0);
+		else if (option == "--screen") params.screen_margin = stof(value);
+		else if (option == "--screen-verify") params.screen_verify = (stoi(value) != 0);
+		else if (option == "--coarse-step") params.coarse_step = stof(value);
+		else if (option == "--refine-band") params.refine_band = stof(value);
+		else
+		{
+			cerr << "Unrec argument: " << option << endl;
+			exit(1);
+		}
+	}
+
+	if ((options.input.empty() == (options.generate == 0)) || (params.sample_count == 0) || (options.bam && (options.generate == 0)) || (options.bam && options.engine))
+	{
+		cerr << "Usage: multigems_diff (-i input.pileup | -g SITES) -S INT [OPTIONS], --bam needs -g and no --engine" << endl;
+		exit(1);
+	}
+}
+
+//Lines from the input file or the generator, -C at a time
+static int next_lines(istream *in, mt19937 &rng, const diff_options &options, long &generated, vector<string> &lines)
+{
+	lines.clear();
+	string line;
+	while ((int) lines.size() < params.one_circle_limit)
+	{
+		if (in != NULL)
+		{
+			if (!getline(*in, line))
+				break;
+			lines.push_back(line);
+		}
+		else
+		{
+			if (generated >= options.generate)
+				break;
+			lines.push_back(synthetic_line(rng, (generated < options.generate / 2) ? "chr1" : "chr2", 1000 + 3 * generated, params.sample_count, options.depth));
+			generated++;
+		}
+	}
+	return lines.size();
+}
+
+static void site_values_of(Multi_Seq_Obj *mso, site_values &values)
+{
+	values.w = mso->Get_W();
+	values.p[0] = mso->Get_P(0);
+	values.p[1] = mso->Get_P(1);
+	for (int j = 0; j < 3; j++)
+		values.value[j] = mso->Get_Value(j);
+	values.genotype.resize(params.sample_count);
+	for (int i = 0; i < params.sample_count; i++)
+		values.genotype[i] = mso->Get_E_Value_Max(i);
+	values.alt = mso->Get_Max_Allele();
+	values.pruned = mso->Get_Pruned();
+	values.screened = mso->Get_Screened();
+	values.coarse = mso->Get_Coarse();
+}
+
+static void site_values_of(const site_call &call, site_values &values)
+{
+	values.w = call.w;
+	values.p[0] = call.p[0];
+	values.p[1] = call.p[1];
+	for (int j = 0; j < 3; j++)
+		values.value[j] = call.value[j];
+	values.genotype = call.genotype;
+	values.alt = call.alt;
+	values.pruned = false;
+	values.screened = false;
+	values.coarse = false;
+}
+
+static int in_call(const site_values &site)
+{
+	return (site.w > 0.1) && (site.w < params.result_filter);
+}
+
+static void compare_site(site_record &reference, const site_values &ref, const site_values &opt, const diff_options &options, diff_summary &summary)
+{
+	float d_w = fabs(ref.w - opt.w);
+	float d_p = max(fabs(ref.p[0] - opt.p[0]), fabs(ref.p[1] - opt.p[1]));
+	float d_value = 0;
+	for (int j = 0; j < 3; j++)
+		d_value = max(d_value, (float) fabs(ref.value[j] - opt.value[j]));
+
+	int genotypes = 0;
+	for (int i = 0; i < params.sample_count; i++)
+		genotypes += (ref.genotype[i] != opt.genotype[i]);
+	bool call = (in_call(ref) != in_call(opt)) || (ref.alt != opt.alt);
+
+	summary.sites++;
+	if (opt.screened)
+	{
+		//A screened site is never output, under --screen-verify its EM still runs and is compared in full
+		bool lost = in_call(ref);
+		summary.screened++;
+		summary.lost_calls += lost;
+		if (lost && (summary.reported < options.report))
+		{
+			summary.reported++;
+			printf("%s\t%s\tW %.9g\tscreened, call lost\n", site_chrom(reference.gene).c_str(), reference.pos.c_str(), ref.w);
+		}
+		if (!params.screen_verify)
+			return;
+	}
+	if (opt.coarse)
+	{
+		//W of the coarse grid is outside the refine band, so the site is not output
+		bool lost = in_call(ref) != in_call(opt);
+		summary.coarse++;
+		summary.lost_calls += lost;
+		if (lost && (summary.reported < options.report))
+		{
+			summary.reported++;
+			printf("%s\t%s\tW %.9g coarse %.9g\tcall lost\n", site_chrom(reference.gene).c_str(), reference.pos.c_str(), ref.w, opt.w);
+		}
+		return;
+	}
+	if (opt.pruned)
+	{
+		bool bound = opt.w > ref.w * PRUNE_MARGIN + options.tol_w;
+		summary.pruned++;
+		summary.bound_over += bound;
+		summary.call_mismatch += call;
+		if ((bound || call) && (summary.reported < options.report))
+		{
+			summary.reported++;
+			printf("%s\t%s\tW %.9g bound %.9g\tcall %s\n", site_chrom(reference.gene).c_str(), reference.pos.c_str(),
+					ref.w, opt.w, call ? "differs" : "same");
+		}
+		return;
+	}
+
+	summary.max_w = max(summary.max_w, d_w);
+	summary.max_p = max(summary.max_p, d_p);
+	summary.max_value = max(summary.max_value, d_value);
+	summary.w_over += (d_w > options.tol_w);
+	summary.p_over += (d_p > options.tol_p);
+	summary.value_over += (d_value > options.tol_value);
+	summary.genotype_mismatch += genotypes;
+	summary.call_mismatch += call;
+
+	bool over = (d_w > options.tol_w) || (d_p > options.tol_p) || (d_value > options.tol_value) || (genotypes > 0) || call;
+	if (over && (summary.reported < options.report))
+	{
+		summary.reported++;
+		printf("%s\t%s\tW %.9g %.9g\tP %.9g,%.9g %.9g,%.9g\tValue %.9g,%.9g,%.9g %.9g,%.9g,%.9g\tgenotypes %d\tcall %s\n",
+				site_chrom(reference.gene).c_str(), reference.pos.c_str(),
+				ref.w, opt.w, ref.p[0], ref.p[1], opt.p[0], opt.p[1],
+				ref.value[0], ref.value[1], ref.value[2],
+				opt.value[0], opt.value[1], opt.value[2],
+				genotypes, call ? "differs" : "same");
+	}
+}
+
+//The pileup line pushed as an in-process producer would, sample by sample
+static int push_line(Engine &engine, const string &line)
+{
+	stringstream in(line);
+	string gene, pos, ref, cov, bases, base_quals, map_quals;
+	in >> gene >> pos >> ref;
+	engine.Begin_Site(gene, strtoul(pos.c_str(), NULL, 10), ref[0]);
+	for (int i = 0; i < params.sample_count; i++)
+	{
+		in >> cov >> bases;
+		if (stoi(cov) == 0)
+		{
+			if (bases == "*")
+				in >> base_quals;
+			continue;
+		}
+		in >> base_quals >> map_quals;
+		engine.Add_Sample(i, stoi(cov), bases, base_quals, map_quals);
+	}
+	return engine.End_Site();
+}
+
+//BAM files and reference of generated reads, returns their pileup lines
+static void generate_bam(const diff_options &options, vector<string> &bams, string &fasta, vector<string> &lines)
+{
+	static const float genotypes[3] = {0.0, 0.5, 1.0};
+	mt19937 rng(options.seed);
+	vector<string> names = {"chr1", "chr2", "chrM"};
+	vector<int> lengths = {(int) options.generate, max((int) options.generate / 2, 1), 100};
+	vector<string> references(2);
+	vector<vector<char>> alts(2);
+	for (int c = 0; c < 2; c++)
+	{
+		references[c] = synthetic_reference(rng, lengths[c]);
+		alts[c].assign(lengths[c], 0);
+		for (int p = 0; p < lengths[c]; p++)
+			if (rng() % 20 == 0)
+				alts[c][p] = "ACGT"[(strchr("ACGT", references[c][p]) - "ACGT" + 1 + rng() % 3) % 4];
+	}
+
+	//chrM is in the BAM headers only, without reads or sequence
+	vector<vector<synthetic_read>> reads(params.sample_count);
+	for (int i = 0; i < params.sample_count; i++)
+		for (int c = 0; c < 2; c++)
+		{
+			vector<float> genotype(lengths[c]);
+			for (int p = 0; p < lengths[c]; p++)
+				genotype[p] = genotypes[rng() % 3];
+			synthetic_reads(rng, c, references[c], alts[c], genotype, options.depth, reads[i]);
+		}
+
+	//Odd seeds leave the FASTA without a faidx index
+	fasta = options.bam_prefix + ".fa";
+	if (synthetic_write_fasta(fasta, vector<string>(names.begin(), names.begin() + 2), references, options.seed % 2 == 0) != 0)
+	{
+		cerr << "Write FASTA error : " << fasta << endl;
+		exit(1);
+	}
+	for (int i = 0; i < params.sample_count; i++)
+	{
+		bams.push_back(options.bam_prefix + "." + to_string(i) + ".bam");
+		if (synthetic_write_bam(bams[i], names, lengths, reads[i], (i == 0) ? 3 : 0) != 0)
+		{
+			cerr << "Write BAM error : " << bams[i] << endl;
+			exit(1);
+		}
+	}
+	synthetic_pileup(vector<string>(names.begin(), names.begin() + 2), references, reads, lines);
+}
+
+//Bases of a pileup column without the read start, read end and indel marks, as the BAM pileup prints them
+static string pileup_bases(const string &column)
+{
+	string bases;
+	for (size_t k = 0; k < column.size(); k++)
+	{
+		if (column[k] == '^')
+			k++;
+		else if ((column[k] == '+') || (column[k] == '-'))
+		{
+			size_t digits = 0;
+			int size = stoi(column.substr(k + 1), &digits);
+			k += digits + size;
+		}
+		else if (column[k] != '$')
+			bases += column[k];
+	}
+	return bases;
+}
+
+//The next site of the BAM pileup, at the position and with the depths and bases of the pileup line
+static int bam_site(site_record &line, site_record &record, const diff_options &options, diff_summary &summary)
+{
+	int candidate = -1;
+	if (bam_pileup.Has_Next())
+		candidate = bam_pileup.Next_Site(record);
+	else
+		clear_record(record, params);
+
+	bool same = (candidate >= 0) && (record.gene == line.gene) && (record.pos == line.pos) && (record.ref == line.ref) && (record.cov_vec == line.cov_vec);
+	for (int i = 0; same && (i < params.sample_count); i++)
+		same = (record.ref_vec[i] == pileup_bases(line.ref_vec[i]));
+	if (!same)
+	{
+		summary.column_mismatch++;
+		if (summary.reported < options.report)
+		{
+			summary.reported++;
+			printf("%s\t%s\tpileup line, BAM site %s\t%s\n", line.gene.c_str(), line.pos.c_str(),
+					(candidate < 0) ? "missing" : record.gene.c_str(), (candidate < 0) ? "" : record.pos.c_str());
+		}
+	}
+	return candidate;
+}
+
+int main(int argc, char *argv[])
+{
+	default_parameters(params);
+	diff_options options;
+	parse_options(argc, argv, options);
+
+	//Against the engine the text path runs the same options
+	Parameters optimized = params;
+	Parameters reference = params;
+	if (!options.engine && !options.bam)
+		reference_parameters(reference);
+	Engine engine;
+	if (options.engine && (engine.Open(optimized) != 0))
+		exit(1);
+
+	ifstream input_file;
+	istringstream bam_lines;
+	vector<string> bams;
+	string fasta;
+	if (options.bam)
+	{
+		vector<string> generated_lines;
+		generate_bam(options, bams, fasta, generated_lines);
+		string text;
+		for (unsigned int k = 0; k < generated_lines.size(); k++)
+			text += generated_lines[k] + "\n";
+		bam_lines.str(text);
+		if (bam_pileup.Open(bams, fasta) != 0)
+			exit(1);
+	}
+	else if (!options.input.empty())
+	{
+		input_file.open(options.input, ifstream::in);
+		if (!input_file)
+		{
+			cerr << "Open infile error: " << options.input << endl;
+			exit(1);
+		}
+	}
+
+	diff_summary summary = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	mt19937 rng(options.seed);
+	long generated = 0;
+	long line_count = 0;
+	vector<string> lines;
+	vector<site_record> ref_records(params.one_circle_limit), opt_records(params.one_circle_limit);
+	vector<em_worker> ref_workers(params.thread), opt_workers(params.thread);
+
+	istream *in = options.bam ? (istream *) &bam_lines : (options.input.empty() ? NULL : (istream *) &input_file);
+	while (next_lines(in, rng, options, generated, lines) > 0)
+	{
+		vector<Multi_Seq_Obj*> ref_sites, opt_sites;
+		vector<int> pairs;
+		for (int k = 0; k < lines.size(); k++)
+		{
+			//Same random state for both parses, Seq_Max_Filter draws from rand()
+			params = reference;
+			srand(line_count + k);
+			int ref_candidate = parse_site(lines[k], ref_records[k]);
+			params = optimized;
+			srand(line_count + k);
+			int opt_candidate;
+			if (options.engine)
+				opt_candidate = push_line(engine, lines[k]);
+			else if (options.bam)
+				opt_candidate = bam_site(ref_records[k], opt_records[k], options, summary);
+			else
+				opt_candidate = parse_site(lines[k], opt_records[k]);
+
+			if (ref_candidate != opt_candidate)
+				summary.candidate_mismatch++;
+			if ((ref_candidate == 1) && (opt_candidate == 1))
+			{
+				ref_sites.push_back(ref_records[k].mso);
+				if (!options.engine)
+					opt_sites.push_back(opt_records[k].mso);
+				pairs.push_back(k);
+			}
+			else
+			{
+				delete ref_records[k].mso;
+				if (!options.engine)
+					delete opt_records[k].mso;
+			}
+		}
+		line_count += lines.size();
+
+		params = reference;
+		calculate_sites(ref_sites, params.end_condition, params.thread, ref_workers);
+		params = optimized;
+		if (options.engine)
+			engine.Flush();
+		else
+			calculate_sites(opt_sites, params.end_condition, params.thread, opt_workers);
+
+		for (int k : pairs)
+		{
+			site_values ref, opt;
+			site_values_of(ref_records[k].mso, ref);
+			if (!options.engine)
+				site_values_of(opt_records[k].mso, opt);
+			else
+			{
+				//Calls come in push order, those without a reference site were counted when parsed
+				site_call call;
+				bool found = false;
+				while (!found && engine.Next_Call(call))
+					found = (call.chrom == ref_records[k].gene) && (call.pos == strtoul(ref_records[k].pos.c_str(), NULL, 10));
+				if (!found)
+				{
+					delete ref_records[k].mso;
+					continue;
+				}
+				site_values_of(call, opt);
+			}
+			compare_site(ref_records[k], ref, opt, options, summary);
+			delete ref_records[k].mso;
+			if (!options.engine)
+				delete opt_records[k].mso;
+		}
+	}
+	engine.Close();
+	if (options.bam)
+	{
+		//Sites of the BAM pileup past the last pileup line
+		site_record extra;
+		while (bam_pileup.Has_Next())
+		{
+			bam_pileup.Next_Site(extra);
+			delete extra.mso;
+			summary.column_mismatch++;
+		}
+		summary.column_mismatch += bam_pileup.Close();
+		remove(fasta.c_str());
+		remove((fasta + ".fai").c_str());
+		for (unsigned int i = 0; i < bams.size(); i++)
+			remove(bams[i].c_str());
+	}
+
+	bool failed = (summary.candidate_mismatch + summary.column_mismatch + summary.w_over + summary.p_over + summary.value_over
+			+ summary.genotype_mismatch + summary.call_mismatch + summary.bound_over) > 0;
+	failed = failed || (summary.lost_calls > options.tol_calls);
+	printf("lines %ld\tsites %ld\tcandidate mismatches %ld\n", line_count, summary.sites, summary.candidate_mismatch);
+	if (options.bam)
+		printf("column mismatches %ld\n", summary.column_mismatch);
+	if (optimized.prune)
+		printf("pruned %ld\tbound over %ld\n", summary.pruned, summary.bound_over);
+	if (optimized.screen_margin > 0)
+		printf("screened %ld\n", summary.screened);
+	if (optimized.coarse_step > optimized.step)
+		printf("refined %ld\tcoarse only %ld\n", summary.sites - summary.coarse, summary.coarse);
+	if ((optimized.screen_margin > 0) || (optimized.coarse_step > optimized.step))
+		printf("lost calls %ld (tolerance %ld)\n", summary.lost_calls, options.tol_calls);
+	printf("W max %.3g over %ld\tP max %.3g over %ld\tValue max %.3g over %ld\n",
+			summary.max_w, summary.w_over, summary.max_p, summary.p_over, summary.max_value, summary.value_over);
+	printf("genotype mismatches %ld\tcall mismatches %ld\t%s\n",
+			summary.genotype_mismatch, summary.call_mismatch, failed ? "FAILED" : "PASSED");
+	if (optimized.fast_math_verify)
+		math_report(cout);
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,267 @@
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include "engine.h"
+
+using namespace std;
+
+//Process settings, those of the first engine opened while any engine is open
+static mutex Engine_lock;
+static int Engines_open = 0;
+static Parameters Engine_kernels;
+
+static bool same_kernels(const Parameters &a, const Parameters &b)
+{
+	return (a.fast_math_level == b.fast_math_level) && (a.fast_math_verify == b.fast_math_verify)
+			&& (a.isa == b.isa) && (a.table_cache_bytes == b.table_cache_bytes);
+}
+
+static void fill_call(site_call &call, site_record &record, const Parameters &p)
+{
+	Multi_Seq_Obj *mso = record.mso;
+	call.chrom = record.gene;
+	call.pos = strtoul(record.pos.c_str(), NULL, 10);
+	call.ref = record.ref[0];
+	call.alt = mso->Get_Max_Allele();
+	call.w = mso->Get_W();
+	call.called = (call.w > 0.1) && (call.w < p.result_filter);
+	call.p[0] = mso->Get_P(0);
+	call.p[1] = mso->Get_P(1);
+	for (int j = 0; j < 3; j++)
+		call.value[j] = mso->Get_Value(j);
+	call.depth = record.cov_vec;
+	call.genotype.resize(p.sample_count);
+	for (unsigned int i = 0; i < p.sample_count; i++)
+		call.genotype[i] = mso->Get_E_Value_Max(i);
+}
+
+Engine::Engine()
+{
+	Opened = false;
+	Loaded = 0;
+	Min_batch = 0;
+	In_site = false;
+	Dropped = false;
+	Site = NULL;
+	Contig = 0;
+	Pos = 0;
+}
+
+Engine::~Engine()
+{
+	Close();
+}
+
+int Engine::Open(const Parameters &p)
+{
+	if (Opened)
+	{
+		cerr << "Engine error : already open" << endl;
+		return 1;
+	}
+
+	Params = p;
+	Params.result_filter = (Params.result_filter < 0.0) ? 0.0 : ((Params.result_filter > 1.0) ? 1.0 : Params.result_filter);
+	Params.store_samples = 0;
+	if (Params.reference)
+		reference_parameters(Params);
+	if (Params.sample_count == 0)
+	{
+		cerr << "Sample number must be at least 1" << endl;
+		return 1;
+	}
+	if (Params.thread < 1)
+	{
+		cerr << "Thread number must be at least 1" << endl;
+		return 1;
+	}
+	if ((Params.fast_math_level < 0) || (Params.fast_math_level >= MATH_LEVELS))
+	{
+		cerr << "Fast math level must be 0, 1 or 2" << endl;
+		return 1;
+	}
+	if ((Params.coarse_step > 0) && (Params.coarse_step >= Params.end_condition / 2))
+	{
+		cerr << "Error : Coarse step must be below " << Params.end_condition / 2 << endl;
+		return 1;
+	}
+
+	{
+		lock_guard<mutex> guard(Engine_lock);
+		if (Engines_open == 0)
+		{
+			if (isa_select(Params.isa) != 0)
+			{
+				cerr << "Instruction set " << Params.isa << " is not supported, ";
+				isa_report(cerr);
+				return 1;
+			}
+			kernel_select(Params);
+			Engine_kernels = Params;
+		}
+		else if (!same_kernels(Params, Engine_kernels))
+		{
+			cerr << "Engine error : fast math level, instruction set and table cache differ from the open engines" << endl;
+			return 1;
+		}
+		Engines_open++;
+	}
+
+	Workers.assign(Params.thread, em_worker());
+	Min_batch = Params.thread * max((int) Params.tile, 1) * MIN_SITES_PER_WORKER;
+	Records.resize(max(Params.one_circle_limit, 1));
+	Loaded = 0;
+	In_site = false;
+	Opened = true;
+	return 0;
+}
+
+int Engine::Close()
+{
+	if (!Opened)
+		return 0;
+	if (In_site)
+		End_Site();
+	int result = Flush();
+
+	lock_guard<mutex> guard(Engine_lock);
+	Engines_open--;
+	Opened = false;
+	return result;
+}
+
+int Engine::Begin_Site(const string &chrom, unsigned int pos, char ref)
+{
+	if (!Opened || In_site)
+	{
+		cerr << "Engine error : site " << chrom << ":" << pos << " begun " << (Opened ? "inside another site" : "before Open") << endl;
+		return 1;
+	}
+
+	if (Loaded == Records.size())
+		Records.resize(2 * Records.size());
+	site_record &record = Records[Loaded];
+	clear_record(record, Params);
+	record.gene = chrom;
+	record.pos = to_string(pos);
+	record.ref.assign(1, ref);
+
+	In_site = true;
+	Dropped = false;
+	Site = NULL;
+	if (ref == 'N')
+	{
+		stats.Add(COUNT_REF_N);
+		return 0;
+	}
+
+	Start = Arena.Get_Mark();
+	Site = arena_new<Multi_Seq_Obj>(&Arena, Params.sample_count, Params.type, &Arena);
+	Site->Set_Parameters(&Params);
+	Contig = intern_contig(chrom);
+	Pos = pos;
+	return 0;
+}
+
+int Engine::Add_Sample(unsigned int sample, int depth, const string &bases, const string &base_quals, const string &map_quals)
+{
+	if (!In_site || (sample >= Params.sample_count))
+	{
+		cerr << "Engine error : sample " << sample << (In_site ? " out of range" : " added outside a site") << endl;
+		return -1;
+	}
+	if ((Site == NULL) || Dropped)
+		return 0;
+	if (depth == 0)
+	{
+		stats.Add(COUNT_SAMPLE_NO_COVERAGE);
+		return 0;
+	}
+
+	site_record &record = Records[Loaded];
+	record.cov_vec[sample] = depth;
+	record.ref_vec[sample] = bases;
+	if (base_quals.size() != map_quals.size())
+	{
+		stats.Add(COUNT_SAMPLE_QUAL_LENGTH);
+		return 0;
+	}
+
+	Seq_Obj *seq_obj = arena_new<Seq_Obj>(&Arena, Contig, Pos, record.ref[0], depth, bases, base_quals, map_quals,
+			Params.type, Params.step, Params.end_condition, &Arena);
+	try
+	{
+		return add_sample(Site, seq_obj, sample, &Arena, Params);
+	} catch (std::invalid_argument &)
+	{
+		//A malformed indel in the bases drops the site, as a malformed pileup line
+		stats.Add(COUNT_PARSE_ERROR);
+		Dropped = true;
+		return 0;
+	}
+}
+
+int Engine::End_Site()
+{
+	if (!In_site)
+	{
+		cerr << "Engine error : site ended before it began" << endl;
+		return -1;
+	}
+	In_site = false;
+	if (Site == NULL)
+		return 0;
+	if (Dropped)
+	{
+		arena_delete(&Arena, Site);
+		Arena.Rewind(Start);
+		return 0;
+	}
+	if (candidate_site(Records[Loaded], Site, &Arena, Start, Params) == 0)
+		return 0;
+
+	Loaded++;
+	if ((Params.mem_budget == 0) ? (Loaded >= Params.one_circle_limit) : ((Arena.Get_Bytes() >= Params.mem_budget) && (Loaded >= Min_batch)))
+		Flush();
+	return 1;
+}
+
+int Engine::Flush()
+{
+	if (In_site)
+	{
+		cerr << "Engine error : flushed inside a site" << endl;
+		return 1;
+	}
+	if (Loaded == 0)
+		return 0;
+
+	vector<Multi_Seq_Obj*> sites(Loaded);
+	for (int i = 0; i < Loaded; i++)
+		sites[i] = Records[i].mso;
+	calculate_sites(Params, sites, Params.end_condition, Params.thread, Workers);
+
+	for (int i = 0; i < Loaded; i++)
+	{
+		site_call call;
+		fill_call(call, Records[i], Params);
+		if (Callback)
+			Callback(call);
+		else
+			Calls.push_back(call);
+		Records[i].mso = NULL;
+	}
+	Arena.Reset();
+	Loaded = 0;
+	return 0;
+}
+
+bool Engine::Next_Call(site_call &call)
+{
+	if (Calls.empty())
+		return false;
+	call = Calls.front();
+	Calls.pop_front();
+	return true;
+}
@@ -0,0 +1,109 @@
+/*
+ * engine.h
+ *
+ * Calling engine of libmultigems, for programs that produce the pileup
+ * themselves and would otherwise write it out as text for multigems. Each
+ * site is pushed sample by sample, the sites are calculated -C at a time
+ * (or by --mem-budget) with the -t threads as in multigems, and every
+ * candidate site comes back in push order, through the callback if one is
+ * set or else from Next_Call, with the values multigems outputs.
+ *
+ * An engine holds its own parameters and sites, so several engines can
+ * run at once in one process. The math level, the vector kernels and the
+ * table cache are shared by the process: the first engine opened selects
+ * them, and the others only open with the same settings.
+ *
+ *   Parameters p;
+ *   default_parameters(p);
+ *   p.sample_count = 2;
+ *   Engine engine;
+ *   engine.Open(p);
+ *   engine.Begin_Site("chr1", 1000, 'A');
+ *   engine.Add_Sample(0, 5, "..,G,", "IIFI5", "]]]]]");
+ *   engine.Add_Sample(1, 4, ".GgG", "IIII", "]]]]");
+ *   engine.End_Site();
+ *   engine.Close(); //Calculates the sites still held
+ *
+ * Link with libmultigems.a, -fopenmp -pthread and -lz.
+ */
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+#include "core_functions.h"
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+using namespace std;
+
+//One calculated site
+typedef struct _site_call {
+	string chrom;
+	unsigned int pos;
+	char ref;
+	char alt;             //Most common non reference allele of the samples held, N if none
+	bool called;          //lFDR above 0.1 and below -f, the sites multigems outputs
+	float w;              //lFDR
+	float p[2];           //P0 and P1
+	float value[3];       //Genotype model proportions RR, NN and RN (0 for haploid sites)
+	vector<int> depth;    //Per sample pileup depth, 0 for samples not pushed
+	vector<int> genotype; //Per sample genotype model (0 RR, 1 NN, 2 RN), -1 for samples the site does not hold
+} site_call;
+
+typedef function<void(const site_call &call)> site_callback;
+
+class Engine {
+public:
+	Engine();
+	~Engine();
+
+	//Checks p as multigems checks its options, returns 1 on an error
+	int Open(const Parameters &p);
+	//Calculates the sites still held, then releases the process settings
+	int Close();
+
+	//Calls go to the callback, in the thread pushing the sites, instead of Next_Call
+	inline void Set_Callback(site_callback callback)
+	{
+		Callback = callback;
+	}
+
+	//Sites come contig by contig in increasing position, as in a pileup
+	int Begin_Site(const string &chrom, unsigned int pos, char ref);
+	//bases, base_quals and map_quals are the columns 5 to 7 of the sample in a samtools mpileup -s
+	//line, or the same with one base per read (. or , for the reference, ACGTN or * for a deletion),
+	//qualities Phred+33; returns 1 if the sample was kept, 0 if filtered out and -1 on an error
+	int Add_Sample(unsigned int sample, int depth, const string &bases, const string &base_quals, const string &map_quals);
+	//Returns 1 if the site is a candidate and will be called, the batch runs once full
+	int End_Site();
+	//Calculates the sites held now
+	int Flush();
+
+	bool Next_Call(site_call &call);
+
+private:
+	Parameters Params;
+	bool Opened;
+	Site_Arena Arena;
+	vector<site_record> Records; //Candidate sites held, then the site being pushed
+	int Loaded;
+	int Min_batch;
+	vector<em_worker> Workers;
+
+	//Site being pushed
+	bool In_site;
+	bool Dropped;
+	Multi_Seq_Obj *Site;
+	Site_Arena::mark Start;
+	unsigned int Contig;
+	unsigned int Pos;
+
+	site_callback Callback;
+	deque<site_call> Calls;
+
+	Engine(const Engine &);
+	Engine &operator=(const Engine &);
+};
+
+#endif
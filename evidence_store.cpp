@@ -0,0 +1,327 @@
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include "evidence_store.h"
+
+//Flushed to the file in blocks of about this size
+#define STORE_BUFFER_SIZE (1 << 20)
+
+Evidence_Store evidence_store;
+
+//Values are stored in the byte order of the host
+template <class T>
+static inline void Put(string &out, T value)
+{
+	out.append((const char*) &value, sizeof(T));
+}
+
+template <class T>
+static inline void Get(ifstream &in, T &value)
+{
+	in.read((char*) &value, sizeof(T));
+}
+
+Evidence_Store::Evidence_Store()
+{
+	In_samples = 0;
+	In_sites = 0;
+	Last_rank = -1;
+	Next_valid = false;
+	Next_contig = 0;
+	Next_pos = 0;
+	Next_ref = 'N';
+	Next_flags = 0;
+	Out_samples = 0;
+	Out_flushed = 0;
+}
+
+int Evidence_Store::Open_Input(const string &filename)
+{
+	In.open(filename, ios::in | ios::binary);
+	if (!In)
+	{
+		cerr << "Open store error : " << filename << endl;
+		return 1;
+	}
+
+	char magic[8];
+	uint32_t version, samples, max_count;
+	int32_t bp, mp;
+	float ratio_nchar, ratio_del;
+	In.read(magic, 8);
+	Get(In, version);
+	Get(In, samples);
+	Get(In, bp);
+	Get(In, mp);
+	Get(In, max_count);
+	Get(In, ratio_nchar);
+	Get(In, ratio_del);
+	streampos sites = In.tellg();
+	if (!In || (memcmp(magic, STORE_MAGIC, 8) != 0) || (version != STORE_VERSION))
+	{
+		cerr << "Not an evidence store : " << filename << endl;
+		return 1;
+	}
+	//The stored reads are only valid under the filters they went through
+	if ((bp != params.bp) || (mp != params.mp) || (max_count != params.max_count)
+			|| (ratio_nchar != params.ratio_nchar) || (ratio_del != params.ratio_del))
+	{
+		cerr << "Evidence store was filtered with -b " << bp << " -m " << mp << " -M " << max_count
+				<< " -n " << ratio_nchar << " -l " << ratio_del << " : " << filename << endl;
+		return 1;
+	}
+	In_samples = samples;
+
+	uint64_t index;
+	In.seekg(-16, ios::end);
+	Get(In, index);
+	In.read(magic, 8);
+	if (!In || (memcmp(magic, STORE_INDEX_MAGIC, 8) != 0))
+	{
+		cerr << "Evidence store without index : " << filename << endl;
+		return 1;
+	}
+
+	uint32_t contigs;
+	In.seekg(index);
+	Get(In, contigs);
+	In_contigs.resize(contigs);
+	for (unsigned int i = 0; i < contigs; i++)
+	{
+		uint32_t length;
+		uint64_t offset, count;
+		Get(In, length);
+		In_contigs[i].name.resize(length);
+		In.read(&In_contigs[i].name[0], length);
+		Get(In, offset);
+		Get(In, count);
+		In_contigs[i].offset = offset;
+		In_contigs[i].sites = count;
+		In_rank[In_contigs[i].name] = i;
+		In_sites += count;
+	}
+	if (!In)
+	{
+		cerr << "Read store index error : " << filename << endl;
+		return 1;
+	}
+
+	In.seekg(sites);
+	Read_Next();
+	return 0;
+}
+
+void Evidence_Store::Read_Next()
+{
+	Next_valid = (In_sites > 0);
+	if (!Next_valid)
+		return;
+	In_sites--;
+
+	uint32_t contig, pos;
+	Get(In, contig);
+	Get(In, pos);
+	Get(In, Next_ref);
+	Get(In, Next_flags);
+	if (!In || (contig >= In_contigs.size()))
+	{
+		cerr << "Read store error" << endl;
+		exit(0);
+	}
+	Next_contig = contig;
+	Next_pos = pos;
+}
+
+int Evidence_Store::Contig_Rank(const string &gene)
+{
+	if (gene != Last_gene)
+	{
+		unordered_map<string, unsigned int>::iterator it = In_rank.find(gene);
+		Last_rank = (it == In_rank.end()) ? -1 : (int) it->second;
+		Last_gene = gene;
+	}
+	return Last_rank;
+}
+
+bool Evidence_Store::Stored_First(const string &gene, unsigned int pos)
+{
+	if (!Next_valid)
+		return false;
+	int rank = Contig_Rank(gene);
+	if (rank < 0)
+		return false;
+	return (Next_contig < rank) || ((Next_contig == rank) && (Next_pos < pos));
+}
+
+bool Evidence_Store::Stored_Same(const string &gene, unsigned int pos)
+{
+	return Next_valid && (Contig_Rank(gene) == (int) Next_contig) && (Next_pos == pos);
+}
+
+void Evidence_Store::Site_Header(site_record &record)
+{
+	record.gene = In_contigs[Next_contig].name;
+	record.pos = to_string(Next_pos);
+	record.ref.assign(1, Next_ref);
+}
+
+//Stored samples of the next site into the site, returns 0 if the site was dropped when stored
+int Evidence_Store::Load_Site(site_record &record, Multi_Seq_Obj *mso, Site_Arena *arena)
+{
+	unsigned int contig = intern_contig(In_contigs[Next_contig].name);
+	uint32_t entries;
+	Get(In, entries);
+	for (unsigned int e = 0; e < entries; e++)
+	{
+		uint32_t sample, length;
+		int32_t cov;
+		unsigned char inserted;
+		Get(In, sample);
+		Get(In, cov);
+		Get(In, length);
+		Bases.resize(length);
+		In.read(&Bases[0], length);
+		Get(In, inserted);
+		if (!In || (sample >= In_samples))
+		{
+			cerr << "Read store error" << endl;
+			exit(0);
+		}
+		record.cov_vec[sample] = cov;
+		record.ref_vec[sample] = Bases;
+
+		if (inserted)
+		{
+			char max_allele;
+			int32_t max_allele_count;
+			uint32_t read_count;
+			Get(In, max_allele);
+			Get(In, max_allele_count);
+			Get(In, read_count);
+			Reads.resize(read_count + (read_count + 7) / 8);
+			In.read((char*) Reads.data(), Reads.size());
+			Seq_Obj *seq_obj = arena_new<Seq_Obj>(arena, contig, Next_pos, Next_ref, cov, Reads.data(), read_count,
+					max_allele, max_allele_count, params.type, params.step, params.end_condition, arena);
+			mso->Insert(seq_obj, sample);
+			mso->Enable();
+		}
+	}
+	if (!In)
+	{
+		cerr << "Read store error" << endl;
+		exit(0);
+	}
+
+	int loaded = (Next_flags & STORE_SITE_DROPPED) ? 0 : 1;
+	Read_Next();
+	return loaded;
+}
+
+int Evidence_Store::Open_Output(const string &filename, unsigned int samples)
+{
+	Out.open(filename, ios::out | ios::binary);
+	if (!Out)
+	{
+		cerr << "Open store error : " << filename << endl;
+		return 1;
+	}
+	Out_name = filename;
+	Out_samples = samples;
+
+	Buffer.append(STORE_MAGIC, 8);
+	Put<uint32_t>(Buffer, STORE_VERSION);
+	Put<uint32_t>(Buffer, samples);
+	Put<int32_t>(Buffer, params.bp);
+	Put<int32_t>(Buffer, params.mp);
+	Put<uint32_t>(Buffer, params.max_count);
+	Put<float>(Buffer, params.ratio_nchar);
+	Put<float>(Buffer, params.ratio_del);
+	return 0;
+}
+
+//Every sample with coverage, the filtered reads of those the site holds
+void Evidence_Store::Write_Site(site_record &record, Multi_Seq_Obj *mso, bool dropped)
+{
+	unordered_map<string, unsigned int>::iterator it = Out_index.find(record.gene);
+	unsigned int contig;
+	if (it == Out_index.end())
+	{
+		contig = Out_contigs.size();
+		store_contig added = {record.gene, Out_flushed + Buffer.size(), 0};
+		Out_contigs.push_back(added);
+		Out_index[record.gene] = contig;
+	}
+	else
+		contig = it->second;
+	Out_contigs[contig].sites++;
+
+	Put<uint32_t>(Buffer, contig);
+	Put<uint32_t>(Buffer, strtoul(record.pos.c_str(), NULL, 10));
+	Put<char>(Buffer, record.ref[0]);
+	Put<unsigned char>(Buffer, dropped ? STORE_SITE_DROPPED : 0);
+
+	uint32_t entries = 0;
+	if (!dropped)
+		for (unsigned int i = 0; i < Out_samples; i++)
+			entries += (record.cov_vec[i] != 0);
+	Put<uint32_t>(Buffer, entries);
+
+	for (unsigned int i = 0; (i < Out_samples) && (entries > 0); i++)
+	{
+		if (record.cov_vec[i] == 0)
+			continue;
+		int k = mso->Find_Sample(i);
+		Put<uint32_t>(Buffer, i);
+		Put<int32_t>(Buffer, record.cov_vec[i]);
+		Put<uint32_t>(Buffer, record.ref_vec[i].size());
+		Buffer += record.ref_vec[i];
+		Put<unsigned char>(Buffer, (k >= 0) ? 1 : 0);
+		if (k >= 0)
+		{
+			Seq_Obj *seq_obj = mso->Seq_obj_s[k];
+			Put<char>(Buffer, seq_obj->Max_allele);
+			Put<int32_t>(Buffer, seq_obj->Max_allele_count);
+			Put<uint32_t>(Buffer, seq_obj->Read_count);
+			Buffer.append((const char*) seq_obj->Reads.data(), seq_obj->Reads.size());
+		}
+	}
+
+	if (Buffer.size() >= STORE_BUFFER_SIZE)
+		Write_Buffer();
+}
+
+void Evidence_Store::Write_Buffer()
+{
+	Out.write(Buffer.data(), Buffer.size());
+	Out_flushed += Buffer.size();
+	Buffer.clear();
+}
+
+int Evidence_Store::Close()
+{
+	if (In.is_open())
+		In.close();
+	if (!Out.is_open())
+		return 0;
+
+	uint64_t index = Out_flushed + Buffer.size();
+	Put<uint32_t>(Buffer, Out_contigs.size());
+	for (unsigned int i = 0; i < Out_contigs.size(); i++)
+	{
+		Put<uint32_t>(Buffer, Out_contigs[i].name.size());
+		Buffer += Out_contigs[i].name;
+		Put<uint64_t>(Buffer, Out_contigs[i].offset);
+		Put<uint64_t>(Buffer, Out_contigs[i].sites);
+	}
+	Put<uint64_t>(Buffer, index);
+	Buffer.append(STORE_INDEX_MAGIC, 8);
+	Write_Buffer();
+	Out.close();
+	if (!Out)
+	{
+		cerr << "Write store error : " << Out_name << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * evidence_store.h
+ *
+ * On-disk store of the filtered evidence of every sample at every site
+ * (--store-out), so a cohort can grow without parsing it again: a later
+ * run loads the stored samples (--store-in) and parses only the pileup of
+ * the new samples, which are numbered after the stored ones. The filtered
+ * reads are kept packed as in Seq_Obj, from which the likelihood tables are
+ * rebuilt, with the depth and pileup bases the output prints.
+ *
+ * Layout: a header with the sample count and the filter parameters the
+ * reads were filtered with, the sites in input order, then an index of the
+ * contigs (name, offset of the first site, site count) and a trailer with
+ * the offset of the index.
+ */
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "core_functions.h"
+
+#ifndef EVIDENCE_STORE_H
+#define EVIDENCE_STORE_H
+
+#define STORE_MAGIC "MGSTORE1"
+#define STORE_INDEX_MAGIC "MGINDEX1"
+#define STORE_VERSION 1
+//Site flags
+#define STORE_SITE_DROPPED 1
+
+using namespace std;
+
+class Evidence_Store {
+public:
+	Evidence_Store();
+
+	int Open_Input(const string &filename);
+	int Open_Output(const string &filename, unsigned int samples);
+	int Close();
+
+	inline bool Reading()
+	{
+		return In.is_open();
+	}
+
+	inline bool Writing()
+	{
+		return Out.is_open();
+	}
+
+	inline unsigned int Get_Samples()
+	{
+		return In_samples;
+	}
+
+	inline bool Has_Next()
+	{
+		return Next_valid;
+	}
+
+	//The next stored site comes before the pileup site, by the contig order of the store
+	bool Stored_First(const string &gene, unsigned int pos);
+	//The next stored site is the pileup site
+	bool Stored_Same(const string &gene, unsigned int pos);
+
+	void Site_Header(site_record &record);
+	int Load_Site(site_record &record, Multi_Seq_Obj *mso, Site_Arena *arena);
+	void Write_Site(site_record &record, Multi_Seq_Obj *mso, bool dropped);
+
+private:
+	typedef struct _store_contig {
+		string name;
+		unsigned long long offset;
+		unsigned long long sites;
+	} store_contig;
+
+	ifstream In;
+	unsigned int In_samples;
+	vector<store_contig> In_contigs;
+	unordered_map<string, unsigned int> In_rank;
+	unsigned long long In_sites;
+	string Last_gene;
+	int Last_rank;
+	//Header of the next stored site
+	bool Next_valid;
+	unsigned int Next_contig;
+	unsigned int Next_pos;
+	char Next_ref;
+	unsigned char Next_flags;
+	vector<unsigned char> Reads;
+	string Bases;
+
+	ofstream Out;
+	string Out_name;
+	unsigned int Out_samples;
+	vector<store_contig> Out_contigs;
+	unordered_map<string, unsigned int> Out_index;
+	unsigned long long Out_flushed;
+	string Buffer;
+
+	void Read_Next();
+	int Contig_Rank(const string &gene);
+	void Write_Buffer();
+};
+
+extern Evidence_Store evidence_store;
+
+#endif
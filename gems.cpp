@@ -3,6 +3,8 @@
 #include <vector>
 
 #include "core_functions.h"
+#include "evidence_store.h"
+#include "bam_pileup.h"
 
 using namespace std;
 
@@ -13,30 +15,7 @@ int main(int argc, char * argv[])
     
     vector<string> infilename;
 
-    //Parameters params;
-    params.sample_count = 3;
-    params.type = 3; //polidy
-    params.max_count = 255;//Max allele count
-    params.thread = 1;
-    params.ratio_nchar = 0.1;
-    params.ratio_del = 0.5;
-    
-    params.step = 0.01;//Steps
-    params.eps = 0.001;
-    params.p_snp = 0.1;
-    
-    //lFDR output filter with a default of 0.1.  In this way, only sites with an estimated lFDR less than 0.1 should be provided in the final output.  If a user decides to output all analyzed sites, he can change this parameter setting to 1
-    params.result_filter = 0.5;
-    params.one_circle_limit = 200;
-    params.end_condition = 0.5;
-
-    params.bp = 17;
-    params.mp = 20;
-    
-    params.min = 1;
-    params.max = 200;
-    
-    params.start_position = 16691745;
+    default_parameters(params);
 
     int arg_pos = 1;
 
@@ -47,7 +26,7 @@ int main(int argc, char * argv[])
 		    printhelp();
 	    }
 
-    params.debug = false;
+    bool input_given = false;
       
     while(arg_pos < argc)
     {
@@ -67,10 +46,88 @@ int main(int argc, char * argv[])
     	{
                             case 'i':
                             	listname = argv[option_pos];
+                            	input_given = true;
                             	break;
                             case 'o':
                             	outfilename = argv[option_pos];
                             	break;
+                            case '-':
+                                if (string(argv[arg_pos]) == "--stats")
+                                {
+                                    params.stats_file = argv[option_pos];
+                                    stats.Enable();
+                                }
+                                else if (string(argv[arg_pos]) == "--stats-batch")
+                                    params.stats_batch = (stoi(argv[option_pos]) != 0);
+                                else if (string(argv[arg_pos]) == "--reference")
+                                    params.reference = (stoi(argv[option_pos]) != 0);
+                                else if (string(argv[arg_pos]) == "--mem-budget")
+                                    params.mem_budget = parse_bytes(argv[option_pos]);
+                                else if (string(argv[arg_pos]) == "--fast-math-level")
+                                {
+                                    params.fast_math_level = stoi(argv[option_pos]);
+                                    if ((params.fast_math_level < 0) || (params.fast_math_level >= MATH_LEVELS))
+                                    {
+                                        cerr << "Fast math level must be 0, 1 or 2" << endl;
+                                        exit(0);
+                                    }
+                                }
+                                else if (string(argv[arg_pos]) == "--fast-math-verify")
+                                    params.fast_math_verify = (stoi(argv[option_pos]) != 0);
+                                else if (string(argv[arg_pos]) == "--isa")
+                                {
+                                    params.isa = argv[option_pos];
+                                    if (isa_select(params.isa) != 0)
+                                    {
+                                        cerr << "Instruction set " << params.isa << " is not supported, ";
+                                        isa_report(cerr);
+                                        exit(0);
+                                    }
+                                }
+                                else if (string(argv[arg_pos]) == "--wide-site")
+                                    params.wide_site = stoul(argv[option_pos]);
+                                else if (string(argv[arg_pos]) == "--table-cache")
+                                    params.table_cache_bytes = parse_bytes(argv[option_pos]);
+                                else if (string(argv[arg_pos]) == "--prune")
+                                    params.prune = (stoi(argv[option_pos]) != 0);
+                                else if (string(argv[arg_pos]) == "--screen")
+                                    params.screen_margin = stof(argv[option_pos]);
+                                else if (string(argv[arg_pos]) == "--screen-verify")
+                                {
+                                    params.screen_verify = (stoi(argv[option_pos]) != 0);
+                                    if (params.screen_verify)
+                                        stats.Count();
+                                }
+                                else if (string(argv[arg_pos]) == "--coarse-step")
+                                    params.coarse_step = stof(argv[option_pos]);
+                                else if (string(argv[arg_pos]) == "--refine-band")
+                                    params.refine_band = stof(argv[option_pos]);
+                                else if (string(argv[arg_pos]) == "--store-in")
+                                    params.store_in = argv[option_pos];
+                                else if (string(argv[arg_pos]) == "--store-out")
+                                    params.store_out = argv[option_pos];
+                                else if (string(argv[arg_pos]) == "--bam")
+                                    params.bam_list = argv[option_pos];
+                                else if (string(argv[arg_pos]) == "--ref")
+                                    params.ref_fasta = argv[option_pos];
+                                else if (string(argv[arg_pos]) == "--progress")
+                                    params.progress_interval = stof(argv[option_pos]);
+                                else if (string(argv[arg_pos]) == "--progress-file")
+                                    params.progress_file = argv[option_pos];
+                                else
+                                {
+                                    cerr<<"Unrec argument: " << argv[arg_pos] << endl;
+                                    printhelp();
+                                }
+                                break;
+                            case 'O':
+                                params.output_type = argv[option_pos][0];
+                                if ((params.output_type != 'v') && (params.output_type != 'b'))
+                                {
+                                    cerr << "Output type must be v (text) or b (BCF)" << endl;
+                                    exit(0);
+                                }
+                                break;
                             case 'n' :
                             	params.ratio_nchar = stof(argv[option_pos]);
                             	break;
@@ -107,6 +164,12 @@ int main(int argc, char * argv[])
                             case 'S':
                                 params.sample_count = stoi(argv[option_pos]);
                                 break;
+                            case 'd':
+                                params.type = (stoi(argv[option_pos]) == 0) ? 3 : 2;
+                                break;
+                            case 'B':
+                                params.tile = stoi(argv[option_pos]);
+                                break;
                             default :
                             	cerr<<"Unrec argument: " << argv[arg_pos] << endl;
                             	printhelp();
@@ -119,18 +182,65 @@ int main(int argc, char * argv[])
     
     //params.sample_count = Get_Name_List(listname.c_str(), infilename);
 
-    if (params.sample_count == 0)
+    if (params.max_count < 0)
     {
-    	cerr << "Sample number must be at least 1" << endl;
+    	cerr << "Error : Max allele count must larger than 0!" << endl;
     	exit(0);
     }
-    
-    if (params.max_count < 0)
+
+    if ((params.coarse_step > 0) && (params.coarse_step >= params.end_condition / 2))
     {
-    	cerr << "Error : Max allele count must larger than 0!" << endl;
+    	cerr << "Error : Coarse step must be below " << params.end_condition / 2 << endl;
     	exit(0);
     }
 
+    if (params.reference)
+        reference_parameters(params);
+
+    //One sample per BAM file, piled up here in place of the pileup of -i
+    if (!params.bam_list.empty())
+    {
+        if (input_given || !params.store_in.empty())
+        {
+            cerr << "--bam cannot be used with -i or --store-in" << endl;
+            exit(0);
+        }
+        if (params.ref_fasta.empty())
+        {
+            cerr << "--bam needs the reference FASTA (--ref)" << endl;
+            exit(0);
+        }
+        vector<string> bams;
+        Get_Name_List(params.bam_list, bams);
+        if (bam_pileup.Open(bams, params.ref_fasta) != 0)
+            exit(0);
+        listname.clear();
+        params.sample_count = bams.size();
+    }
+
+    //Stored samples come first, the pileup samples (-S) are numbered after them
+    if (!params.store_in.empty())
+    {
+        if (evidence_store.Open_Input(params.store_in) != 0)
+            exit(0);
+        if (!input_given)
+        {
+            listname.clear();
+            params.sample_count = 0;
+        }
+        params.store_samples = evidence_store.Get_Samples();
+        params.sample_count += params.store_samples;
+    }
+
+    if (params.sample_count == 0)
+    {
+    	cerr << "Sample number must be at least 1" << endl;
+    	exit(0);
+    }
+
+    if (!params.store_out.empty() && (evidence_store.Open_Output(params.store_out, params.sample_count) != 0))
+        exit(0);
+
     //calculate_preprocess(infilename, outfilename);
     constrains(listname, outfilename);
 
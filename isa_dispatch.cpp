@@ -0,0 +1,80 @@
+#include "isa_kernels.h"
+
+#define ISA_PATHS 4
+
+extern const isa_kernels isa_kernels_generic;
+extern const isa_kernels isa_kernels_sse42;
+extern const isa_kernels isa_kernels_avx2;
+extern const isa_kernels isa_kernels_avx512;
+
+typedef struct _isa_path {
+	const char *name;
+	const isa_kernels *kernels;
+} isa_path;
+
+//Narrowest first
+static const isa_path Isa_paths[ISA_PATHS] = {
+	{"generic", &isa_kernels_generic},
+	{"sse4.2", &isa_kernels_sse42},
+	{"avx2", &isa_kernels_avx2},
+	{"avx512", &isa_kernels_avx512}
+};
+
+//cpuid, including whether the OS saves the wider registers
+static bool isa_supported(int path)
+{
+	__builtin_cpu_init();
+	switch (path)
+	{
+		case 1:
+			return __builtin_cpu_supports("sse4.2");
+		case 2:
+			return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+		case 3:
+			return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+		default:
+			return true;
+	}
+}
+
+static int isa_widest()
+{
+	int path = ISA_PATHS - 1;
+	while ((path > 0) && !isa_supported(path))
+		path--;
+	return path;
+}
+
+static int Isa_path = isa_widest();
+const isa_kernels *isa = Isa_paths[Isa_path].kernels;
+
+int isa_select(const string &name)
+{
+	int path = -1;
+	if (name == "auto")
+		path = isa_widest();
+	else
+		for (int k = 0; k < ISA_PATHS; k++)
+			if ((name == Isa_paths[k].name) && isa_supported(k))
+				path = k;
+	if (path < 0)
+		return -1;
+
+	Isa_path = path;
+	isa = Isa_paths[path].kernels;
+	return 0;
+}
+
+const char *isa_name()
+{
+	return Isa_paths[Isa_path].name;
+}
+
+void isa_report(ostream &out)
+{
+	out << "isa " << isa_name() << ", supported";
+	for (int k = 0; k < ISA_PATHS; k++)
+		if (isa_supported(k))
+			out << " " << Isa_paths[k].name;
+	out << endl;
+}
@@ -0,0 +1,156 @@
+/*
+ * isa_kernels.cpp
+ *
+ * Built once per instruction set by the Makefile, with ISA_NAME naming the
+ * build. The kernels and the inline math they use are compiled inside a
+ * namespace of that name, so no out of line copy built for a wider
+ * instruction set is shared with the other objects.
+ */
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <ostream>
+
+#define ISA_ACCUMULATORS 16
+
+namespace ISA_NAME {
+
+#include "math_kernels.h"
+
+template <int LEVEL>
+static void grid_log_sum(const float *w, const float *nn, int length, const float *r, const float *n, int count, float *result)
+{
+	for (int i = 0; i < count; i++)
+		result[i] = 0.0;
+	for (int k = 0; k < length; k++)
+	{
+		float a = (nn[k] != 0.0f) ? 1.0f - w[k] : w[k];
+		float b = 1.0f - a;
+		#pragma omp simd
+		for (int i = 0; i < count; i++)
+			result[i] = result[i] + math_log_level<LEVEL>(r[i] * a + n[i] * b);
+	}
+}
+
+template <int LEVEL>
+static void grid_log_classes(const float *class_w, const float *class_nn, int classes, const int *cls, int length,
+		const float *r, const float *n, int count, float *logs, float *result)
+{
+	//The row of logs of every read class, then the reads add theirs in order
+	for (int c = 0; c < classes; c++)
+	{
+		float a = (class_nn[c] != 0.0f) ? 1.0f - class_w[c] : class_w[c];
+		float b = 1.0f - a;
+		float *row = &logs[c * count];
+		#pragma omp simd
+		for (int i = 0; i < count; i++)
+			row[i] = math_log_level<LEVEL>(r[i] * a + n[i] * b);
+	}
+
+	for (int i = 0; i < count; i++)
+		result[i] = 0.0;
+	for (int k = 0; k < length; k++)
+	{
+		const float *row = &logs[cls[k] * count];
+		#pragma omp simd
+		for (int i = 0; i < count; i++)
+			result[i] = result[i] + row[i];
+	}
+}
+
+//Read j is added to accumulator j % 16 and the accumulators are added in order,
+//the same sums at every vector width
+template <int LEVEL>
+static float log_sum(const float *w, const float *nn, int length, float r, float n)
+{
+	float acc[ISA_ACCUMULATORS];
+	for (int k = 0; k < ISA_ACCUMULATORS; k++)
+		acc[k] = 0.0f;
+
+	int j = 0;
+	for (; j + ISA_ACCUMULATORS <= length; j += ISA_ACCUMULATORS)
+	{
+		#pragma omp simd
+		for (int k = 0; k < ISA_ACCUMULATORS; k++)
+		{
+			float a = w[j + k] + nn[j + k] * (1.0f - 2.0f * w[j + k]);
+			acc[k] = acc[k] + math_log_level<LEVEL>(r * a + n * (1.0f - a));
+		}
+	}
+	for (int k = 0; j + k < length; k++)
+	{
+		float a = w[j + k] + nn[j + k] * (1.0f - 2.0f * w[j + k]);
+		acc[k] = acc[k] + math_log_level<LEVEL>(r * a + n * (1.0f - a));
+	}
+
+	float sum = 0.0f;
+	for (int k = 0; k < ISA_ACCUMULATORS; k++)
+		sum = sum + acc[k];
+	return sum;
+}
+
+//Summed over samples in the same order as Basic_EM
+static void tile_sum(const float *t1, const float *t2, const float *t3, const float *e,
+		unsigned int rows, unsigned int grid, unsigned int tile, float *sum)
+{
+	for (size_t g = 0; g < (size_t) grid * grid * tile; g++)
+		sum[g] = 0.0;
+
+	for (unsigned int i = 0; i < rows; i++)
+	{
+		const float *e_0 = &e[(i * 3 + 0) * tile];
+		const float *e_1 = &e[(i * 3 + 1) * tile];
+		const float *e_2 = &e[(i * 3 + 2) * tile];
+		for (unsigned int a = 0; a < grid; a++)
+		{
+			const float *t_1 = &t1[(i * grid + a) * tile];
+			for (unsigned int b = 0; b < grid; b++)
+			{
+				const float *t_2 = &t2[(i * grid + b) * tile];
+				const float *t_3 = &t3[(((size_t) i * grid + a) * grid + b) * tile];
+				float *s_ab = &sum[(a * grid + b) * tile];
+				#pragma omp simd
+				for (unsigned int l = 0; l < tile; l++)
+				{
+					float s = s_ab[l];
+					s += (t_1[l] * e_0[l]);
+					s += (t_2[l] * e_1[l]);
+					s += (t_3[l] * e_2[l]);
+					s_ab[l] = s;
+				}
+			}
+		}
+	}
+}
+
+static void tile_argmax(const float *sum, unsigned int points, unsigned int tile, float *sum_max, int *best)
+{
+	for (unsigned int g = 0; g < points; g++)
+	{
+		const float *s_g = &sum[g * tile];
+		#pragma omp simd
+		for (unsigned int l = 0; l < tile; l++)
+		{
+			bool take = (s_g[l] * 100.0 >= sum_max[l] * 100.0);
+			sum_max[l] = take ? s_g[l] : sum_max[l];
+			best[l] = take ? (int) g : best[l];
+		}
+	}
+}
+
+}
+
+#include "isa_kernels.h"
+
+#define ISA_TABLE_OF(name) isa_kernels_##name
+#define ISA_TABLE(name) ISA_TABLE_OF(name)
+
+extern const isa_kernels ISA_TABLE(ISA_NAME);
+const isa_kernels ISA_TABLE(ISA_NAME) = {
+	{NULL, ISA_NAME::grid_log_sum<1>, ISA_NAME::grid_log_sum<2>},
+	{NULL, ISA_NAME::grid_log_classes<1>, ISA_NAME::grid_log_classes<2>},
+	{NULL, ISA_NAME::log_sum<1>, ISA_NAME::log_sum<2>},
+	ISA_NAME::tile_sum,
+	ISA_NAME::tile_argmax
+};
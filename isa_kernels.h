@@ -0,0 +1,49 @@
+/*
+ * isa_kernels.h
+ *
+ * The vector loops of the likelihood tables and scan (fast math levels 1
+ * and 2) and of the tiled EM grid search, built once per instruction set
+ * from isa_kernels.cpp and picked at startup from cpuid (--isa):
+ *
+ *   generic  x86-64 baseline (SSE2)
+ *   sse4.2   SSE4.2
+ *   avx2     AVX2 and FMA
+ *   avx512   AVX-512F, 512 bit vectors
+ *
+ * Multiplies and adds are never fused and every loop keeps its order of
+ * additions whatever the vector width, so all paths give the same results.
+ */
+#include <string>
+#include <ostream>
+#include "math_kernels.h"
+
+#ifndef ISA_KERNELS_H
+#define ISA_KERNELS_H
+
+using namespace std;
+
+//Entries by fast math level, those of level 0 are NULL
+typedef struct _isa_kernels {
+	//result[i] = sum over the reads of log(row(r[i], n[i])), read by read
+	void (*grid_log_sum[MATH_LEVELS])(const float *w, const float *nn, int length,
+			const float *r, const float *n, int count, float *result);
+	//The same from the logs of each read class, logs holds classes * count floats
+	void (*grid_log_classes[MATH_LEVELS])(const float *class_w, const float *class_nn, int classes,
+			const int *cls, int length, const float *r, const float *n, int count, float *logs, float *result);
+	//Sum over the reads of log(row(r, n))
+	float (*log_sum[MATH_LEVELS])(const float *w, const float *nn, int length, float r, float n);
+	//Batch_EM grid sums of the diploid tables, [p][p_2][lane] from the [sample][...][lane] tables
+	void (*tile_sum)(const float *t1, const float *t2, const float *t3, const float *e,
+			unsigned int rows, unsigned int grid, unsigned int tile, float *sum);
+	//Batch_EM last best grid point of every lane
+	void (*tile_argmax)(const float *sum, unsigned int points, unsigned int tile, float *sum_max, int *best);
+} isa_kernels;
+
+extern const isa_kernels *isa;
+
+//"auto" for the widest the CPU supports, returns -1 for a name it does not
+int isa_select(const string &name);
+const char *isa_name();
+void isa_report(ostream &out); //The path taken and those the CPU supports
+
+#endif
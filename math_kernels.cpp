@@ -0,0 +1,52 @@
+#include <atomic>
+#include "math_kernels.h"
+
+int math_level = 0;
+bool math_verify = false;
+
+static const char *Math_names[MATH_FUNCTIONS] = {"log", "exp"};
+
+//Documented maximum relative errors by level, see math_kernels.h
+static const float Math_bounds[MATH_LEVELS][MATH_FUNCTIONS] = {
+	{0.0, 0.0},
+	{2e-7, 2e-7},
+	{4e-6, 6e-5}
+};
+
+static atomic<float> Math_max_error[MATH_FUNCTIONS];
+static atomic<float> Math_max_x[MATH_FUNCTIONS];
+static atomic<unsigned long long> Math_calls[MATH_FUNCTIONS];
+
+void math_select(int level, bool verify)
+{
+	math_level = ((level >= 0) && (level < MATH_LEVELS)) ? level : 0;
+	math_verify = verify;
+}
+
+void math_check(Math_Function function, float x, float value)
+{
+	float exact = (function == MATH_LOG) ? log(x) : exp(x);
+	float error = fabs(value - exact);
+	//Relative error where the float result is normal, absolute error in the subnormal range
+	if (fabs(exact) >= 1.17549435e-38f)
+		error /= fabs(exact);
+
+	Math_calls[function].fetch_add(1, memory_order_relaxed);
+	float seen = Math_max_error[function].load(memory_order_relaxed);
+	while ((error > seen) && !Math_max_error[function].compare_exchange_weak(seen, error, memory_order_relaxed))
+		;
+	if (error >= seen)
+		Math_max_x[function].store(x, memory_order_relaxed);
+}
+
+void math_report(ostream &out)
+{
+	for (int i = 0; i < MATH_FUNCTIONS; i++)
+	{
+		float error = Math_max_error[i].load();
+		out << "fast math level " << math_level << " " << Math_names[i] << ": " << Math_calls[i].load()
+		    << " calls, max relative error " << error << " at " << Math_max_x[i].load()
+		    << ", bound " << Math_bounds[math_level][i]
+		    << ((error > Math_bounds[math_level][i]) ? " EXCEEDED" : "") << endl;
+	}
+}
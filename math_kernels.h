@@ -0,0 +1,200 @@
+/*
+ * math_kernels.h
+ *
+ * log and exp for the likelihood tables and the EM E-step, selected by
+ * --fast-math-level:
+ *
+ *   0  libm logf and expf (default, the reference results)
+ *   1  range reduction plus degree 9 (log) and degree 5 (exp) polynomials,
+ *      maximum relative error 2e-7 (log) and 2e-7 (exp), about 1 ulp
+ *   2  range reduction plus a 3 term atanh series (log) and a degree 4
+ *      polynomial (exp), maximum relative error 4e-6 (log) and 6e-5 (exp)
+ *
+ * The bounds hold for positive normal arguments of log and for exp
+ * arguments down to -87.3, below which results fall into the float
+ * subnormal range and only the absolute error (< 1e-42) is bounded.
+ * The level 1 and 2 kernels have no branches or calls and vectorize.
+ * --fast-math-verify checks every fast call against libm and reports the
+ * largest relative error seen.
+ */
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <ostream>
+
+#ifndef MATH_KERNELS_H
+#define MATH_KERNELS_H
+
+#define MATH_LEVELS 3
+#define MATH_CHECKED 3 //Kernel instantiation that checks against libm
+
+using namespace std;
+
+enum Math_Function {
+	MATH_LOG,
+	MATH_EXP,
+	MATH_FUNCTIONS
+};
+
+extern int math_level;
+extern bool math_verify;
+
+void math_select(int level, bool verify);
+void math_check(Math_Function function, float x, float value);
+void math_report(ostream &out);
+
+inline float math_bits_float(int32_t bits)
+{
+	float x;
+	memcpy(&x, &bits, sizeof(x));
+	return x;
+}
+
+inline int32_t math_float_bits(float x)
+{
+	int32_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	return bits;
+}
+
+//x = (1 + f) * 2^e with 1 + f in [sqrt(0.5), sqrt(2)), integer only so it vectorizes
+inline float math_log_reduce(float x, float &e)
+{
+	int32_t bits = math_float_bits(x);
+	int32_t exponent = (bits - 0x3f3504f3) >> 23;
+	e = (float) exponent;
+	return math_bits_float(bits - (exponent << 23)) - 1.0f;
+}
+
+inline float fast_log_1(float x)
+{
+	float e;
+	float f = math_log_reduce(x, e);
+	float z = f * f;
+	float y = 7.0376836292e-2f;
+	y = y * f - 1.1514610310e-1f;
+	y = y * f + 1.1676998740e-1f;
+	y = y * f - 1.2420140846e-1f;
+	y = y * f + 1.4249322787e-1f;
+	y = y * f - 1.6668057665e-1f;
+	y = y * f + 2.0000714765e-1f;
+	y = y * f - 2.4999993993e-1f;
+	y = y * f + 3.3333331174e-1f;
+	y = y * f * z;
+	y += -2.12194440e-4f * e;
+	y += -0.5f * z;
+	return f + y + 0.693359375f * e;
+}
+
+inline float fast_log_2(float x)
+{
+	float e;
+	float f = math_log_reduce(x, e);
+	float s = f / (2.0f + f);
+	float s2 = s * s;
+	float y = 2.0f * s * (1.0f + s2 * (0.333333333f + s2 * 0.2f));
+	return (y - 2.12194440e-4f * e) + 0.693359375f * e;
+}
+
+//exp(x) = 2^n * exp(r), |r| <= ln2 / 2, 2^n applied in two halves to reach the subnormal range
+template <int DEGREE>
+inline float math_exp_poly(float x)
+{
+	float c = (x < -104.0f) ? -104.0f : ((x > 88.7f) ? 88.7f : x);
+	float t = c * 1.44269504f;
+	int32_t n = (int32_t) (t + ((t >= 0.0f) ? 0.5f : -0.5f));
+	float nf = (float) n;
+	float r = (c - nf * 0.693359375f) + nf * 2.12194440e-4f;
+	float y;
+	if (DEGREE == 5)
+	{
+		y = 1.9875691500e-4f;
+		y = y * r + 1.3981999507e-3f;
+		y = y * r + 8.3334519073e-3f;
+		y = y * r + 4.1665795894e-2f;
+		y = y * r + 1.6666665459e-1f;
+		y = y * r + 5.0000001201e-1f;
+		y = y * r * r + r + 1.0f;
+	}
+	else
+		y = 1.0f + r * (1.0f + r * (0.5f + r * (0.166666667f + r * 0.0416666667f)));
+	int32_t n1 = n / 2;
+	int32_t n2 = n - n1;
+	y = y * math_bits_float((n1 + 127) << 23) * math_bits_float((n2 + 127) << 23);
+	return (x < -103.972f) ? 0.0f : ((x > 88.7228f) ? HUGE_VALF : y);
+}
+
+inline float fast_exp_1(float x)
+{
+	return math_exp_poly<5>(x);
+}
+
+inline float fast_exp_2(float x)
+{
+	return math_exp_poly<4>(x);
+}
+
+//Kernels by level, for loops instantiated once per level
+template <int LEVEL>
+inline float math_log_level(float x)
+{
+	switch (LEVEL)
+	{
+		case 1:
+			return fast_log_1(x);
+		case 2:
+			return fast_log_2(x);
+		case MATH_CHECKED:
+		{
+			float value = (math_level == 1) ? fast_log_1(x) : ((math_level == 2) ? fast_log_2(x) : log(x));
+			math_check(MATH_LOG, x, value);
+			return value;
+		}
+		default:
+			return log(x);
+	}
+}
+
+template <int LEVEL>
+inline float math_exp_level(float x)
+{
+	switch (LEVEL)
+	{
+		case 1:
+			return fast_exp_1(x);
+		case 2:
+			return fast_exp_2(x);
+		case MATH_CHECKED:
+		{
+			float value = (math_level == 1) ? fast_exp_1(x) : ((math_level == 2) ? fast_exp_2(x) : exp(x));
+			math_check(MATH_EXP, x, value);
+			return value;
+		}
+		default:
+			return exp(x);
+	}
+}
+
+//Level of the kernel instantiation to run
+inline int math_kernel()
+{
+	return math_verify ? MATH_CHECKED : math_level;
+}
+
+//Single calls at the selected level
+inline float math_exp(float x)
+{
+	switch (math_kernel())
+	{
+		case 1:
+			return math_exp_level<1>(x);
+		case 2:
+			return math_exp_level<2>(x);
+		case MATH_CHECKED:
+			return math_exp_level<MATH_CHECKED>(x);
+		default:
+			return exp(x);
+	}
+}
+
+#endif
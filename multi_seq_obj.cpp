@@ -1,6 +1,10 @@
+#include <algorithm>
+#include <cfloat>
 #include "multi_seq_obj.h"
 
 #include "core_functions.h"
+#include "stats.h"
+#include "math_kernels.h"
 
 using namespace std;
 
@@ -9,11 +13,10 @@ char Multi_Seq_Obj::Get_Max_Allele()
 	char max_allele = 'N';
 	int max_count = 0;
 	array<int, 4> allele_counter = {{0, 0, 0, 0}};
-	for (unsigned int i = 0; i < Sample; i++)
+	for (unsigned int k = 0; k < Sample_Count; k++)
 	{
-		if (Seq_obj_s[i])
 		{
-			switch (Seq_obj_s[i].get()->Get_Max_Allele())
+			switch (Seq_obj_s[k]->Get_Max_Allele())
 			{
 				case 'A':
 					allele_counter[0]++;
@@ -55,21 +58,70 @@ char Multi_Seq_Obj::Get_Max_Allele()
 	return max_allele;
 }
 
-int Multi_Seq_Obj::Insert(shared_ptr<Seq_Obj> &seq_obj, int n)
+//Samples normally come in order and are appended, E_RR and Genotype are sized here
+//because the EM runs on the worker threads, which must not allocate from the arena
+int Multi_Seq_Obj::Insert(Seq_Obj *seq_obj, int n)
 {
 	if (n > Sample)
 		return -1;
 	if (Sample_Count == 0)
 	{
-		this->Ref = seq_obj.get()->Get_Ref();
-		this->Chrom = seq_obj.get()->Get_ID();
+		this->Ref = seq_obj->Get_Ref();
+		this->Contig = seq_obj->Get_Contig();
 	}
-	if (!Seq_obj_s[n])
-		Sample_Count++;
-	Seq_obj_s[n].swap(seq_obj);
+
+	int k = Sample_Count;
+	while ((k > 0) && (Sample_id[k - 1] >= n))
+		k--;
+	if ((k < Sample_Count) && (Sample_id[k] == n))
+	{
+		arena_delete(Arena, Seq_obj_s[k]);
+		Seq_obj_s[k] = seq_obj;
+		return 0;
+	}
+
+	Seq_obj_s.insert(Seq_obj_s.begin() + k, seq_obj);
+	Sample_id.insert(Sample_id.begin() + k, n);
+	Genotype.push_back(-1);
+	E_RR.push_back(0.0);
+	Sample_Count++;
 	return 0;
 }
 
+int Multi_Seq_Obj::Find_Sample(int sample)
+{
+	arena_vector<unsigned int>::iterator it = lower_bound(Sample_id.begin(), Sample_id.end(), (unsigned int) sample);
+	return ((it != Sample_id.end()) && (*it == sample)) ? it - Sample_id.begin() : -1;
+}
+
+void Multi_Seq_Obj::Remove_Sample(int k)
+{
+	arena_delete(Arena, Seq_obj_s[k]);
+	Seq_obj_s.erase(Seq_obj_s.begin() + k);
+	Sample_id.erase(Sample_id.begin() + k);
+	Genotype.pop_back();
+	E_RR.pop_back();
+	Sample_Count--;
+}
+
+//Keeps the argmax genotype and the RR posterior of each covered sample
+void Multi_Seq_Obj::Store_E(vector<float> &E_value)
+{
+	for (unsigned int k = 0; k < Sample_Count; k++)
+	{
+		float max = E_value[k * Type + 0];
+		int max_index = 0;
+		for (int j = 1; j < Type; j++)
+			if (E_value[k * Type + j] > max)
+			{
+				max = E_value[k * Type + j];
+				max_index = j;
+			}
+		Genotype[k] = max_index;
+		E_RR[k] = E_value[k * Type + 0];
+	}
+}
+
 int Multi_Seq_Obj::Get_Value_Max()
 {
 	float max = Value[0];
@@ -85,23 +137,16 @@ int Multi_Seq_Obj::Get_Value_Max()
 
 int Multi_Seq_Obj::Get_E_Value_Max(int sample)
 {
-	if ((sample >= Sample) || (!Seq_obj_s[sample]))
-		return -1;
-	float max = E_Value[sample * Type + 0];
-	int max_index = 0;
-	for (int i = 1; i < Type; i++)
-		if (E_Value[sample * Type + i] > max)
-		{
-			max = E_Value[sample * Type + i];
-			max_index = i;
-		}
-	return max_index;
+	int k = Find_Sample(sample);
+	return (k < 0) ? -1 : Genotype[k];
 }
 
 int Multi_Seq_Obj::Calc_EM(float end, float step, float eps)
 {
-	vector<float> E_value(Sample * Type, 0.0);
-	vector<float> FS_value(Sample * Type, 0.0);
+	Stat_Timer timer(STAT_EM);
+
+	vector<float> E_value;
+	vector<float> FS_value;
 
 	vector<float> Init_value(Type, 0.0); //p0
 	vector<float> Calc_value(Type, 0.0); //p1
@@ -111,68 +156,22 @@ int Multi_Seq_Obj::Calc_EM(float end, float step, float eps)
 	float Calc_p = 0.0; //q1
 	float Calc_p_2 = 0.0; //q1
 
-	//For if only 1 sample
-	int Single_sample_index = 0;
-	unsigned int Max_value_index = 0;
-
-	for (unsigned int i = 0; i < Sample; i++)
-	{
-		if (Seq_obj_s[i])
-		{
-			if (Seq_obj_s[i].get()->Get_Ref_Length() == 0)
-			{
-				Seq_obj_s[i].reset();
-				Sample_Count--;
-			}
-			else
-			{
-				Seq_obj_s[i].get()->Calc_Value(end, step);
-				for (unsigned int j = 0; j < Type; j++)
-					E_value[i * Type + j] = Seq_obj_s[i].get()->Get_Value_Result(j);
-				Seq_obj_s[i].get()->pre_Calc_Value();
-			}
-		}
-	}
+	int Prepared = EM_Prepare(end, step, E_value, Init_value);
 
-	if (Sample_Count == 0) {
-		Is_Qual = false;
+	if (Sample_Count == 0)
 		return 0;
-	}
-
-	if (params.debug)
-	{
-		cout << "Init E_value" << endl;
-		for (int i = 0; i < Sample * Type; i++)
-			cout << E_value[i] << "\t";
-		cout << endl;
-	}
-
-	for (int i = 0; i < Sample; i++)
-	{
-		if (Seq_obj_s[i])
-		{
-			Single_sample_index = i;
-			Max_value_index = Seq_obj_s[i].get()->Get_Value_Result_Max_Index();
-			float max = Seq_obj_s[i].get()->Get_Value_Result(Max_value_index);
-			for (int j = 0; j < Type; j++)
-				E_value[i * Type + j] = exp(Seq_obj_s[i].get()->Get_Value_Result(j) - max);
-
-		}
-	}
+	FS_value.assign(Sample_Count * Type, 0.0);
 
-	Matrix_Norm(E_value, Type, Sample);
-	Matrix_Ave(Init_value, E_value, Type, Sample, Sample_Count);
-
-	if (params.debug)
+	if (Params->debug)
 	{
 		cout << endl;
 		cout << "Before first step of EM" << endl;
 		cout << "E_value" << endl;
-		for (int i = 0; i < Sample * Type; i++)
+		for (int i = 0; i < Sample_Count * Type; i++)
 			cout << E_value[i] << "\t";
 		cout << endl;
 		cout << "FS_value" <<endl;
-		for (int i = 0; i < Sample * Type; i++)
+		for (int i = 0; i < Sample_Count * Type; i++)
 			cout << FS_value[i] << "\t";
 		cout << endl;
 		cout << "Init_value" << endl;
@@ -186,27 +185,21 @@ int Multi_Seq_Obj::Calc_EM(float end, float step, float eps)
 	}
 
 	//Single Sample
-	if (Sample_Count == 1)
-	{
-		P = Seq_obj_s[Single_sample_index].get()->Get_Value_P(Max_value_index, 0);
-		P_2 = Seq_obj_s[Single_sample_index].get()->Get_Value_P(Max_value_index, 1);
-		Value = Calc_value;
-		E_Value = E_value;
+	if (Prepared == 0)
 		return 0; //Single GeMS
-	}
 
 	Basic_EM(FS_value, E_value, end, step, Init_p, Init_p_2);
 
-	if (params.debug)
+	if (Params->debug)
 	{
 		cout << endl;
 		cout << "After first step of EM" << endl;
 		cout << "E_value" << endl;
-		for (int i = 0; i < Sample * Type; i++)
+		for (int i = 0; i < Sample_Count * Type; i++)
 			cout << E_value[i] << "\t";
 		cout << endl;
 		cout << "FS_value" <<endl;
-		for (int i = 0; i < Sample * Type; i++)
+		for (int i = 0; i < Sample_Count * Type; i++)
 			cout << FS_value[i] << "\t";
 		cout << endl;
 		cout << "Init_value" << endl;
@@ -221,32 +214,262 @@ int Multi_Seq_Obj::Calc_EM(float end, float step, float eps)
 
 	//Loop
 
+	int Loop = EM_Loop(FS_value, E_value, Init_value, Calc_value, Init_p, Init_p_2, Calc_p, Calc_p_2, end, step, eps);
+
+	EM_Finish(Calc_value, E_value, Calc_p, Calc_p_2);
+	stats.Add_Iterations(Loop);
+	return Loop;
+}
+
+//The site is calculated again from its samples, nothing of the previous Calc_EM is kept
+void Multi_Seq_Obj::Set_Step(float step, bool coarse)
+{
+	for (unsigned int k = 0; k < Sample_Count; k++)
+		Seq_obj_s[k]->Set_Step(step);
+	Pruned = false;
+	Screened = false;
+	Coarse = coarse;
+	W = -1;
+}
+
+int Multi_Seq_Obj::EM_Prepare(float end, float step, vector<float> &E_value, vector<float> &Init_value)
+{
+	//For if only 1 sample
+	int Single_sample_index = 0;
+	unsigned int Max_value_index = 0;
+
+	for (int k = Sample_Count - 1; k >= 0; k--)
+		if (Seq_obj_s[k]->Get_Ref_Length() == 0)
+			Remove_Sample(k);
+	E_value.assign(Sample_Count * Type, 0.0);
+
+	//The screen only needs the scan values, the tables are filled for the sites it keeps
+	bool Screen = (Params->screen_margin > 0) && (Sample_Count > 1);
+
+	#pragma omp parallel for num_threads(Threads) if (Threads > 1) schedule(dynamic)
+	for (unsigned int i = 0; i < Sample_Count; i++)
+	{
+		if (Screen)
+			Seq_obj_s[i]->Calc_Value(end, step);
+		else
+			Seq_obj_s[i]->Calc_Tables(end, step);
+		for (unsigned int j = 0; j < Type; j++)
+			E_value[i * Type + j] = Seq_obj_s[i]->Get_Value_Result(j);
+	}
+
+	if (Sample_Count == 0) {
+		Is_Qual = false;
+		stats.Add(COUNT_SITE_NO_SAMPLE);
+		return 0;
+	}
+
+	if (Params->debug)
+	{
+		cout << "Init E_value" << endl;
+		for (int i = 0; i < Sample_Count * Type; i++)
+			cout << E_value[i] << "\t";
+		cout << endl;
+	}
+
+	for (int i = 0; i < Sample_Count; i++)
+	{
+		Single_sample_index = i;
+		Max_value_index = Seq_obj_s[i]->Get_Value_Result_Max_Index();
+		float max = Seq_obj_s[i]->Get_Value_Result(Max_value_index);
+		for (int j = 0; j < Type; j++)
+			E_value[i * Type + j] = math_exp(Seq_obj_s[i]->Get_Value_Result(j) - max);
+	}
+
+	Matrix_Norm(E_value, Type, Sample_Count);
+	Matrix_Ave(Init_value, E_value, Type, Sample_Count, Sample_Count);
+
+	//Single Sample
+	if (Sample_Count == 1)
+	{
+		P = Seq_obj_s[Single_sample_index]->Get_Value_P(Max_value_index, 0);
+		P_2 = Seq_obj_s[Single_sample_index]->Get_Value_P(Max_value_index, 1);
+		Value.assign(Type, 0.0);
+		Store_E(E_value);
+		stats.Add(COUNT_SITE_SINGLE_SAMPLE);
+		return 0;
+	}
+
+	//Sites whose screen score is outside the output band widened by the margin are finished here,
+	//under --screen-verify they still run the EM and are counted when it outputs them
+	if (Screen)
+	{
+		float Score = Screen_Score(E_value, Init_value, 2, 200);
+		if ((Score <= 0.1 - Params->screen_margin) || (Score >= Params->result_filter + Params->screen_margin))
+		{
+			Screened = true;
+			stats.Add(COUNT_SITE_SCREENED);
+			if (!Params->screen_verify)
+			{
+				W = Score;
+				Value.assign(Init_value.begin(), Init_value.end());
+				Store_E(E_value);
+				return 0;
+			}
+		}
+
+		//The scan values are kept, only the tables are filled
+		#pragma omp parallel for num_threads(Threads) if (Threads > 1) schedule(dynamic)
+		for (unsigned int i = 0; i < Sample_Count; i++)
+			Seq_obj_s[i]->Calc_Tables(end, step, true);
+	}
+
+	//Sites that cannot reach the output (W below -f) are finished here, not under -w
+	//where skipping a site would change the start of the next one
+	if (Params->prune && Prune_Bound(Init_value[0], 2, 200))
+	{
+		Pruned = true;
+		Value.assign(Init_value.begin(), Init_value.end());
+		Store_E(E_value);
+		stats.Add(COUNT_SITE_PRUNED);
+		return 0;
+	}
+
+	stats.Add(COUNT_SITE_EM);
+	return 1;
+}
+
+//Approximate W for --screen: one EM step on the best scan value of each model
+//(in place of the grid search), from the average of the single sample posteriors
+float Multi_Seq_Obj::Screen_Score(vector<float> &E_value, vector<float> &Init_value, int min, int max)
+{
+	int w = 0;
+	float sum = 0.0;
+	for (unsigned int i = 0; i < Sample_Count; i++)
+	{
+		double mix = 0.0;
+		for (unsigned int j = 0; j < Type; j++)
+			mix += E_value[i * Type + j] * Init_value[j];
+		float temp_e = (mix > 0) ? E_value[i * Type] * Init_value[0] / mix : 0;
+
+		int temp_w = (Seq_obj_s[i]->Get_Ref_Length() >= min) ? Seq_obj_s[i]->Get_Ref_Length() : 0;
+		temp_w = (temp_w <= max) ? temp_w : max;
+		temp_e = (temp_e * 1000 > 0) ? temp_e : 1e-323;
+		w += temp_w;
+		sum += (float) temp_w * log(temp_e);
+	}
+
+	return (w != 0) ? exp(sum / (float) w) : -1;
+}
+
+//Lower bound of W after the EM, from the likelihood tables alone (--prune).
+//Whatever grid point an EM step picks, sample i favours NN or RN over RR by
+//at most R_i, the largest ratio of its NN or RN likelihood to its RR likelihood
+//over the grid. Its RR posterior is then at least g_i(p0) = p0 / (p0 + (1 - p0) R_i)
+//and the next p0 at least the mean of these, so MAX_LOOP steps of that mean from
+//the starting p0 bound every p0 and every RR posterior the EM can reach.
+//W is set to the bound and true returned when it clears -f.
+bool Multi_Seq_Obj::Prune_Bound(float p0, int min, int max)
+{
+	int n = Seq_obj_s[0]->typeoneVec.size();
+	double lowest = 0.0;
+	double floor_sum = 0.0;
+	vector<double> R(Sample_Count);
+	for (unsigned int i = 0; i < Sample_Count; i++)
+	{
+		Seq_Obj *seq_obj = Seq_obj_s[i];
+		double one_min = MAX, other_min = MAX, ratio = MIN;
+		for (int a = 0; a < n; a++)
+		{
+			double one = seq_obj->typeoneVec[a];
+			one_min = (one < one_min) ? one : one_min;
+			for (int b = 0; b < n; b++)
+			{
+				double other = seq_obj->typetwoVec[b];
+				if (Type == 3)
+				{
+					double three = seq_obj->typethreeVec[a * n + b];
+					other_min = (three < other_min) ? three : other_min;
+					other = (three > other) ? three : other;
+				}
+				other_min = (other < other_min) ? other : other_min;
+				ratio = (other - one > ratio) ? other - one : ratio;
+			}
+		}
+		lowest = (one_min < lowest) ? one_min : lowest;
+		floor_sum += (one_min < other_min) ? one_min : other_min;
+		R[i] = exp(ratio);
+	}
+
+	//Basic_EM must find a grid point at every step
+	if (!(floor_sum > MIN / 2))
+		return false;
+
+	double slack = PRUNE_SLACK + Sample_Count * FLT_EPSILON;
+	double p = p0, p_low = p0;
+	for (int t = 0; t <= MAX_LOOP; t++)
+	{
+		double sum = 0.0;
+		for (unsigned int i = 0; i < Sample_Count; i++)
+			sum += p / (p + (1 - p) * R[i]);
+		p = sum / Sample_Count * (1 - slack);
+		p_low = (p < p_low) ? p : p_low;
+	}
+	if (!(p_low > 0) || (lowest + log(p_low) < PRUNE_MIN_EXP))
+		return false;
+
+	int w = 0;
+	double sum = 0.0;
+	for (unsigned int i = 0; i < Sample_Count; i++)
+	{
+		int temp_w = (Seq_obj_s[i]->Get_Ref_Length() >= min) ? Seq_obj_s[i]->Get_Ref_Length() : 0;
+		temp_w = (temp_w <= max) ? temp_w : max;
+		w += temp_w;
+		sum += temp_w * log(p_low / (p_low + (1 - p_low) * R[i]));
+	}
+	if (w == 0)
+		return false;
+
+	double bound = exp(sum / w);
+	if (bound < Params->result_filter * PRUNE_MARGIN)
+		return false;
+	W = bound;
+	return true;
+}
+
+void Multi_Seq_Obj::EM_Finish(vector<float> &Calc_value, vector<float> &E_value, float p, float p_2)
+{
+	//Same sizes as allocated at construction, so the arena is not touched from the worker threads
+	Value.assign(Calc_value.begin(), Calc_value.end());
+	Store_E(E_value);
+
+	P = p; //RN condition 1
+	P_2 = p_2; //NR contiditon 2
+}
+
+int Multi_Seq_Obj::EM_Loop(vector<float> &FS_value, vector<float> &E_value, vector<float> &Init_value,
+		vector<float> &Calc_value, float &Init_p, float &Init_p_2,
+		float &Calc_p, float &Calc_p_2, float end, float step, float eps)
+{
 	int Loop = 0;
 	float diff = MAX;
 
 	while ((diff > eps) && (Loop < MAX_LOOP))
 	{
-		for (int i = 0; i < Sample; i++)
-			if (Seq_obj_s[i])
-				for (int j = 0; j < Type; j++)
-					E_value[i * Type + j] = exp(FS_value[i * Type + j]) * Init_value[j];
-
+		#pragma omp parallel for num_threads(Threads) if (Threads > 1) schedule(static)
+		for (int i = 0; i < Sample_Count; i++)
+			for (int j = 0; j < Type; j++)
+				E_value[i * Type + j] = math_exp(FS_value[i * Type + j]) * Init_value[j];
 
-		Matrix_Norm(E_value, Type, Sample);
-		Matrix_Ave(Calc_value, E_value, Type, Sample, Sample_Count);
+		Matrix_Norm(E_value, Type, Sample_Count);
+		Matrix_Ave(Calc_value, E_value, Type, Sample_Count, Sample_Count);
 
 		Basic_EM(FS_value, E_value, end, step, Calc_p, Calc_p_2);
 
-		if (params.debug)
+		if (Params->debug)
 		{
 			cout << endl;
 			cout << "After Loop " << Loop + 1 << " of EM" << endl;
 			cout << "E_value" << endl;
-			for (int i = 0; i < Sample * Type; i++)
+			for (int i = 0; i < Sample_Count * Type; i++)
 				cout << E_value[i] << "\t";
 			cout << endl;
 			cout << "FS_value" <<endl;
-			for (int i = 0; i < Sample * Type; i++)
+			for (int i = 0; i < Sample_Count * Type; i++)
 				cout << FS_value[i] << "\t";
 			cout << endl;
 			cout << "Init_value" << endl;
@@ -284,93 +507,108 @@ int Multi_Seq_Obj::Calc_EM(float end, float step, float eps)
 		Init_p_2 = Calc_p_2;
 		Loop++;
 	}
-	Value = Calc_value;
-	E_Value = E_value;
 
-	//min of E_Values
-	float min_E_RR = MAX;
-	float min_E_NN = MAX;
-	for (int i = 0; i < Sample; i++)
+	return Loop;
+}
+
+template <unsigned int TYPE>
+void Multi_Seq_Obj::Fill_FS_Type(vector<float> &FS_value, float p, float p_2, float step)
+{
+	#pragma omp parallel for num_threads(Threads) if (Threads > 1) schedule(static)
+	for (int i = 0; i < Sample_Count; i++)
 	{
-		if (E_Value[i * Type] < min_E_RR)
-			min_E_RR = E_Value[i * Type];
-		if (E_Value[i * Type + 1] < min_E_NN)
-			min_E_NN = E_Value[i * Type + 1];
+		FS_value[i * TYPE] = Seq_obj_s[i]->get_Calc_Value(p, 0, 0, step);
+		FS_value[i * TYPE + 1] = Seq_obj_s[i]->get_Calc_Value(p_2, 0, 1, step);
+		if (TYPE == 3)
+			FS_value[i * TYPE + 2] = Seq_obj_s[i]->get_Calc_Value(p, p_2, 2, step);
 	}
-
-	P = Calc_p; //RN condition 1
-	P_2 = Calc_p_2; //NR contiditon 2
-	return Loop;
 }
 
 void Multi_Seq_Obj::Basic_EM(vector<float> &FS_value, vector<float> &E_value, float end,
 		float step, float &p, float &p_2)
 {
-	end = end - step / 10.0;
-	float test_p = step;
-	float Sum_max = MIN;
+	if (Type == 2)
+		Basic_EM_Type<2>(FS_value, E_value, end, step, p, p_2);
+	else
+		Basic_EM_Type<3>(FS_value, E_value, end, step, p, p_2);
+}
 
-	while (test_p < end)
+template <unsigned int TYPE>
+void Multi_Seq_Obj::Basic_EM_Type(vector<float> &FS_value, vector<float> &E_value, float end,
+		float step, float &p, float &p_2)
+{
+	//Same grid points as the nested loops stepping test_p and test_p_2
+	end = end - step / 10.0;
+	vector<float> grid;
+	for (float test_p = step; test_p < end; test_p += step)
+		grid.push_back(test_p);
+	int n = grid.size();
+
+	//Each grid point sums its samples in order, so splitting the points over threads keeps the sums
+	vector<float> Sum(n * n, 0.0);
+	#pragma omp parallel for num_threads(Threads) if (Threads > 1) schedule(static)
+	for (int g = 0; g < n * n; g++)
 	{
-		float test_p_2 = step;
-		while (test_p_2 < end)
+		float test_p = grid[g / n];
+		float test_p_2 = grid[g % n];
+		float Sum_temp = 0;
+		for (int i = 0; i < Sample_Count; i++)
 		{
-			float Sum_temp = 0;
-			vector<float> FS_temp(Sample * Type, 0.0);
-
-			for (int i = 0; i < Sample; i++)
-				if (Seq_obj_s[i])
-				{
-					FS_temp[i * Type] = Seq_obj_s[i].get()->get_Calc_Value(test_p, 0, 0, step);
-					//cout << test_p << "\t" << test_p_2 << "\t" << "should equal " << FS_temp[i * Type] << "\t" << Seq_obj_s[i].get()->Calc_Value(test_p, 0, 0) << endl;
-					FS_temp[i * Type + 1] = Seq_obj_s[i].get()->get_Calc_Value(test_p_2, 0, 1, step);
-					//cout << test_p << "\t" << test_p_2 << "\t" << "should equal " << FS_temp[i * Type + 1] << "\t" << Seq_obj_s[i].get()->Calc_Value(test_p_2, 0, 1) << endl;
-					FS_temp[i * Type + 2] = Seq_obj_s[i].get()->get_Calc_Value(test_p, test_p_2, 2, step);
-					//cout << test_p << "\t" << test_p_2 << "\t" << 	"should equal " << FS_temp[i * Type + 2] << "\t" << Seq_obj_s[i].get()->Calc_Value(test_p, test_p_2, 2) << endl;
-					Sum_temp += (FS_temp[i * Type] * E_value[i * Type]);
-					Sum_temp += (FS_temp[i * Type + 1] * E_value[i * Type + 1]);
-					Sum_temp += (FS_temp[i * Type + 2] * E_value[i * Type + 2]);
-				}
+			Sum_temp += (Seq_obj_s[i]->get_Calc_Value(test_p, 0, 0, step) * E_value[i * TYPE]);
+			Sum_temp += (Seq_obj_s[i]->get_Calc_Value(test_p_2, 0, 1, step) * E_value[i * TYPE + 1]);
+			if (TYPE == 3)
+				Sum_temp += (Seq_obj_s[i]->get_Calc_Value(test_p, test_p_2, 2, step) * E_value[i * TYPE + 2]);
+		}
+		Sum[g] = Sum_temp;
+	}
 
-			if (Sum_temp * 100.0 >= Sum_max * 100.0)
-			{
-				p = test_p;
-				p_2 = test_p_2;
-				FS_value = FS_temp;
-				Sum_max = Sum_temp;
-			}
-			test_p_2 += step;
+	float Sum_max = MIN;
+	int best = -1;
+	for (int g = 0; g < n * n; g++)
+		if (Sum[g] * 100.0 >= Sum_max * 100.0)
+		{
+			best = g;
+			Sum_max = Sum[g];
 		}
-		test_p += step;
+
+	if (best >= 0)
+	{
+		p = grid[best / n];
+		p_2 = grid[best % n];
+		Fill_FS_Type<TYPE>(FS_value, p, p_2, step);
 	}
 }
 
+template void Multi_Seq_Obj::Fill_FS_Type<2>(vector<float> &FS_value, float p, float p_2, float step);
+template void Multi_Seq_Obj::Fill_FS_Type<3>(vector<float> &FS_value, float p, float p_2, float step);
+template void Multi_Seq_Obj::Basic_EM_Type<2>(vector<float> &FS_value, vector<float> &E_value, float end, float step, float &p, float &p_2);
+template void Multi_Seq_Obj::Basic_EM_Type<3>(vector<float> &FS_value, vector<float> &E_value, float end, float step, float &p, float &p_2);
+
 float Multi_Seq_Obj::Calc_W(int min, int max) {
 
 	int w = 0;
 
 	float sum = 0.0;
 
+	if (Pruned || (Screened && !Params->screen_verify))
+		return W;
+
 	if (Sample_Count == 1) { //When only 1 sample
-		for (int i = 0; i < Sample; i++)
-			if (Seq_obj_s[i]) {
-				W = E_Value[i * Type + 0];
-				return W;
-			}
+		W = E_RR[0];
+		return W;
 	}
 
-	for (int i = 0; i < Sample; i++)
-		if (Seq_obj_s[i])
-		{
-			int temp_w;
-			float temp_e;
-
-			temp_w = (Seq_obj_s[i].get()->Get_Ref_Length() >= min) ? Seq_obj_s[i].get()->Get_Ref_Length() : 0;
-			temp_w = (temp_w <= max) ? temp_w : max;
-			temp_e = (E_Value[i * Type + 0] * 1000 > 0) ? E_Value[i * Type + 0] : 1e-323;
-			w += temp_w;
-			sum += (float) temp_w * log(temp_e);
-		}
+	for (int i = 0; i < Sample_Count; i++)
+	{
+		int temp_w;
+		float temp_e;
+
+		temp_w = (Seq_obj_s[i]->Get_Ref_Length() >= min) ? Seq_obj_s[i]->Get_Ref_Length() : 0;
+		temp_w = (temp_w <= max) ? temp_w : max;
+		temp_e = (E_RR[i] * 1000 > 0) ? E_RR[i] : 1e-323;
+		w += temp_w;
+		sum += (float) temp_w * log(temp_e);
+	}
 
 	if (w != 0)
 		W = exp(sum / (float) w);
@@ -382,9 +620,8 @@ int Multi_Seq_Obj::Get_Load()
 {
 	int load = 0;
 
-	for (int i = 0; i < Sample; i++)
-		if (Seq_obj_s[i])
-			load += Seq_obj_s[i].get()->Get_Ref_Length();
+	for (int i = 0; i < Sample_Count; i++)
+		load += Seq_obj_s[i]->Get_Ref_Length();
 
 	return load;
 }
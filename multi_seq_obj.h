@@ -1,9 +1,10 @@
 #include <iostream>
 #include <vector>
 #include <string>
-#include <memory>
 #include <cmath>
+#include <memory>
 #include "seq_obj.h"
+#include "parameters.h"
 
 using namespace std;
 
@@ -11,35 +12,69 @@ using namespace std;
 #define MULTI_SEQ_OBJ_H
 
 #define MAX_LOOP 300
+#define PRUNE_SLACK 1.5e-4 //Per EM step, float rounding and the error of the fast exp
+#define PRUNE_MARGIN 1.001 //Over -f, for the float arithmetic of Calc_W
+#define PRUNE_MIN_EXP -80  //RR likelihood times p0 stays a normal float
+
+class Batch_EM;
+
+//State of a worker kept from batch to batch, the Batch_EM engines (-B), one per grid step
+typedef struct _em_worker {
+	vector<shared_ptr<Batch_EM>> engines;
+} em_worker;
 
 class Multi_Seq_Obj {
 
 public:
-	Multi_Seq_Obj() {
+
+	friend class Batch_EM;
+	friend class Kernel_Bench;
+	friend class Evidence_Store;
+
+	Multi_Seq_Obj(Site_Arena *arena = NULL) : Seq_obj_s(arena), Sample_id(arena), Value(arena),
+			Genotype(arena), E_RR(arena) {
+		Arena = arena;
 		Sample = 0;
 		Sample_Count = 0;
+		Threads = 1;
 		Type = 0;
 		P = 0;
 		P_2 = 0;
 		W = -1;
 		Is_Qual = false;
-		Chrom = "NA";
-		Ref = "NA";
-	}
-
-	Multi_Seq_Obj(unsigned int n, unsigned int type) {
+		Pruned = false;
+		Screened = false;
+		Coarse = false;
+		Contig = 0;
+		Ref = 'N';
+		Params = &params;
+	}
+
+	//Samples are owned by the site, from the arena if one is given (the arena then owns the site too)
+	//Only covered samples are held, so the size of a site follows its coverage and not the cohort
+	Multi_Seq_Obj(unsigned int n, unsigned int type, Site_Arena *arena = NULL) : Seq_obj_s(arena), Sample_id(arena), Value(arena),
+			Genotype(arena), E_RR(arena) {
+		Arena = arena;
 		Sample = n;
 		Sample_Count = 0;
+		Threads = 1;
 		Type = type;
-		Seq_obj_s.resize(Sample);
 		Value.resize(Type, 0.0);
 		P = 0;
 		P_2 = 0;
-		E_Value.resize(Sample * Type, 0.0);
 		W = -1;
 		Is_Qual = false;
-		Chrom = "NA";
-		Ref = "NA";
+		Pruned = false;
+		Screened = false;
+		Coarse = false;
+		Contig = 0;
+		Ref = 'N';
+		Params = &params;
+	}
+
+	~Multi_Seq_Obj() {
+		for (unsigned int k = 0; k < Seq_obj_s.size(); k++)
+			arena_delete(Arena, Seq_obj_s[k]);
 	}
 
 	inline int Get_Sample_Count()
@@ -62,24 +97,26 @@ public:
 		return (n == 0) ? P : P_2;
 	}
 
-	inline float Get_E_Value(int sample, int type)
-	{
-		return ((sample < Sample) && (type < Type)) ? E_Value[sample * Type + type] : 0;
-	}
-
-	inline string Get_Ref()
+	inline char Get_Ref()
 	{
 		return this->Ref;
 	}
 
 	inline bool Get_Is_Sample(int sample)
 	{
-		return ((sample >= Sample) || (!Seq_obj_s[sample])) ? false : true;
+		return Find_Sample(sample) >= 0;
 	}
 
 	inline int Get_Sample_Ref_Length(int sample)
 	{
-		return ((sample >= Sample) || (!Seq_obj_s[sample])) ? 0 : Seq_obj_s[sample].get()->Get_Ref_Length();
+		int k = Find_Sample(sample);
+		return (k < 0) ? 0 : Seq_obj_s[k]->Get_Ref_Length();
+	}
+
+	//Id of the k-th covered sample
+	inline unsigned int Get_Sample_Id(int k)
+	{
+		return Sample_id[k];
 	}
 
 	inline float Get_W()
@@ -102,34 +139,61 @@ public:
 		return Is_Qual;
 	}
 
+	inline bool Get_Pruned()
+	{
+		return Pruned;
+	}
+
+	inline bool Get_Screened()
+	{
+		return Screened;
+	}
+
+	inline bool Get_Coarse()
+	{
+		return Coarse;
+	}
+
 	inline void Display(int sample)
 	{
-		if (!Seq_obj_s[sample])
+		int k = Find_Sample(sample);
+		if (k < 0)
 			cout << "NULL" << endl;
 		else {
-			cout << Seq_obj_s[sample].get()->Get_Ref_Info() << endl;
-			cout << Seq_obj_s[sample].get()->Get_Seq_Qual(0) << endl;
-			cout << Seq_obj_s[sample].get()->Get_Seq_Qual(1) << endl;
+			cout << Seq_obj_s[k]->Get_Ref_Info() << endl;
+			cout << Seq_obj_s[k]->Get_Seq_Qual(0) << endl;
+			cout << Seq_obj_s[k]->Get_Seq_Qual(1) << endl;
 		}
 	}
 
 	inline string Get_Sample(int sample)
 	{
-		if (sample < Seq_obj_s.size() && Seq_obj_s[sample])
-			return Seq_obj_s[sample].get()->Get_Ref_Info();
-		else
-			return "";
+		int k = Find_Sample(sample);
+		return (k < 0) ? "" : Seq_obj_s[k]->Get_Ref_Info();
 	}
 
-	inline string Get_Chrom()
+	inline const string &Get_Chrom()
 	{
-		return Chrom;
+		return contig_name(Contig);
+	}
+
+	//Parameters of the run the site belongs to, params unless an Engine holds its own
+	inline void Set_Parameters(const Parameters *p)
+	{
+		Params = p;
+	}
+
+	//Threads the EM of this site is split across, for wide sites run one at a time
+	inline void Set_Threads(unsigned int threads)
+	{
+		Threads = (threads == 0) ? 1 : threads;
 	}
 
 	char Get_Max_Allele();
 	int Get_Load(); //Sample * Coverage
-	int Insert(shared_ptr<Seq_Obj> &seq_obj, int n);
+	int Insert(Seq_Obj *seq_obj, int n); //Takes ownership
 	int Calc_EM(float end, float step, float eps);
+	void Set_Step(float step, bool coarse); //Before Calc_EM on another grid (--coarse-step)
 	float Calc_W(int min, int max);
 	int Get_Value_Max();
 	int Get_E_Value_Max(int sample);
@@ -137,18 +201,43 @@ public:
 private:
 	unsigned int Sample;
 	unsigned int Sample_Count;
+	unsigned int Threads;
 	unsigned int Type;
 	float P;
 	float P_2;
 	float W;
-	string Chrom;
-	string Ref;
-	vector<shared_ptr<Seq_Obj>> Seq_obj_s;
-	vector<float> Value;
-	vector<float> E_Value;
+	Site_Arena *Arena;
+	const Parameters *Params;
+	unsigned int Contig;
+	char Ref;
+	arena_vector<Seq_Obj*> Seq_obj_s;    //Covered samples, in sample order
+	arena_vector<unsigned int> Sample_id; //Their sample ids
+	arena_vector<float> Value;
+	arena_vector<char> Genotype;          //Most likely genotype model per covered sample after EM
+	arena_vector<float> E_RR;             //RR posterior per covered sample, for Calc_W
 	bool Is_Qual;
+	bool Pruned; //W is the lower bound of --prune, the EM was skipped
+	bool Screened; //Outside the --screen band, W is the screen score and the EM was skipped unless --screen-verify
+	bool Coarse; //Calculated on the --coarse-step grid, not refined on the -s grid
+
+	int Find_Sample(int sample);
+	void Store_E(vector<float> &E_value);
+	void Remove_Sample(int k);
+
+	Multi_Seq_Obj(const Multi_Seq_Obj &);
+	Multi_Seq_Obj &operator=(const Multi_Seq_Obj &);
 
 	void Basic_EM(vector<float> &FS_value, vector<float> &E_value, float end, float step, float &p, float &p_2);
+	bool Prune_Bound(float p0, int min, int max);
+	float Screen_Score(vector<float> &E_value, vector<float> &Init_value, int min, int max);
+	int EM_Prepare(float end, float step, vector<float> &E_value, vector<float> &Init_value);
+	void EM_Finish(vector<float> &Calc_value, vector<float> &E_value, float p, float p_2);
+	int EM_Loop(vector<float> &FS_value, vector<float> &E_value, vector<float> &Init_value,
+			vector<float> &Calc_value, float &Init_p, float &Init_p_2,
+			float &Calc_p, float &Calc_p_2, float end, float step, float eps);
+	//Specialized by type count, 3 for diploid sites and 2 for haploid sites
+	template <unsigned int TYPE> void Basic_EM_Type(vector<float> &FS_value, vector<float> &E_value, float end, float step, float &p, float &p_2);
+	template <unsigned int TYPE> void Fill_FS_Type(vector<float> &FS_value, float p, float p_2, float step);
 	int Matrix_Norm(vector<float> &m, int w, int h);
 	int Matrix_Ave(vector<float> &result, vector<float> &m, int w, int h, int count);
 };
@@ -0,0 +1,79 @@
+#include "output_writer.h"
+
+Output_Writer::Output_Writer(ostream &out, size_t max_pending) : Out(out)
+{
+	this->Max_pending = max_pending;
+	this->Pending_bytes = 0;
+	this->Bytes = 0;
+	this->Next_reserve = 0;
+	this->Next_write = 0;
+	this->Done = false;
+	Worker = thread(&Output_Writer::Write_Loop, this);
+}
+
+Output_Writer::~Output_Writer()
+{
+	if (Worker.joinable())
+		Finish();
+}
+
+unsigned long Output_Writer::Reserve(unsigned long n)
+{
+	lock_guard<mutex> guard(Lock);
+	unsigned long first = Next_reserve;
+	Next_reserve += n;
+	return first;
+}
+
+void Output_Writer::Commit(unsigned long sequence, string &buffer)
+{
+	unique_lock<mutex> guard(Lock);
+	//The buffer the writer waits for is always taken
+	Space.wait(guard, [&] { return (Pending_bytes < Max_pending) || (sequence == Next_write); });
+	Pending_bytes += buffer.size();
+	Pending[sequence].swap(buffer);
+	Ready.notify_one();
+}
+
+void Output_Writer::Finish()
+{
+	{
+		lock_guard<mutex> guard(Lock);
+		Done = true;
+	}
+	Ready.notify_one();
+	Worker.join();
+	Out.flush();
+}
+
+void Output_Writer::Write_Loop()
+{
+	unique_lock<mutex> guard(Lock);
+	while (true)
+	{
+		Ready.wait(guard, [&] { return Done || (Pending.count(Next_write) != 0); });
+
+		map<unsigned long, string>::iterator it = Pending.find(Next_write);
+		if (it == Pending.end())
+		{
+			//Finished with reserved sequences never committed
+			if (Pending.empty())
+				break;
+			Next_write = Pending.begin()->first;
+			continue;
+		}
+
+		string buffer;
+		buffer.swap(it->second);
+		Pending.erase(it);
+
+		guard.unlock();
+		Out.write(buffer.data(), buffer.size());
+		guard.lock();
+
+		Pending_bytes -= buffer.size();
+		Bytes += buffer.size();
+		Next_write++;
+		Space.notify_all();
+	}
+}
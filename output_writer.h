@@ -0,0 +1,81 @@
+/*
+ * output_writer.h
+ *
+ * Ordered asynchronous output. Workers format whole chunks of output
+ * lines into their own buffers and commit them under a sequence number
+ * reserved in genomic order; a writer thread appends the buffers to the
+ * stream strictly in sequence order.
+ */
+#include <ostream>
+#include <string>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdio>
+
+#ifndef OUTPUT_WRITER_H
+#define OUTPUT_WRITER_H
+
+//Committed but unwritten bytes before committers wait for the writer
+#define OUTPUT_MAX_PENDING (64 * 1024 * 1024)
+#define OUTPUT_CHUNK_SIZE (1024 * 1024)
+
+using namespace std;
+
+class Output_Writer {
+public:
+	Output_Writer(ostream &out, size_t max_pending = OUTPUT_MAX_PENDING);
+	~Output_Writer();
+
+	unsigned long Reserve(unsigned long n);
+	void Commit(unsigned long sequence, string &buffer);
+	void Finish();
+
+	inline unsigned long long Get_Bytes()
+	{
+		return Bytes;
+	}
+
+private:
+	ostream &Out;
+	size_t Max_pending;
+	size_t Pending_bytes;
+	unsigned long long Bytes;
+	unsigned long Next_reserve;
+	unsigned long Next_write;
+	bool Done;
+	map<unsigned long, string> Pending;
+	mutex Lock;
+	condition_variable Ready;
+	condition_variable Space;
+	thread Worker;
+
+	void Write_Loop();
+};
+
+inline void Append_Int(string &buffer, long value)
+{
+	char temp[24];
+	char *end = temp + sizeof(temp);
+	char *begin = end;
+	unsigned long magnitude = (value < 0) ? -(unsigned long) value : value;
+	do
+	{
+		*--begin = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while (magnitude != 0);
+	if (value < 0)
+		*--begin = '-';
+	buffer.append(begin, end - begin);
+}
+
+//Same text as the default ostream << for float and double
+inline void Append_Float(string &buffer, double value)
+{
+	char temp[32];
+	int length = snprintf(temp, sizeof(temp), "%g", value);
+	buffer.append(temp, length);
+}
+
+#endif
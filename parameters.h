@@ -0,0 +1,61 @@
+/*
+ * parameters.h
+ *
+ * Run parameters, set from the command line into the global params by
+ * multigems, or filled by default_parameters() and given to an Engine.
+ */
+#include <string>
+
+#ifndef PARAMETERS_H
+#define PARAMETERS_H
+
+using namespace std;
+
+typedef struct FORSIMPLE
+{
+	bool debug;
+	bool reference;
+	unsigned int tile;
+	char output_type;
+	bool stats_batch;
+	string stats_file;
+	float progress_interval;
+	string progress_file;
+	unsigned long long mem_budget;
+	int fast_math_level;
+	bool fast_math_verify;
+	string isa;
+	unsigned long wide_site;
+	unsigned long long table_cache_bytes;
+	bool prune;
+	float screen_margin;
+	bool screen_verify;
+	float coarse_step;
+	float refine_band;
+	string store_in;
+	string store_out;
+	string bam_list; //--bam, read the samples from BAM files against ref_fasta
+	string ref_fasta;
+	unsigned int store_samples; //Samples loaded from --store-in, ahead of the pileup samples
+	int type;
+	int bp;
+	int mp;
+	int min;
+	int max;
+	int thread;
+	int one_circle_limit;
+	int start_position;
+	unsigned int max_count;
+	unsigned int sample_count;
+	float ratio_nchar;
+	float ratio_del;
+	float step;
+	float eps;
+	float p_snp;
+	float result_filter;
+	float end_condition;
+} Parameters;
+
+extern Parameters params;
+
+#endif
@@ -0,0 +1,119 @@
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include "progress.h"
+
+Progress_Reporter progress;
+
+Progress_Reporter::Progress_Reporter()
+{
+	Active = false;
+	Stopping = false;
+	Interval = 0;
+	Total_bytes = 0;
+	Bytes = 0;
+	Lines = 0;
+	Pos = 0;
+	Contig = "NA";
+}
+
+Progress_Reporter::~Progress_Reporter()
+{
+	Stop();
+}
+
+void Progress_Reporter::Start(double interval, const string &status_file, unsigned long long total_bytes)
+{
+	if ((interval <= 0) || Active)
+		return;
+	this->Interval = interval;
+	this->Status_file = status_file;
+	this->Total_bytes = total_bytes;
+	this->Stopping = false;
+	this->Begin = chrono::steady_clock::now();
+	this->Active = true;
+	Worker = thread(&Progress_Reporter::Run, this);
+}
+
+void Progress_Reporter::Stop()
+{
+	if (!Active)
+		return;
+	{
+		lock_guard<mutex> guard(Lock);
+		Stopping = true;
+	}
+	Wake.notify_one();
+	Worker.join();
+	Active = false;
+}
+
+void Progress_Reporter::Set_Contig(const string &contig)
+{
+	lock_guard<mutex> guard(Lock);
+	Contig = contig;
+}
+
+void Progress_Reporter::Run()
+{
+	unsigned long long last_bytes = 0;
+	unsigned long long last_lines = 0;
+	chrono::steady_clock::time_point last = Begin;
+
+	unique_lock<mutex> guard(Lock);
+	while (true)
+	{
+		bool done = Wake.wait_for(guard, chrono::duration<double>(Interval), [&] { return Stopping; });
+
+		chrono::steady_clock::time_point now = chrono::steady_clock::now();
+		double span = chrono::duration<double>(now - last).count();
+		unsigned long long bytes = Bytes.load(memory_order_relaxed);
+		unsigned long long lines = Lines.load(memory_order_relaxed);
+
+		//Rates over the last interval, the whole run for the final line
+		if (done)
+		{
+			span = chrono::duration<double>(now - Begin).count();
+			last_bytes = 0;
+			last_lines = 0;
+		}
+		span = (span > 0) ? span : 1e-9;
+		Print(chrono::duration<double>(now - Begin).count(), (lines - last_lines) / span, (bytes - last_bytes) / span, done);
+
+		last = now;
+		last_bytes = bytes;
+		last_lines = lines;
+		if (done)
+			break;
+	}
+}
+
+//Called with Lock held
+void Progress_Reporter::Print(double seconds, double line_rate, double byte_rate, bool done)
+{
+	unsigned long long bytes = Bytes.load(memory_order_relaxed);
+	double fraction = (Total_bytes > 0) ? (double) bytes / Total_bytes : 0.0;
+	fraction = (fraction > 1.0) ? 1.0 : fraction;
+
+	char eta[32] = "NA";
+	if (done)
+		snprintf(eta, sizeof(eta), "done");
+	else if (fraction > 0)
+	{
+		long remain = seconds * (1.0 - fraction) / fraction;
+		snprintf(eta, sizeof(eta), "%ld:%02ld:%02ld", remain / 3600, (remain / 60) % 60, remain % 60);
+	}
+
+	char line[512];
+	snprintf(line, sizeof(line), "%s:%u\tlines %llu\t%.1f lines/s\t%.2f MB/s\t%.1f%%\tETA %s\n",
+			Contig.c_str(), Pos.load(memory_order_relaxed), Lines.load(memory_order_relaxed),
+			line_rate, byte_rate / 1e6, fraction * 100.0, eta);
+
+	if (Status_file.empty())
+		cerr << line << flush;
+	else
+	{
+		ofstream out(Status_file, ios::out);
+		out << line;
+	}
+}
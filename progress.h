@@ -0,0 +1,62 @@
+/*
+ * progress.h
+ *
+ * Periodic progress report from a timer thread. The reading thread only
+ * does relaxed atomic stores per line; the contig name is handed over
+ * under a lock when it changes.
+ */
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+using namespace std;
+
+class Progress_Reporter {
+public:
+	Progress_Reporter();
+	~Progress_Reporter();
+
+	void Start(double interval, const string &status_file, unsigned long long total_bytes);
+	void Stop();
+	void Set_Contig(const string &contig);
+
+	inline bool Enabled()
+	{
+		return Active;
+	}
+
+	inline void Add_Line(unsigned long long bytes, unsigned int pos)
+	{
+		Bytes.store(Bytes.load(memory_order_relaxed) + bytes, memory_order_relaxed);
+		Lines.store(Lines.load(memory_order_relaxed) + 1, memory_order_relaxed);
+		Pos.store(pos, memory_order_relaxed);
+	}
+
+private:
+	bool Active;
+	bool Stopping;
+	double Interval;
+	string Status_file;
+	unsigned long long Total_bytes;
+	atomic<unsigned long long> Bytes;
+	atomic<unsigned long long> Lines;
+	atomic<unsigned int> Pos;
+	string Contig;
+	mutex Lock;
+	condition_variable Wake;
+	thread Worker;
+	chrono::steady_clock::time_point Begin;
+
+	void Run();
+	void Print(double seconds, double line_rate, double byte_rate, bool done);
+};
+
+extern Progress_Reporter progress;
+
+#endif
@@ -1,15 +1,97 @@
 #include <iostream>
 #include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
 #include "seq_obj.h"
+#include "stats.h"
+#include "math_kernels.h"
+#include "table_cache.h"
+#include "isa_kernels.h"
+
+//Contig names in blocks that never move
+#define CONTIG_BLOCK 4096
+#define CONTIG_BLOCKS 4096
+
+//Names are only added, parse_site interns under the lock while the output
+//threads look names up without it, through the published size
+class Contig_Table {
+public:
+	Contig_Table()
+	{
+		for (int i = 0; i < CONTIG_BLOCKS; i++)
+			Blocks[i] = NULL;
+		Size = 0;
+		Intern("NA");
+	}
+
+	~Contig_Table()
+	{
+		for (int i = 0; i < CONTIG_BLOCKS; i++)
+			delete[] Blocks[i];
+	}
+
+	unsigned int Intern(const string &name)
+	{
+		lock_guard<mutex> lock(Lock);
+		unordered_map<string, unsigned int>::iterator it = Ids.find(name);
+		if (it != Ids.end())
+			return it->second;
+		unsigned int id = Size.load(memory_order_relaxed);
+		if (id >= CONTIG_BLOCK * CONTIG_BLOCKS)
+			throw invalid_argument("contig count");
+		if (Blocks[id / CONTIG_BLOCK] == NULL)
+			Blocks[id / CONTIG_BLOCK] = new string[CONTIG_BLOCK];
+		Blocks[id / CONTIG_BLOCK][id % CONTIG_BLOCK] = name;
+		Ids[name] = id;
+		Size.store(id + 1, memory_order_release);
+		return id;
+	}
+
+	const string &Name(unsigned int id)
+	{
+		if (id >= Size.load(memory_order_acquire))
+			id = 0;
+		return Blocks[id / CONTIG_BLOCK][id % CONTIG_BLOCK];
+	}
+
+private:
+	mutex Lock;
+	string *Blocks[CONTIG_BLOCKS];
+	atomic<unsigned int> Size; //Published names
+	unordered_map<string, unsigned int> Ids;
+};
+
+static Contig_Table contig_table;
+
+unsigned int intern_contig(const string &name)
+{
+	//Lines come contig by contig
+	static thread_local string last_name = "NA";
+	static thread_local unsigned int last_id = 0;
+	if (name != last_name)
+	{
+		last_id = contig_table.Intern(name);
+		last_name = name;
+	}
+	return last_id;
+}
+
+const string &contig_name(unsigned int id)
+{
+	return contig_table.Name(id);
+}
 
 float Seq_Obj::Get_Value_Result_Max() {
 	if (this->Value.empty()) {
-		cerr << "No value\t" << ID << endl;
+		cerr << "No value\t" << Get_ID() << endl;
 		return 0.0;
 	}
 	if (this->Value.size() < Type)
 	{
-		cerr << "out of range\t" << ID << endl;
+		cerr << "out of range\t" << Get_ID() << endl;
 		return 0.0;
 	}
 	float max = Value[0].result;
@@ -25,12 +107,12 @@ int Seq_Obj::Get_Value_Result_Max_Index()
 {
 	if (this->Value.empty())
 	{
-		cerr << "No value\t" << ID << endl;
+		cerr << "No value\t" << Get_ID() << endl;
 		return 0;
 	}
 	if (this->Value.size() < Type)
 	{
-		cerr << "out of range\t" << ID << endl;
+		cerr << "out of range\t" << Get_ID() << endl;
 		return 0;
 	}
 
@@ -47,34 +129,42 @@ int Seq_Obj::Get_Value_Result_Max_Index()
 	return max_index;
 }
 
+//Indel length after + or -, the digits are skipped
+static int indel_length(const arena_string &ref_info, int &iter, bool required)
+{
+	int length = 0;
+	int digits = 0;
+	while ((ref_info[iter] >= '0') && (ref_info[iter] <= '9'))
+	{
+		length = length * 10 + (ref_info[iter] - '0');
+		digits++;
+		iter++;
+	}
+	//As stoi, a + without a length is a parse error
+	if (required && (digits == 0))
+		throw invalid_argument("indel length");
+	return length;
+}
+
+//The filters only ever drop reads, so they compact the strings in place
 int Seq_Obj::Seq_Init_Filter()
 {
+	Stat_Timer timer(STAT_FILTER);
 	int iter = 0;
 	int valid = 0;
 	int length = this->Ref_Info.size();
-	string temp_ref_info = "";
+	int kept = 0;
 	while (iter < length) {
 		char test = this->Ref_Info[iter];
-		string temp = "";
 		switch (test)
 		{
 			case '+':
 				iter++;
-				temp = "";
-				while ((this->Ref_Info[iter] >= '0') && (this->Ref_Info[iter] <= '9')) {
-					temp += Ref_Info[iter];
-					iter++;
-				}
-				iter += stoi(temp);
+				iter += indel_length(this->Ref_Info, iter, true);
 				break;
 			case '-':
 				iter++;
-				temp = "";
-				while ((this->Ref_Info[iter] >= '0') && (this->Ref_Info[iter] <= '9')) {
-					temp += Ref_Info[iter];
-					iter++;
-				}
-				iter += atoi(temp.c_str());
+				iter += indel_length(this->Ref_Info, iter, false);
 				break;
 			case '$':
 				iter++;
@@ -83,12 +173,12 @@ int Seq_Obj::Seq_Init_Filter()
 				iter += 2;
 				break;
 			default:
-				temp_ref_info += test;
+				this->Ref_Info[kept++] = test;
 				iter++;
 				break;
 		}
 	}
-	this->Ref_Info = temp_ref_info;
+	this->Ref_Info.resize(kept);
 	if (this->Ref_Info.size() != this->Seq_Qual_1.size())
 	{
 		valid = 1;
@@ -99,12 +189,11 @@ int Seq_Obj::Seq_Init_Filter()
 
 int Seq_Obj::Seq_Qual_Filter(int bq, int mq)
 {
+	Stat_Timer timer(STAT_FILTER);
 	//Quality
 	int iter = 0;
 	int length = this->Seq_Qual_1.size();
-	string temp_qual_1 = "";
-	string temp_qual_2 = "";
-	string temp_ref_info = "";
+	int kept = 0;
 
 	int qual_bq = bq + 33;
 	int qual_mq = mq + 33;
@@ -117,13 +206,13 @@ int Seq_Obj::Seq_Qual_Filter(int bq, int mq)
 		{
 			if ((this->Seq_Qual_1[iter] >= qual_bq) && (this->Seq_Qual_2[iter] >= qual_mq))
 			{
-				temp_qual_1 += this->Seq_Qual_1[iter];
-				temp_qual_2 += this->Seq_Qual_2[iter];
+				this->Seq_Qual_1[kept] = this->Seq_Qual_1[iter];
+				this->Seq_Qual_2[kept] = this->Seq_Qual_2[iter];
 
 				if ((this->Ref_Info[iter] != '.') && (this->Ref_Info[iter] != ','))
 				{
 					char this_allele = toupper(this->Ref_Info[iter]);
-					temp_ref_info += this_allele;
+					this->Ref_Info[kept] = this_allele;
 					for (int i = 0; i < 4; i++)
 						if (this_allele == allele_array[i])
 						{
@@ -132,15 +221,16 @@ int Seq_Obj::Seq_Qual_Filter(int bq, int mq)
 						}
 				}
 				else
-					temp_ref_info += this->Ref;
+					this->Ref_Info[kept] = this->Ref;
+				kept++;
 			}
 		}
 		iter++;
 	}
 
-	this->Seq_Qual_1 = temp_qual_1;
-	this->Seq_Qual_2 = temp_qual_2;
-	this->Ref_Info = temp_ref_info;
+	this->Seq_Qual_1.resize(kept);
+	this->Seq_Qual_2.resize(kept);
+	this->Ref_Info.resize(kept);
 
 	for (int i = 0; i < 4; i++)
 	{
@@ -162,53 +252,73 @@ int Seq_Obj::Seq_Qual_Filter(int bq, int mq)
 	//RN
 	iter = 0;
 	length = this->Seq_Qual_1.size();
-	temp_qual_1 = "";
-	temp_qual_2 = "";
-	temp_ref_info = "";
+	kept = 0;
 
 	while (iter < length)
 	{
-		if (this->Ref_Info[iter] == this->Ref[0])
-		{
-			temp_ref_info += 'R';
-			temp_qual_1 += this->Seq_Qual_1[iter];
-			temp_qual_2 += this->Seq_Qual_2[iter];
-		}
-		else if (this->Ref_Info[iter] == max_allele)
+		char allele = this->Ref_Info[iter];
+		if ((allele == this->Ref) || (allele == max_allele))
 		{
-			temp_ref_info += 'N';
-			temp_qual_1 += this->Seq_Qual_1[iter];
-			temp_qual_2 += this->Seq_Qual_2[iter];
+			this->Ref_Info[kept] = (allele == this->Ref) ? 'R' : 'N';
+			this->Seq_Qual_1[kept] = this->Seq_Qual_1[iter];
+			this->Seq_Qual_2[kept] = this->Seq_Qual_2[iter];
+			kept++;
 		}
 		iter++;
 	}
 
-	this->Seq_Qual_1 = temp_qual_1;
-	this->Seq_Qual_2 = temp_qual_2;
-	this->Ref_Info = temp_ref_info;
-	return this->Seq_Qual_1.size();
+	this->Seq_Qual_1.resize(kept);
+	this->Seq_Qual_2.resize(kept);
+	this->Ref_Info.resize(kept);
+	Pack_Reads();
+	return this->Read_count;
+}
+
+//One quality byte min(bq, mq) per read, then the N flags eight reads to a byte
+void Seq_Obj::Pack_Reads()
+{
+	int length = this->Ref_Info.size();
+	this->Read_count = length;
+	this->Reads.assign(length + (length + 7) / 8, 0);
+	for (int j = 0; j < length; j++)
+	{
+		this->Reads[j] = (Seq_Qual_1[j] < Seq_Qual_2[j]) ? Seq_Qual_1[j] : Seq_Qual_2[j];
+		if (this->Ref_Info[j] == 'N')
+			this->Reads[length + (j >> 3)] |= 1 << (j & 7);
+	}
+
+	this->Ref_Info.clear();
+	this->Ref_Info.shrink_to_fit();
+	this->Seq_Qual_1.clear();
+	this->Seq_Qual_1.shrink_to_fit();
+	this->Seq_Qual_2.clear();
+	this->Seq_Qual_2.shrink_to_fit();
 }
 
 int Seq_Obj::Seq_Max_Filter(const unsigned int max_count)
 {
-	if ((max_count == 0) || (max_count >= this->Ref_Info.size()))
-		return this->Ref_Info.size();
-	string temp_qual_1 = "";
-	string temp_qual_2 = "";
-	string temp_ref_info = "";
+	Stat_Timer timer(STAT_FILTER);
+	if ((max_count == 0) || (max_count >= this->Read_count))
+		return this->Read_count;
 
+	//Get_Random returns the kept reads in increasing order, so the qualities compact in place
+	//and the flags are rebuilt behind them
 	int order[max_count];
-	int check = Get_Random(this->Ref_Info.size(), max_count, order);
+	unsigned char flags[(max_count + 7) / 8];
+	int check = Get_Random(this->Read_count, max_count, order);
+	for (unsigned int i = 0; i < (max_count + 7) / 8; i++)
+		flags[i] = 0;
 	for (unsigned int i = 0; i < max_count; i++)
 	{
-		temp_qual_1 += this->Seq_Qual_1[order[i]];
-		temp_qual_2 += this->Seq_Qual_2[order[i]];
-		temp_ref_info += this->Ref_Info[order[i]];
+		if (Read_N(order[i]))
+			flags[i >> 3] |= 1 << (i & 7);
+		this->Reads[i] = this->Reads[order[i]];
 	}
 
-	this->Seq_Qual_1 = temp_qual_1;
-	this->Seq_Qual_2 = temp_qual_2;
-	this->Ref_Info = temp_ref_info;
+	this->Read_count = max_count;
+	this->Reads.resize(max_count + (max_count + 7) / 8);
+	for (unsigned int i = 0; i < (max_count + 7) / 8; i++)
+		this->Reads[max_count + i] = flags[i];
 
 	return check;
 
@@ -243,51 +353,252 @@ float Seq_Obj::Get_Ratio_del()
 	return (float) star / (float) length;
 }
 
-void Seq_Obj::Calc_W()
-{
-	int length = this->Ref_Info.size();
+//1 - 10^(-Q/10) for every quality character, the same value the pow call gives
+class Qual_W_Table {
+public:
+	float W[256];
 
+	Qual_W_Table()
+	{
+		for (int c = 0; c < 256; c++)
+			W[c] = 1 - pow(10.0, ((int) (char) c - 33) * (-0.1));
+	}
+};
+
+static const Qual_W_Table qual_w_table;
+
+//Weights of the sample being scanned or tabled on this thread
+static thread_local read_weights read_scratch;
+
+//Kept per thread, so scanning a sample does not hold a float per read in every sample
+void Seq_Obj::Calc_W(read_weights &reads)
+{
+	int length = this->Read_count;
+	reads.w.resize(length);
+	reads.nn.resize(length);
+	reads.cls.resize(length);
+	reads.class_w.clear();
+	reads.class_nn.clear();
+
+	//Class of every quality byte and allele, -1 until a read has it
+	int class_of[512];
+	memset(class_of, -1, sizeof(class_of));
 	for (int i = 0; i < length; i++)
-		W[i] = 1 - pow(10.0, (((Seq_Qual_1[i] < Seq_Qual_2[i]) ? Seq_Qual_1[i] : Seq_Qual_2[i]) - 33) * (-0.1));
+	{
+		reads.w[i] = qual_w_table.W[this->Reads[i]];
+		reads.nn[i] = Read_N(i) ? 1.0f : 0.0f;
+		int key = this->Reads[i] * 2 + (Read_N(i) ? 1 : 0);
+		if (class_of[key] < 0)
+		{
+			class_of[key] = reads.class_w.size();
+			reads.class_w.push_back(reads.w[i]);
+			reads.class_nn.push_back(reads.nn[i]);
+		}
+		reads.cls[i] = class_of[key];
+	}
 }
 
 int Seq_Obj::Calc_Value(float end, float step)
 {
-	end = end - step / 10.0;
-	Calc_W();
+	Stat_Timer timer(STAT_SCAN);
+	return (this->Type == 2) ? Scan_Value<2>(end, step) : Scan_Value<3>(end, step);
+}
 
-	//Function table
-	float (*func_ptr[3][2])(float, float);
-	Func_Init(func_ptr);
+float Seq_Obj::Calc_Value(float test_p, float test_p_2, int type)
+{
+	read_weights &reads = read_scratch;
+	Calc_W(reads);
+	switch (type)
+	{
+		case 0:
+			return Model_Value<Model_RR>(reads, test_p, test_p_2);
+		case 1:
+			return Model_Value<Model_NN>(reads, test_p, test_p_2);
+		default:
+			return Model_Value<Model_RN>(reads, test_p, test_p_2);
+	}
+}
 
-	// For each genotype of RR and NN
-	for (unsigned int i = 0; i < Type - 1; i++)
+void Seq_Obj::pre_Calc_Value()
+{
+	Stat_Timer timer(STAT_TABLE);
+	if (this->Type == 2)
+		Fill_Tables<2>();
+	else
+		Fill_Tables<3>();
+	this->Tables_level = math_kernel();
+}
+
+//Everything the scan values and tables depend on, the reads in order as they are summed in order
+void Seq_Obj::Table_Key(string &key, float end, float step)
+{
+	int level = math_kernel();
+	key.clear();
+	key.append((const char*) &this->Type, sizeof(this->Type));
+	key.append((const char*) &level, sizeof(level));
+	key.append((const char*) &end, sizeof(end));
+	key.append((const char*) &step, sizeof(step));
+	key.append((const char*) &this->end, sizeof(this->end));
+	key.append((const char*) &this->step, sizeof(this->step));
+	key.append((const char*) &this->Read_count, sizeof(this->Read_count));
+	key.append((const char*) this->Reads.data(), this->Reads.size());
+}
+
+void Seq_Obj::Calc_Tables(float end, float step, bool scanned)
+{
+	//Tables first, the scan takes the points it shares with them. A scan without the tables computes
+	//those points with the same kernel, so its values stand
+	if (!table_cache.Enabled())
 	{
-		this->Value[i].result = MIN;
-		this->Value[i].p = 0.0;
-		this->Value[i].p2 = 0.0;
-		float test_p = step;
+		pre_Calc_Value();
+		if (!scanned)
+			Calc_Value(end, step);
+		return;
+	}
 
-		while (test_p < end)
+	static thread_local string key;
+	Table_Key(key, end, step);
+	shared_ptr<const table_entry> cached = table_cache.Find(key);
+	if (cached)
+	{
+		Stat_Timer timer(STAT_TABLE);
+		stats.Add(COUNT_TABLE_CACHE_HIT);
+		for (unsigned int i = 0; i < this->Type; i++)
 		{
-			float test_result = this->Calc_Value(test_p, 0, i);
-			if (test_result > this->Value[i].result)
-			{
-				this->Value[i].result = test_result;
-				this->Value[i].p = test_p;
-				this->Value[i].p2 = 0;
-			}
-			test_p += step;
+			this->Value[i] = cached->value[i];
+			this->valuesVector[i * 3 + 0] = cached->value[i].result;
+			this->valuesVector[i * 3 + 1] = cached->value[i].p;
+			this->valuesVector[i * 3 + 2] = cached->value[i].p2;
 		}
+		copy(cached->one.begin(), cached->one.end(), this->typeoneVec.begin());
+		copy(cached->two.begin(), cached->two.end(), this->typetwoVec.begin());
+		copy(cached->three.begin(), cached->three.end(), this->typethreeVec.begin());
+		return;
 	}
 
-	//Genotype NR and RN
+	stats.Add(COUNT_TABLE_CACHE_MISS);
+	pre_Calc_Value();
+	if (!scanned)
+		Calc_Value(end, step);
+
+	shared_ptr<table_entry> entry = make_shared<table_entry>();
+	entry->key = key;
+	entry->value.assign(this->Value.begin(), this->Value.end());
+	entry->one.assign(this->typeoneVec.begin(), this->typeoneVec.end());
+	entry->two.assign(this->typetwoVec.begin(), this->typetwoVec.end());
+	entry->three.assign(this->typethreeVec.begin(), this->typethreeVec.end());
+	entry->bytes = sizeof(table_entry) + key.size() + entry->value.size() * sizeof(internal_value)
+			+ (entry->one.size() + entry->two.size() + entry->three.size()) * sizeof(float);
+	table_cache.Insert(entry);
+}
+
+//Log likelihood of the reads under one genotype model
+template <class Model>
+float Seq_Obj::Model_Value(const read_weights &reads, float test_p, float test_p_2)
+{
+	float r = Model::R(test_p, test_p_2);
+	float n = Model::N(test_p, test_p_2);
+
+	switch (math_kernel())
+	{
+		case 1:
+			return Log_Sum<1>(reads, r, n);
+		case 2:
+			return Log_Sum<2>(reads, r, n);
+		case MATH_CHECKED:
+			return Log_Sum<MATH_CHECKED>(reads, r, n);
+		default:
+			return Log_Sum<0>(reads, r, n);
+	}
+}
+
+template <int LEVEL>
+float Seq_Obj::Log_Sum(const read_weights &reads, float r, float n)
+{
+	int length = this->Read_count;
+	float test_result = 0.0;
+
+	//The fast kernels are approximate anyway, so the rows are rounded in float
+	//without branches and the sum is reordered, which lets the loop vectorize
+	if ((LEVEL == 1) || (LEVEL == 2))
+		test_result = isa->log_sum[LEVEL](reads.w.data(), reads.nn.data(), length, r, n);
+	else if (Shared_Classes(reads))
+	{
+		//One log per read class, still added read by read in order
+		int classes = reads.class_w.size();
+		float logs[classes];
+		for (int c = 0; c < classes; c++)
+			logs[c] = math_log_level<LEVEL>(Row_Sum(reads.class_w[c], reads.class_nn[c], r, n));
+		const int *cls = reads.cls.data();
+		for (int j = 0; j < length; j++)
+			test_result = test_result + logs[cls[j]];
+	}
+	else
+	{
+		for (int j = 0; j < length; j++)
+			test_result = test_result + math_log_level<LEVEL>(Row_Sum(reads.w[j], reads.nn[j], r, n));
+	}
 
-	this->Value[2].result = this->Calc_Value(this->Value[0].p, this->Value[1].p, 2);
-	this->Value[2].p = this->Value[0].p;
-	this->Value[2].p2 = this->Value[1].p;
+	return test_result;
+}
 
-	for (unsigned int i = 0; i < this->Type; i++)
+//Returns the grid index of the best point, -1 if none, table (if filled with the same kernel)
+//gives the value of the points where the summed test_p lands on the table grid (i + 1) * step
+template <class Model>
+int Seq_Obj::Scan_Model(const read_weights &reads, internal_value &value, float end, float step, const float *table)
+{
+	value.result = MIN;
+	value.p = 0.0;
+	value.p2 = 0.0;
+	float test_p = step;
+	int grid = typeoneVec.size();
+	int best = -1;
+
+	for (int k = 0; test_p < end; k++)
+	{
+		bool tabled = (table != NULL) && (k < grid) && (test_p == (k + 1) * this->step);
+		float test_result = tabled ? table[k] : Model_Value<Model>(reads, test_p, 0);
+		if (test_result > value.result)
+		{
+			value.result = test_result;
+			value.p = test_p;
+			value.p2 = 0;
+			best = k;
+		}
+		test_p += step;
+	}
+	return best;
+}
+
+template <unsigned int TYPE>
+int Seq_Obj::Scan_Value(float end, float step)
+{
+	end = end - step / 10.0;
+	read_weights &reads = read_scratch;
+	Calc_W(reads);
+
+	//Tables filled by the fast kernels sum in another order than the scan
+	int level = math_kernel();
+	bool tabled = (this->Tables_level == level) && (level != 1) && (level != 2);
+
+	// For each genotype of RR and NN
+	int best_rr = Scan_Model<Model_RR>(reads, this->Value[0], end, step, tabled ? this->typeoneVec.data() : NULL);
+	int best_nn = Scan_Model<Model_NN>(reads, this->Value[1], end, step, tabled ? this->typetwoVec.data() : NULL);
+
+	//Genotype NR and RN
+	if (TYPE == 3)
+	{
+		int grid = this->typeoneVec.size();
+		if (tabled && (best_rr >= 0) && (best_nn >= 0) && (best_rr < grid) && (best_nn < grid)
+				&& (this->Value[0].p == (best_rr + 1) * this->step) && (this->Value[1].p == (best_nn + 1) * this->step))
+			this->Value[2].result = this->typethreeVec[best_rr * grid + best_nn];
+		else
+			this->Value[2].result = Model_Value<Model_RN>(reads, this->Value[0].p, this->Value[1].p);
+		this->Value[2].p = this->Value[0].p;
+		this->Value[2].p2 = this->Value[1].p;
+	}
+
+	for (unsigned int i = 0; i < TYPE; i++)
 	{
 		this->valuesVector.at(i * 3 + 0) = this->Value.at(i).result;
 		this->valuesVector.at(i * 3 + 1) = this->Value.at(i).p;
@@ -297,59 +608,88 @@ int Seq_Obj::Calc_Value(float end, float step)
 	return 0;
 }
 
-float Seq_Obj::Calc_Value(float test_p, float test_p_2, int type)
+template <unsigned int TYPE>
+void Seq_Obj::Fill_Tables()
 {
-	int length = this->Ref_Info.size();
-	//Function table
-	float (*func_ptr[3][2])(float, float);
-	Func_Init(func_ptr);
+	read_weights &reads = read_scratch;
+	Calc_W(reads);
+	switch (math_kernel())
+	{
+		case 1:
+			Fill_Tables_Fast<TYPE, 1>(reads);
+			return;
+		case 2:
+			Fill_Tables_Fast<TYPE, 2>(reads);
+			return;
+	}
 
+	int grid = typeoneVec.size();
+	for (int i = 0; i < grid; i++)
+	{
+		typeoneVec[i] = Model_Value<Model_RR>(reads, (i + 1) * this->step, 0);
+		typetwoVec[i] = Model_Value<Model_NN>(reads, (i + 1) * this->step, 0);
+		if (TYPE == 3)
+			for (int j = 0; j < grid; j++)
+				typethreeVec[i * grid + j] = Model_Value<Model_RN>(reads, (i + 1) * this->step, (j + 1) * this->step);
+	}
+}
 
+//Tables at the approximate levels, one row of grid points at a time so the
+//loop runs across the grid and vectorizes whatever the depth
+template <unsigned int TYPE, int LEVEL>
+void Seq_Obj::Fill_Tables_Fast(const read_weights &reads)
+{
+	int grid = typeoneVec.size();
+	vector<float> r(grid), n(grid);
 
-	float test_result = 0.0;
-	//For each point in the Ref_Info to get the sum of Ref_Info
-	for (int j = 0; j < length; j++)
+	for (int i = 0; i < grid; i++)
 	{
-		int num = 0;
-		switch (this->Ref_Info[j])
-		{
-			case 'R':
-				num = 0;
-				break;
-			case 'N':
-				num = 1;
-				break;
-			default:
-				break;
-		}
-		//Get the sum of each row of the table
-		float row_sum = 0.0;
-		for (int k = 0; k < 2; k++)
-			if (k == num)
-				row_sum += (*func_ptr[type][k])(test_p, test_p_2) * W[j];
-			else
-				row_sum += (*func_ptr[type][k])(test_p, test_p_2) * (1.0 - W[j]);                                  ///3.0;
+		r[i] = Model_RR::R((i + 1) * this->step, 0);
+		n[i] = Model_RR::N((i + 1) * this->step, 0);
+	}
+	Grid_Log_Sum<LEVEL>(reads, r.data(), n.data(), grid, typeoneVec.data());
 
-		test_result = test_result + log(row_sum);
+	for (int i = 0; i < grid; i++)
+	{
+		r[i] = Model_NN::R((i + 1) * this->step, 0);
+		n[i] = Model_NN::N((i + 1) * this->step, 0);
 	}
+	Grid_Log_Sum<LEVEL>(reads, r.data(), n.data(), grid, typetwoVec.data());
 
-	//cout << test_p << "\t" << test_p_2 << "\t" << type << "\t" << test_result << endl;
-	return test_result;
+	if (TYPE == 3)
+		for (int i = 0; i < grid; i++)
+		{
+			for (int j = 0; j < grid; j++)
+			{
+				r[j] = Model_RN::R((i + 1) * this->step, (j + 1) * this->step);
+				n[j] = Model_RN::N((i + 1) * this->step, (j + 1) * this->step);
+			}
+			Grid_Log_Sum<LEVEL>(reads, r.data(), n.data(), grid, &typethreeVec[i * grid]);
+		}
 }
 
-void Seq_Obj::pre_Calc_Value()
+//result[i] = sum over the reads of log(row(r[i], n[i])), the reads are added in order
+template <int LEVEL>
+void Seq_Obj::Grid_Log_Sum(const read_weights &reads, const float *r, const float *n, int count, float *result)
 {
-	for (int i = 0; i < typeoneVec.size(); i++)
+	int length = this->Read_count;
+	if (!Shared_Classes(reads))
 	{
-		typeoneVec[i] = this->Calc_Value((i + 1) * this->step, 0, 0);
-		typetwoVec[i] = this->Calc_Value((i + 1) * this->step, 0, 1);
-		for (int j = 0; j < typeoneVec.size(); j++)
-		{
-			typethreeVec[i * typeoneVec.size() + j] = this->Calc_Value((i + 1) * this->step, (j + 1) * this->step, 2);
-		}
+		isa->grid_log_sum[LEVEL](reads.w.data(), reads.nn.data(), length, r, n, count, result);
+		return;
 	}
+
+	static thread_local vector<float> class_logs;
+	class_logs.resize(reads.class_w.size() * count);
+	isa->grid_log_classes[LEVEL](reads.class_w.data(), reads.class_nn.data(), reads.class_w.size(),
+			reads.cls.data(), length, r, n, count, class_logs.data(), result);
 }
 
+template int Seq_Obj::Scan_Value<2>(float end, float step);
+template int Seq_Obj::Scan_Value<3>(float end, float step);
+template void Seq_Obj::Fill_Tables<2>();
+template void Seq_Obj::Fill_Tables<3>();
+
 float Seq_Obj::get_Calc_Value(float step0, float step1, int type, float step_length)
 {
 	if (type == 0)
@@ -1,6 +1,9 @@
 #include <string>
 #include <array>
+#include <cmath>
 #include <vector>
+#include <iostream>
+#include "site_arena.h"
 #ifndef SEQ_OBJ_H
 #define SEQ_OBJ_H
 
@@ -15,21 +18,39 @@ typedef struct _value {
 	float p2;
 } internal_value;
 
+//Weight and allele (1.0 for N) of every read of the sample being scanned, expanded from the packed reads
+//Reads of the same quality byte and allele form a class, whose rows (and logs) are the same
+typedef struct _read_weights {
+	vector<float> w;
+	vector<float> nn;
+	vector<int> cls;
+	vector<float> class_w;
+	vector<float> class_nn;
+} read_weights;
+
+//Contig names are interned, sites and samples keep a small id, 0 is "NA"
+unsigned int intern_contig(const string &name);
+const string &contig_name(unsigned int id);
+
 class Seq_Obj {
 public:
 
 	friend class Multi_Seq_Obj;
+	friend class Batch_EM;
+	friend class Evidence_Store;
 
-	Seq_Obj(string &_ID, unsigned int _Pos, string &_Ref, int _Num_Two,
-			string &_Ref_Info, string &_Seq, string &_Seq_Two, unsigned int type, float step, float end)
+	//Buffers come from the arena if one is given, the caller then leaves the object to it
+	Seq_Obj(unsigned int _Contig, unsigned int _Pos, char _Ref, int _Num_Two,
+			const string &_Ref_Info, const string &_Seq, const string &_Seq_Two, unsigned int type, float step, float end,
+			Site_Arena *arena = NULL) : Seq_Obj(arena)
 	{
-		this->ID = _ID;
+		this->Contig = _Contig;
 		this->Pos = _Pos;
 		this->Ref = _Ref;
 		this->Num_Two = _Num_Two;
-		this->Ref_Info = _Ref_Info;
-		this->Seq_Qual_1 = _Seq;
-		this->Seq_Qual_2 = _Seq_Two;
+		this->Ref_Info.assign(_Ref_Info.data(), _Ref_Info.size());
+		this->Seq_Qual_1.assign(_Seq.data(), _Seq.size());
+		this->Seq_Qual_2.assign(_Seq_Two.data(), _Seq_Two.size());
 		this->Type = type;
 		initVectors(type, step, end);
 
@@ -37,30 +58,52 @@ public:
 		this->Max_allele_count = 0;
 	}
 
-	Seq_Obj()
+	//From the filtered evidence of an evidence store, the reads are already packed
+	Seq_Obj(unsigned int _Contig, unsigned int _Pos, char _Ref, int _Num_Two,
+			const unsigned char *reads, int read_count, char max_allele, int max_allele_count,
+			unsigned int type, float step, float end, Site_Arena *arena = NULL) : Seq_Obj(arena)
+	{
+		this->Contig = _Contig;
+		this->Pos = _Pos;
+		this->Ref = _Ref;
+		this->Num_Two = _Num_Two;
+		this->Read_count = read_count;
+		this->Reads.assign(reads, reads + read_count + (read_count + 7) / 8);
+		this->Type = type;
+		initVectors(type, step, end);
+
+		this->Max_allele = max_allele;
+		this->Max_allele_count = max_allele_count;
+	}
+
+	Seq_Obj(Site_Arena *arena = NULL) : Ref_Info(arena), Seq_Qual_1(arena), Seq_Qual_2(arena),
+			Reads(arena), Value(arena), classCounter(arena), valuesVector(arena),
+			typeoneVec(arena), typetwoVec(arena), typethreeVec(arena)
 	{
-		this->ID = "";
+		this->Contig = 0; //"NA"
 		this->Pos = 0;
-		this->Ref = "";
+		this->Ref = '\0';
+		this->Read_count = 0;
 		this->Num_Two = -1;
 		this->Ref_Info = "";
 		this->Seq_Qual_1 = "";
 		this->Seq_Qual_2 = "";
 		this->Type = 0;
+		this->Tables_level = -1;
 
 		this->Max_allele = 'N';
 		this->Max_allele_count = 0;
 	}
 
-	Seq_Obj(vector<string> &obj, unsigned int type, float step, float end)
+	Seq_Obj(vector<string> &obj, unsigned int type, float step, float end) : Seq_Obj()
 	{
-		this->ID = obj[0];
+		this->Contig = intern_contig(obj[0]);
 		this->Pos = stoi(obj[1]);
-		this->Ref = obj[2];
+		this->Ref = obj[2][0];
 		this->Num_Two = stoi(obj[3]);
-		this->Ref_Info = obj[4];
-		this->Seq_Qual_1 = obj[5];
-		this->Seq_Qual_2 = obj[6];
+		this->Ref_Info.assign(obj[4].data(), obj[4].size());
+		this->Seq_Qual_1.assign(obj[5].data(), obj[5].size());
+		this->Seq_Qual_2.assign(obj[6].data(), obj[6].size());
 		this->Type = type;
 		initVectors(type, step, end);
 
@@ -68,15 +111,15 @@ public:
 		this->Max_allele_count = 0;
 	}
 
-	Seq_Obj(array<string, 7> &obj, unsigned int type, float step, float end)
+	Seq_Obj(array<string, 7> &obj, unsigned int type, float step, float end) : Seq_Obj()
 	{
-		this->ID = obj[0];
+		this->Contig = intern_contig(obj[0]);
 		this->Pos = stoi(obj[1]);
-		this->Ref = obj[2];
+		this->Ref = obj[2][0];
 		this->Num_Two = stoi(obj[3]);
-		this->Ref_Info = obj[4];
-		this->Seq_Qual_1 = obj[5];
-		this->Seq_Qual_2 = obj[6];
+		this->Ref_Info.assign(obj[4].data(), obj[4].size());
+		this->Seq_Qual_1.assign(obj[5].data(), obj[5].size());
+		this->Seq_Qual_2.assign(obj[6].data(), obj[6].size());
 		this->Type = type;
 		initVectors(type, step, end);
 
@@ -94,9 +137,14 @@ public:
 		return this->Max_allele;
 	}
 
-	inline string Get_ID()
+	inline const string &Get_ID()
+	{
+		return contig_name(this->Contig);
+	}
+
+	inline unsigned int Get_Contig()
 	{
-		return this->ID;
+		return this->Contig;
 	}
 
 	inline unsigned int Get_Pos()
@@ -104,36 +152,48 @@ public:
 		return this->Pos;
 	}
 
+	//Reads kept by the filters
 	inline int Get_Ref_Length()
 	{
-		return Ref_Info.size();
+		return this->Read_count;
 	}
 
-	inline string Get_Ref()
+	inline char Get_Ref()
 	{
 		return this->Ref;
 	}
 
+	//R/N of the kept reads once packed, the pileup bases before
 	inline string Get_Ref_Info()
 	{
-		return this->Ref_Info;
+		if (this->Reads.empty())
+			return string(this->Ref_Info.data(), this->Ref_Info.size());
+		string ref_info(this->Read_count, 'R');
+		for (int j = 0; j < this->Read_count; j++)
+			if (Read_N(j))
+				ref_info[j] = 'N';
+		return ref_info;
 	}
 
+	//Once packed both are the combined quality min(bq, mq)
 	inline string Get_Seq_Qual(int n)
 	{
-		return (n == 0) ? this->Seq_Qual_1 : this->Seq_Qual_2;
+		if (!this->Reads.empty())
+			return string((const char*) this->Reads.data(), this->Read_count);
+		const arena_string &qual = (n == 0) ? this->Seq_Qual_1 : this->Seq_Qual_2;
+		return string(qual.data(), qual.size());
 	}
 
 	inline float Get_Value_Result(const unsigned int n)
 	{
 		if (this->Value.empty())
 		{
-			cerr << "No value\t" << ID << endl;
+			cerr << "No value\t" << Get_ID() << endl;
 			return 0.0;
 		}
 		if (this->Value.size() <= n)
 		{
-			cerr << "out of range\t" << ID << endl;
+			cerr << "out of range\t" << Get_ID() << endl;
 			return 0.0;
 		}
 		return this->Value[n].result;
@@ -143,12 +203,12 @@ public:
 	{
 		if (this->Value.empty())
 		{
-			cerr << "No value\t" << ID << endl;
+			cerr << "No value\t" << Get_ID() << endl;
 			return 0.0;
 		}
 		if (this->Value.size() <= n)
 		{
-			cerr << "out of range\t" << ID << endl;
+			cerr << "out of range\t" << Get_ID() << endl;
 			return 0.0;
 		}
 		if (i == 0)
@@ -159,12 +219,12 @@ public:
 
 	inline vector<int> getClassCounter()
 	{
-		return this->classCounter;
+		return vector<int>(this->classCounter.begin(), this->classCounter.end());
 	}
 
 	inline vector<float> getValuesVector()
 	{
-		return this->valuesVector;
+		return vector<float>(this->valuesVector.begin(), this->valuesVector.end());
 	}
 
 
@@ -173,38 +233,89 @@ public:
 	int Seq_Max_Filter(const unsigned int max_count);
 	float Get_Ratio_nchar();
 	float Get_Ratio_del();
-	void Calc_W();
+	void Calc_W(read_weights &reads);
 	int Calc_Value(float end, float step);float Calc_Value(float test_p, float test_p_2, int type);
 	float Get_Value_Result_Max();
 	int Get_Value_Result_Max_Index();
 
 	void pre_Calc_Value();
+	//Calc_Value(end, step) and pre_Calc_Value(), through the table cache when it is enabled,
+	//scanned if the values of Calc_Value(end, step) are already there and only the tables are missing
+	void Calc_Tables(float end, float step, bool scanned = false);
+
+	//Grid of the next tables, no finer than the one the sample was built with, so the tables only
+	//shrink and grow back within their storage and the worker threads do not touch the arena
+	inline void Set_Step(float step)
+	{
+		int n = floor((this->end - step / 10) / step);
+		this->step = step;
+		this->typeoneVec.resize(n);
+		this->typetwoVec.resize(n);
+		if (this->Type == 3)
+			this->typethreeVec.resize(n * n);
+		this->Tables_level = -1;
+	}
 	float get_Calc_Value(float step0, float step1, int type, float step_length);
 
 private:
+	//Kernels specialized by genotype model and type count (3 diploid, 2 haploid)
+	template <class Model> float Model_Value(const read_weights &reads, float test_p, float test_p_2);
+	template <int LEVEL> float Log_Sum(const read_weights &reads, float r, float n);
+
+	//Row sum of the R and N columns for a read of weight w, in the float and double steps of the original table walk
+	inline float Row_Sum(float w, float nn, float r, float n)
+	{
+		float row_r = r * w + n * (1.0 - w);
+		float row_n_r = r * (1.0 - w);
+		float row_n = row_n_r + n * w;
+		return (nn != 0.0f) ? row_n : row_r;
+	}
+	//Logs by read class only pay off when the classes save a quarter of them
+	inline bool Shared_Classes(const read_weights &reads)
+	{
+		return 4 * (int) reads.class_w.size() <= 3 * this->Read_count;
+	}
+	template <class Model> int Scan_Model(const read_weights &reads, internal_value &value, float end, float step, const float *table);
+	template <unsigned int TYPE> int Scan_Value(float end, float step);
+	template <unsigned int TYPE> void Fill_Tables();
+	template <unsigned int TYPE, int LEVEL> void Fill_Tables_Fast(const read_weights &reads);
+	template <int LEVEL> void Grid_Log_Sum(const read_weights &reads, const float *r, const float *n, int count, float *result);
+
+	void Table_Key(string &key, float end, float step);
+
+	//Packed reads, Read_count quality bytes min(bq, mq) then one N bit per read
+	void Pack_Reads();
+	inline bool Read_N(int j)
+	{
+		return (this->Reads[this->Read_count + (j >> 3)] >> (j & 7)) & 1;
+	}
+
 	int Num_Two;
 	unsigned int Type;
 	unsigned int Pos;
-	string ID;
-	string Ref;
-	string Ref_Info;
-	string Seq_Qual_1;
-	string Seq_Qual_2;
-	vector<float> W;
-	vector<internal_value> Value;
+	unsigned int Contig;
+	char Ref;
+	int Read_count;
+	//Pileup bases and qualities, only until Seq_Qual_Filter packs the kept reads
+	arena_string Ref_Info;
+	arena_string Seq_Qual_1;
+	arena_string Seq_Qual_2;
+	arena_vector<unsigned char> Reads;
+	arena_vector<internal_value> Value;
 
 	char Max_allele;
 	int Max_allele_count;
 
-	vector<int> classCounter;
-	vector<float> valuesVector;
+	arena_vector<int> classCounter;
+	arena_vector<float> valuesVector;
 
 	//To save the Calc_Values
-	vector<float> typeoneVec;
-	vector<float> typetwoVec;
-	vector<float> typethreeVec;
+	arena_vector<float> typeoneVec;
+	arena_vector<float> typetwoVec;
+	arena_vector<float> typethreeVec;
 	float step;
 	float end;
+	int Tables_level; //Math kernel the tables were filled with, -1 before
 
 	inline void initVectors(int type, float step, float end)
 	{
@@ -212,49 +323,57 @@ private:
 		this->end = end;
 		this->classCounter.resize(4, 0);
 		this->valuesVector.resize(3 * type, 0.0);
-		this->W.resize(this->Ref_Info.size(), 0.0);
 		this->Value.resize(type);
 		this->typeoneVec.resize(floor((end - step / 10) / step));
 		this->typetwoVec.resize(floor((end - step / 10) / step));
-		this->typethreeVec.resize(floor((end - step / 10) / step) * floor((end - step / 10) / step));
+		//RN table for diploid sites only
+		if (type == 3)
+			this->typethreeVec.resize(floor((end - step / 10) / step) * floor((end - step / 10) / step));
 	}
 };
 
 
 
-inline float func_1(float p1, float p2)
+//Genotype models, the probability of a reference (R) and a non reference (N) read
+//p1 and p2 are the error rates, RN uses both and is only scanned for diploid sites
+struct Model_RR
 {
-	return 1.0 - p1;
-}
+	static inline float R(float p1, float p2)
+	{
+		return 1.0 - p1;
+	}
 
-inline float func_2(float p1, float p2)
-{
-	return p1;
-}
+	static inline float N(float p1, float p2)
+	{
+		return p1;
+	}
+};
 
-inline float func_3(float p1, float p2)
+struct Model_NN
 {
-	return 0.5 * (1.0 - p1) + 0.5 * p2;
-}
+	static inline float R(float p1, float p2)
+	{
+		return p1;
+	}
 
-inline float func_4(float p1, float p2)
-{
-	return 0.5 * (1.0 - p2) + 0.5 * p1;
-}
+	static inline float N(float p1, float p2)
+	{
+		return 1.0 - p1;
+	}
+};
 
-inline int Func_Init(float (* (&func_ptr)[3][2])(float, float))
+struct Model_RN
 {
-	func_ptr[0][0] = func_1;
-    func_ptr[0][1] = func_2;
-
-    func_ptr[1][0] = func_2;
-    func_ptr[1][1] = func_1;
-
-    func_ptr[2][0] = func_3;
-    func_ptr[2][1] = func_4;
+	static inline float R(float p1, float p2)
+	{
+		return 0.5 * (1.0 - p1) + 0.5 * p2;
+	}
 
-    return 0;
-}
+	static inline float N(float p1, float p2)
+	{
+		return 0.5 * (1.0 - p2) + 0.5 * p1;
+	}
+};
 
 int Get_Random(const unsigned int total, const unsigned int n, int * order);
 
@@ -0,0 +1,71 @@
+#include <cstdlib>
+#include "site_arena.h"
+
+Site_Arena::Site_Arena()
+{
+	Current = 0;
+	Offset = 0;
+	Bytes = 0;
+}
+
+Site_Arena::~Site_Arena()
+{
+	Run_Destructors(0);
+	for (size_t i = 0; i < Blocks.size(); i++)
+		free(Blocks[i].data);
+}
+
+void *Site_Arena::Allocate(size_t bytes, size_t align)
+{
+	while (true)
+	{
+		if (Current < Blocks.size())
+		{
+			block &b = Blocks[Current];
+			size_t start = (Offset + align - 1) & ~(align - 1);
+			if (start + bytes <= b.size)
+			{
+				Offset = start + bytes;
+				Bytes += bytes;
+				return b.data + start;
+			}
+			//Next kept block, or a new one in front of the kept blocks too small for the request
+			Current++;
+			Offset = 0;
+			if ((Current < Blocks.size()) && (Blocks[Current].size >= bytes + align))
+				continue;
+		}
+
+		size_t size = (bytes + align > SITE_ARENA_BLOCK) ? bytes + align : SITE_ARENA_BLOCK;
+		block b = {(char*) malloc(size), size};
+		if (b.data == NULL)
+			throw bad_alloc();
+		Blocks.insert(Blocks.begin() + Current, b);
+		Offset = 0;
+	}
+}
+
+void Site_Arena::Run_Destructors(size_t count)
+{
+	while (Destructors.size() > count)
+	{
+		Destructors.back().second(Destructors.back().first);
+		Destructors.pop_back();
+	}
+}
+
+void Site_Arena::Reset()
+{
+	Run_Destructors(0);
+	Current = 0;
+	Offset = 0;
+	Bytes = 0;
+}
+
+void Site_Arena::Rewind(const mark &position)
+{
+	Run_Destructors(position.destructors);
+	Current = position.block;
+	Offset = position.offset;
+	Bytes = position.bytes;
+}
@@ -0,0 +1,149 @@
+/*
+ * site_arena.h
+ *
+ * Bump allocator for the sites of one analysis cycle. Sites, their samples
+ * and the sample buffers are carved from large blocks and released together
+ * by Reset() once the cycle is written, the blocks are kept for the next
+ * cycle. Objects with destructors are destroyed by Reset() (or Rewind()) in
+ * reverse order of creation. Not thread-safe, sites are only allocated while
+ * parsing.
+ *
+ * Containers take an Arena_Allocator, which falls back to the heap when it
+ * has no arena (sites built outside the analysis cycle).
+ */
+#include <cstddef>
+#include <new>
+#include <string>
+#include <vector>
+#include <utility>
+#include <type_traits>
+
+#ifndef SITE_ARENA_H
+#define SITE_ARENA_H
+
+#define SITE_ARENA_BLOCK (1 << 20)
+
+using namespace std;
+
+class Site_Arena {
+public:
+	//Position to rewind to, e.g. when a parsed site is not a candidate
+	typedef struct _mark {
+		size_t block;
+		size_t offset;
+		size_t destructors;
+		size_t bytes;
+	} mark;
+
+	Site_Arena();
+	~Site_Arena();
+
+	void *Allocate(size_t bytes, size_t align);
+	void Reset();
+	void Rewind(const mark &position);
+
+	inline mark Get_Mark()
+	{
+		mark position = {Current, Offset, Destructors.size(), Bytes};
+		return position;
+	}
+
+	//Bytes carved since the last Reset
+	inline size_t Get_Bytes()
+	{
+		return Bytes;
+	}
+
+	template <class T, class... Args>
+	T *Create(Args&&... args)
+	{
+		T *object = new (Allocate(sizeof(T), alignof(T))) T(forward<Args>(args)...);
+		if (!is_trivially_destructible<T>::value)
+			Destructors.push_back(make_pair((void*) object, &Destroy<T>));
+		return object;
+	}
+
+private:
+	typedef struct _block {
+		char *data;
+		size_t size;
+	} block;
+
+	vector<block> Blocks;
+	size_t Current;
+	size_t Offset;
+	size_t Bytes;
+	vector<pair<void*, void (*)(void*)>> Destructors;
+
+	template <class T>
+	static void Destroy(void *object)
+	{
+		((T*) object)->~T();
+	}
+
+	void Run_Destructors(size_t count);
+
+	Site_Arena(const Site_Arena &);
+	Site_Arena &operator=(const Site_Arena &);
+};
+
+template <class T>
+class Arena_Allocator {
+public:
+	typedef T value_type;
+
+	Arena_Allocator(Site_Arena *arena = NULL) : Arena(arena) {}
+
+	template <class U>
+	Arena_Allocator(const Arena_Allocator<U> &other) : Arena(other.Arena) {}
+
+	inline T *allocate(size_t n)
+	{
+		if (Arena == NULL)
+			return (T*) ::operator new(n * sizeof(T));
+		return (T*) Arena->Allocate(n * sizeof(T), alignof(T));
+	}
+
+	//Arena memory goes back with Reset
+	inline void deallocate(T *p, size_t n)
+	{
+		if (Arena == NULL)
+			::operator delete(p);
+	}
+
+	Site_Arena *Arena;
+};
+
+template <class T, class U>
+inline bool operator==(const Arena_Allocator<T> &a, const Arena_Allocator<U> &b)
+{
+	return a.Arena == b.Arena;
+}
+
+template <class T, class U>
+inline bool operator!=(const Arena_Allocator<T> &a, const Arena_Allocator<U> &b)
+{
+	return a.Arena != b.Arena;
+}
+
+template <class T>
+using arena_vector = vector<T, Arena_Allocator<T>>;
+typedef basic_string<char, char_traits<char>, Arena_Allocator<char>> arena_string;
+
+//Objects owned by an arena, or by the caller on the heap when there is none
+template <class T, class... Args>
+inline T *arena_new(Site_Arena *arena, Args&&... args)
+{
+	if (arena == NULL)
+		return new T(forward<Args>(args)...);
+	return arena->template Create<T>(forward<Args>(args)...);
+}
+
+template <class T>
+inline void arena_delete(Site_Arena *arena, T *object)
+{
+	if (arena == NULL)
+		delete object;
+}
+
+#endif
@@ -0,0 +1,103 @@
+#include <sys/resource.h>
+#include "stats.h"
+#include "isa_kernels.h"
+
+Run_Stats stats;
+
+static const char *Stage_names[STAT_STAGES] = {
+	"parse", "filter", "scan", "table", "em", "output"
+};
+
+static const char *Counter_names[STAT_COUNTERS] = {
+	"lines", "bytes_read", "bytes_written",
+	"sites_ref_n", "sites_parse_error",
+	"samples_no_coverage", "samples_qual_length", "samples_init_filter", "samples_ratio_filter",
+	"sites_not_enabled", "sites_low_coverage", "sites_candidate",
+	"sites_no_sample", "sites_single_sample", "sites_em",
+	"table_cache_hits", "table_cache_misses", "sites_pruned",
+	"sites_screened", "screen_verify_calls", "screen_verify_missed", "sites_refined",
+	"sites_output"
+};
+
+Run_Stats::Run_Stats()
+{
+	Active = false;
+	Counting = false;
+	for (int i = 0; i < STAT_COUNTERS; i++)
+		Counters[i] = 0;
+	for (int i = 0; i < STAT_STAGES; i++)
+	{
+		Stage_ns[i] = 0;
+		Stage_calls[i] = 0;
+	}
+	for (int i = 0; i < STAT_ITERATION_BINS; i++)
+		Iterations[i] = 0;
+	Batch_sites = 0;
+	Batch_bytes = 0;
+	Batch_seconds = 0;
+}
+
+void Run_Stats::Enable()
+{
+	Active = true;
+	Counting = true;
+	Start = chrono::steady_clock::now();
+}
+
+void Run_Stats::Count()
+{
+	Counting = true;
+}
+
+//One JSON object per line, batch < 0 for the final report
+void Run_Stats::Report(ostream &out, long batch)
+{
+	double wall = chrono::duration_cast<chrono::duration<double>>(chrono::steady_clock::now() - Start).count();
+
+	out << "{\"batch\":";
+	if (batch < 0)
+		out << "\"final\"";
+	else
+		out << batch;
+	out << ",\"wall_seconds\":" << wall << ",\"isa\":\"" << isa_name() << "\"";
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	out << ",\"peak_rss_bytes\":" << usage.ru_maxrss * 1024L;
+	if (batch >= 0)
+		out << ",\"batch_sites\":" << Batch_sites << ",\"batch_bytes\":" << Batch_bytes
+		    << ",\"batch_seconds\":" << Batch_seconds
+		    << ",\"batch_sites_per_second\":" << ((Batch_seconds > 0) ? Batch_sites / Batch_seconds : 0);
+
+	out << ",\"stages\":{";
+	for (int i = 0; i < STAT_STAGES; i++)
+	{
+		out << ((i == 0) ? "" : ",") << "\"" << Stage_names[i] << "\":{\"seconds\":" << Stage_ns[i] * 1e-9
+		    << ",\"calls\":" << Stage_calls[i] << "}";
+	}
+	out << "}";
+
+	out << ",\"counters\":{";
+	for (int i = 0; i < STAT_COUNTERS; i++)
+		out << ((i == 0) ? "" : ",") << "\"" << Counter_names[i] << "\":" << Counters[i];
+	out << "}";
+
+	unsigned long long lookups = Counters[COUNT_TABLE_CACHE_HIT] + Counters[COUNT_TABLE_CACHE_MISS];
+	if (lookups > 0)
+		out << ",\"table_cache_hit_rate\":" << (double) Counters[COUNT_TABLE_CACHE_HIT] / lookups;
+	if (Counters[COUNT_SCREEN_CALLS] > 0)
+		out << ",\"screen_false_negative_rate\":" << (double) Counters[COUNT_SCREEN_MISSED] / Counters[COUNT_SCREEN_CALLS];
+
+	unsigned long long total = 0;
+	bool first = true;
+	out << ",\"em_iterations\":{\"histogram\":{";
+	for (int i = 0; i < STAT_ITERATION_BINS; i++)
+	{
+		if (Iterations[i] == 0)
+			continue;
+		out << (first ? "" : ",") << "\"" << i << "\":" << Iterations[i];
+		total += Iterations[i] * i;
+		first = false;
+	}
+	out << "},\"total\":" << total << "}}" << endl;
+}
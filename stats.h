@@ -0,0 +1,139 @@
+/*
+ * stats.h
+ *
+ * Run-wide timing and counters, reported as JSON. Everything is a no-op
+ * until Enable() is called (--stats), Count() keeps only the counters
+ * (--screen-verify). Stage times are summed over threads
+ * and em includes the scan and table stages it triggers. Batch reports add
+ * the size, throughput and peak RSS of the cycle.
+ */
+#include <atomic>
+#include <chrono>
+#include <ostream>
+
+#ifndef STATS_H
+#define STATS_H
+
+//EM iteration histogram, the last bin also holds longer runs
+#define STAT_ITERATION_BINS 301
+
+using namespace std;
+
+enum Stat_Stage {
+	STAT_PARSE,
+	STAT_FILTER,
+	STAT_SCAN,
+	STAT_TABLE,
+	STAT_EM,
+	STAT_OUTPUT,
+	STAT_STAGES
+};
+
+enum Stat_Counter {
+	COUNT_LINES,
+	COUNT_BYTES_READ,
+	COUNT_BYTES_WRITTEN,
+	COUNT_REF_N,
+	COUNT_PARSE_ERROR,
+	COUNT_SAMPLE_NO_COVERAGE,
+	COUNT_SAMPLE_QUAL_LENGTH,
+	COUNT_SAMPLE_INIT_FILTER,
+	COUNT_SAMPLE_RATIO_FILTER,
+	COUNT_SITE_NOT_ENABLED,
+	COUNT_SITE_LOW_COVERAGE,
+	COUNT_SITE_CANDIDATE,
+	COUNT_SITE_NO_SAMPLE,
+	COUNT_SITE_SINGLE_SAMPLE,
+	COUNT_SITE_EM,
+	COUNT_TABLE_CACHE_HIT,
+	COUNT_TABLE_CACHE_MISS,
+	COUNT_SITE_PRUNED,
+	COUNT_SITE_SCREENED,
+	COUNT_SCREEN_CALLS,
+	COUNT_SCREEN_MISSED,
+	COUNT_SITE_REFINED,
+	COUNT_SITE_OUTPUT,
+	STAT_COUNTERS
+};
+
+class Run_Stats {
+public:
+	Run_Stats();
+
+	void Enable();
+	void Count();
+	void Report(ostream &out, long batch);
+
+	inline bool Enabled()
+	{
+		return Active;
+	}
+
+	inline void Add(Stat_Counter counter, unsigned long long n = 1)
+	{
+		if (Counting)
+			Counters[counter].fetch_add(n, memory_order_relaxed);
+	}
+
+	inline unsigned long long Get(Stat_Counter counter)
+	{
+		return Counters[counter].load(memory_order_relaxed);
+	}
+
+	inline void Add_Time(Stat_Stage stage, unsigned long long ns)
+	{
+		Stage_ns[stage].fetch_add(ns, memory_order_relaxed);
+		Stage_calls[stage].fetch_add(1, memory_order_relaxed);
+	}
+
+	//Size and throughput of the last analysis cycle
+	inline void Set_Batch(long sites, unsigned long long bytes, double seconds)
+	{
+		Batch_sites = sites;
+		Batch_bytes = bytes;
+		Batch_seconds = seconds;
+	}
+
+	inline void Add_Iterations(int loops)
+	{
+		if (Active)
+			Iterations[(loops < STAT_ITERATION_BINS) ? loops : STAT_ITERATION_BINS - 1].fetch_add(1, memory_order_relaxed);
+	}
+
+private:
+	bool Active;
+	bool Counting;
+	chrono::steady_clock::time_point Start;
+	atomic<unsigned long long> Counters[STAT_COUNTERS];
+	atomic<unsigned long long> Stage_ns[STAT_STAGES];
+	atomic<unsigned long long> Stage_calls[STAT_STAGES];
+	atomic<unsigned long long> Iterations[STAT_ITERATION_BINS];
+	long Batch_sites;
+	unsigned long long Batch_bytes;
+	double Batch_seconds;
+};
+
+extern Run_Stats stats;
+
+//Adds the lifetime of the object to a stage
+class Stat_Timer {
+public:
+	inline Stat_Timer(Stat_Stage stage)
+	{
+		this->Stage = stage;
+		if (stats.Enabled())
+			Begin = chrono::steady_clock::now();
+	}
+
+	inline ~Stat_Timer()
+	{
+		if (stats.Enabled())
+			stats.Add_Time(Stage, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - Begin).count());
+	}
+
+private:
+	Stat_Stage Stage;
+	chrono::steady_clock::time_point Begin;
+};
+
+#endif
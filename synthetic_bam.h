@@ -0,0 +1,357 @@
+/*
+ * synthetic_bam.h
+ *
+ * Deterministic reads of several samples over a generated reference, for
+ * the differential check of the BAM input (--bam). The reads are written
+ * as one BAM file per sample with the reference FASTA, and the pileup
+ * samtools mpileup -s -B -Q 0 -x -d 0 would print for them is built
+ * separately, read by read, with the read start, read end and indel marks.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include "bcf_writer.h"
+
+#ifndef SYNTHETIC_BAM_H
+#define SYNTHETIC_BAM_H
+
+using namespace std;
+
+typedef struct _synthetic_read {
+	int contig;
+	int pos;
+	uint16_t flag;
+	unsigned char mq;
+	vector<pair<char, int>> cigar;
+	string seq;
+	string qual; //Phred values
+} synthetic_read;
+
+//Kept by the pileup: not unmapped, secondary, QC failed or duplicate, and in a proper pair if paired
+inline bool synthetic_kept(const synthetic_read &read)
+{
+	return !(read.flag & 0x704) && (!(read.flag & 0x1) || (read.flag & 0x2));
+}
+
+inline int synthetic_span(const synthetic_read &read)
+{
+	int span = 0;
+	for (unsigned int k = 0; k < read.cigar.size(); k++)
+		if (strchr("MDN=X", read.cigar[k].first) != NULL)
+			span += read.cigar[k].second;
+	return span;
+}
+
+//Reference with a run of N, soft masked (lower case) stretches are upper cased by the reader
+inline string synthetic_reference(mt19937 &rng, int length)
+{
+	string sequence;
+	for (int p = 0; p < length; p++)
+		sequence += (p >= 40 && p < 44) ? 'N' : "ACGT"[rng() % 4];
+	return sequence;
+}
+
+//Reads of one sample over a contig, with its variants, errors, indels, clips and skips
+inline void synthetic_reads(mt19937 &rng, int contig, const string &reference, const vector<char> &alts,
+		const vector<float> &genotype, int depth, vector<synthetic_read> &reads)
+{
+	static const unsigned char mapping[6] = {0, 20, 29, 40, 60, 255};
+	uniform_real_distribution<float> unit(0.0, 1.0);
+	int length = reference.size();
+	int count = length * depth / 75;
+	vector<synthetic_read> sample;
+	for (int r = 0; r < count; r++)
+	{
+		synthetic_read read;
+		read.contig = contig;
+		read.pos = rng() % length;
+		read.mq = mapping[rng() % 6];
+		float f = unit(rng);
+		read.flag = (f < 0.04) ? 0x400 : (f < 0.06) ? 0x100 : (f < 0.07) ? 0x200 : (f < 0.09) ? 0x4 : (f < 0.12) ? 0x1 : (f < 0.42) ? 0x3 : 0;
+		read.flag |= (rng() & 1) ? 0x10 : 0;
+		bool equals = (unit(rng) < 0.05);
+
+		if (unit(rng) < 0.1)
+		{
+			int clip = 1 + rng() % 5;
+			read.cigar.push_back(make_pair('S', clip));
+			for (int k = 0; k < clip; k++)
+				read.seq += "ACGT"[rng() % 4];
+		}
+		int end = min(length, read.pos + 50 + (int) (rng() % 51));
+		int p = read.pos;
+		while (p < end)
+		{
+			float x = unit(rng);
+			bool inside = (p > read.pos) && (p + 4 < end) && (read.cigar.back().first == 'M');
+			if (inside && (x < 0.01))
+			{
+				int size = 1 + rng() % 3;
+				read.cigar.push_back(make_pair('I', size));
+				for (int k = 0; k < size; k++)
+					read.seq += "ACGT"[rng() % 4];
+				continue;
+			}
+			if (inside && (x < 0.02))
+			{
+				int size = 1 + rng() % 3;
+				read.cigar.push_back(make_pair('D', size));
+				p += size;
+				continue;
+			}
+			if (inside && (x < 0.023))
+			{
+				int size = 5 + rng() % 16;
+				read.cigar.push_back(make_pair('N', size));
+				p += size;
+				continue;
+			}
+
+			char base = reference[p];
+			if ((alts[p] != 0) && (unit(rng) < genotype[p]))
+				base = alts[p];
+			float e = unit(rng);
+			if ((base == 'N') || (e < 0.01))
+				base = "ACGT"[rng() % 4];
+			else if (e < 0.015)
+				base = 'N';
+			else if (equals && (base == reference[p]))
+				base = '=';
+			read.seq += base;
+			if (read.cigar.empty() || (read.cigar.back().first != 'M'))
+				read.cigar.push_back(make_pair('M', 0));
+			read.cigar.back().second++;
+			p++;
+		}
+		if (read.cigar.back().first != 'M')
+			continue;
+		if (unit(rng) < 0.1)
+		{
+			int clip = 1 + rng() % 5;
+			read.cigar.push_back(make_pair('S', clip));
+			for (int k = 0; k < clip; k++)
+				read.seq += "ACGT"[rng() % 4];
+		}
+		for (unsigned int k = 0; k < read.seq.size(); k++)
+			read.qual += (char) (2 + rng() % 40);
+		sample.push_back(read);
+	}
+	stable_sort(sample.begin(), sample.end(), [](const synthetic_read &a, const synthetic_read &b) { return a.pos < b.pos; });
+	reads.insert(reads.end(), sample.begin(), sample.end());
+}
+
+template <class T>
+inline void synthetic_put(string &out, T value)
+{
+	out.append((const char *) &value, sizeof(T));
+}
+
+//UCSC bin of a 0-based half open interval, as in the SAM specification
+inline int synthetic_bin(int beg, int end)
+{
+	--end;
+	if (beg >> 14 == end >> 14) return ((1 << 15) - 1) / 7 + (beg >> 14);
+	if (beg >> 17 == end >> 17) return ((1 << 12) - 1) / 7 + (beg >> 17);
+	if (beg >> 20 == end >> 20) return ((1 << 9) - 1) / 7 + (beg >> 20);
+	if (beg >> 23 == end >> 23) return ((1 << 6) - 1) / 7 + (beg >> 23);
+	if (beg >> 26 == end >> 26) return ((1 << 3) - 1) / 7 + (beg >> 26);
+	return 0;
+}
+
+inline int synthetic_write_bam(const string &filename, const vector<string> &names, const vector<int> &lengths,
+		const vector<synthetic_read> &reads, int unplaced)
+{
+	ofstream file(filename, ios::out | ios::binary);
+	Bgzf_Writer bgzf(file);
+	string text = "@HD\tVN:1.6\tSO:coordinate\n";
+	for (unsigned int i = 0; i < names.size(); i++)
+		text += "@SQ\tSN:" + names[i] + "\tLN:" + to_string(lengths[i]) + "\n";
+	string out = "BAM\1";
+	synthetic_put(out, (int32_t) text.size());
+	out += text;
+	synthetic_put(out, (int32_t) names.size());
+	for (unsigned int i = 0; i < names.size(); i++)
+	{
+		synthetic_put(out, (int32_t) names[i].size() + 1);
+		out.append(names[i].c_str(), names[i].size() + 1);
+		synthetic_put(out, (int32_t) lengths[i]);
+	}
+	bgzf.Write(out.data(), out.size());
+
+	for (unsigned int r = 0; r < reads.size() + unplaced; r++)
+	{
+		synthetic_read unmapped;
+		unmapped.contig = -1;
+		unmapped.pos = -1;
+		unmapped.flag = 0x4;
+		unmapped.mq = 0;
+		unmapped.seq = "ACGTACGT";
+		unmapped.qual = string(8, 30);
+		const synthetic_read &read = (r < reads.size()) ? reads[r] : unmapped;
+		string name = "r" + to_string(r);
+		string record;
+		synthetic_put(record, (int32_t) read.contig);
+		synthetic_put(record, (int32_t) read.pos);
+		synthetic_put(record, (uint8_t) (name.size() + 1));
+		synthetic_put(record, (uint8_t) read.mq);
+		synthetic_put(record, (uint16_t) ((read.contig < 0) ? 4680 : synthetic_bin(read.pos, read.pos + max(synthetic_span(read), 1))));
+		synthetic_put(record, (uint16_t) read.cigar.size());
+		synthetic_put(record, (uint16_t) read.flag);
+		synthetic_put(record, (int32_t) read.seq.size());
+		synthetic_put(record, (int32_t) -1);
+		synthetic_put(record, (int32_t) -1);
+		synthetic_put(record, (int32_t) 0);
+		record.append(name.c_str(), name.size() + 1);
+		for (unsigned int k = 0; k < read.cigar.size(); k++)
+			synthetic_put(record, (uint32_t) ((read.cigar[k].second << 4) | (strchr("MIDNSHP=X", read.cigar[k].first) - "MIDNSHP=X")));
+		for (unsigned int k = 0; k < read.seq.size(); k += 2)
+		{
+			uint8_t high = strchr("=ACMGRSVTWYHKDBN", read.seq[k]) - "=ACMGRSVTWYHKDBN";
+			uint8_t low = (k + 1 < read.seq.size()) ? strchr("=ACMGRSVTWYHKDBN", read.seq[k + 1]) - "=ACMGRSVTWYHKDBN" : 0;
+			record += (char) ((high << 4) | low);
+		}
+		record += read.qual;
+		string block;
+		synthetic_put(block, (int32_t) record.size());
+		block += record;
+		bgzf.Write(block.data(), block.size());
+	}
+	return bgzf.Close();
+}
+
+//60 bases a line, part of every contig soft masked, with a faidx index if asked
+inline int synthetic_write_fasta(const string &filename, const vector<string> &names, const vector<string> &sequences, bool index)
+{
+	ofstream file(filename, ios::out | ios::binary);
+	ofstream fai;
+	if (index)
+		fai.open(filename + ".fai", ios::out);
+	for (unsigned int i = 0; i < names.size(); i++)
+	{
+		file << ">" << names[i] << " synthetic\n";
+		if (index)
+			fai << names[i] << "\t" << sequences[i].size() << "\t" << file.tellp() << "\t60\t61\n";
+		for (unsigned int p = 0; p < sequences[i].size(); p += 60)
+		{
+			string line = sequences[i].substr(p, 60);
+			for (unsigned int k = 0; k < line.size(); k++)
+				if ((p + k) % 200 >= 100 && (p + k) % 200 < 130)
+					line[k] = tolower(line[k]);
+			file << line << "\n";
+		}
+	}
+	return file ? 0 : 1;
+}
+
+//The mpileup entries of one read, one per reference position from its start
+inline void synthetic_entries(const synthetic_read &read, const string &reference, vector<string> &bases, string &quals)
+{
+	bool reverse = (read.flag & 0x10) != 0;
+	bases.clear();
+	quals.clear();
+	int q = 0;
+	int p = read.pos;
+	for (unsigned int k = 0; k < read.cigar.size(); k++)
+	{
+		char op = read.cigar[k].first;
+		int size = read.cigar[k].second;
+		if (op == 'S')
+			q += size;
+		else if (op == 'M')
+			for (int j = 0; j < size; j++, q++, p++)
+			{
+				char base = read.seq[q];
+				if ((base == '=') || (base == reference[p]))
+					base = reverse ? ',' : '.';
+				else if (reverse)
+					base = tolower(base);
+				bases.push_back(string(1, base));
+				quals += (char) min(read.qual[q] + 33, 126);
+			}
+		else if (op == 'I')
+		{
+			string mark = "+" + to_string(size);
+			for (int j = 0; j < size; j++, q++)
+				mark += reverse ? tolower(read.seq[q]) : read.seq[q];
+			bases.back() += mark;
+		}
+		else
+		{
+			if (op == 'D')
+			{
+				string mark = "-" + to_string(size);
+				for (int j = 0; j < size; j++)
+					mark += reverse ? tolower(reference[p + j]) : reference[p + j];
+				bases.back() += mark;
+			}
+			for (int j = 0; j < size; j++, p++)
+			{
+				bases.push_back((op == 'D') ? "*" : (reverse ? "<" : ">"));
+				quals += (char) min(read.qual[q] + 33, 126);
+			}
+		}
+	}
+	bases.front() = "^" + string(1, (char) min(read.mq + 33, 126)) + bases.front();
+	bases.back() += "$";
+}
+
+//The pileup lines of the reads of every sample, at the positions some kept read covers
+inline void synthetic_pileup(const vector<string> &names, const vector<string> &references,
+		const vector<vector<synthetic_read>> &samples, vector<string> &lines)
+{
+	vector<string> bases;
+	string quals;
+	for (unsigned int c = 0; c < names.size(); c++)
+	{
+		int length = references[c].size();
+		vector<vector<string>> column_bases(samples.size() * length), column_quals(samples.size() * length);
+		for (unsigned int i = 0; i < samples.size(); i++)
+			for (unsigned int r = 0; r < samples[i].size(); r++)
+			{
+				const synthetic_read &read = samples[i][r];
+				if ((read.contig != (int) c) || !synthetic_kept(read))
+					continue;
+				synthetic_entries(read, references[c], bases, quals);
+				for (unsigned int j = 0; j < bases.size(); j++)
+				{
+					int at = i * length + read.pos + j;
+					column_bases[at].push_back(bases[j]);
+					column_quals[at].push_back(string(1, quals[j]) + (char) min(read.mq + 33, 126));
+				}
+			}
+
+		for (int p = 0; p < length; p++)
+		{
+			string line = names[c] + "\t" + to_string(p + 1) + "\t" + references[c][p];
+			bool covered = false;
+			for (unsigned int i = 0; i < samples.size(); i++)
+			{
+				const vector<string> &entries = column_bases[i * length + p];
+				const vector<string> &entry_quals = column_quals[i * length + p];
+				if (entries.empty())
+				{
+					line += "\t0\t*\t*";
+					continue;
+				}
+				covered = true;
+				string b, bq, mq;
+				for (unsigned int k = 0; k < entries.size(); k++)
+				{
+					b += entries[k];
+					bq += entry_quals[k][0];
+					mq += entry_quals[k][1];
+				}
+				line += "\t" + to_string(entries.size()) + "\t" + b + "\t" + bq + "\t" + mq;
+			}
+			if (covered)
+				lines.push_back(line);
+		}
+	}
+}
+
+#endif
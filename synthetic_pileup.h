@@ -0,0 +1,73 @@
+/*
+ * synthetic_pileup.h
+ *
+ * Deterministic multi-sample pileup generator for the benchmark and
+ * differential check tools.
+ */
+#include <random>
+#include <string>
+#include <cctype>
+
+#ifndef SYNTHETIC_PILEUP_H
+#define SYNTHETIC_PILEUP_H
+
+using namespace std;
+
+//One sample column: bases, base qualities and mapping qualities
+//genotype is the expected fraction of alt reads
+inline void synthetic_sample(mt19937 &rng, float genotype, char alt, int depth, string &bases, string &bq, string &mq)
+{
+	static const int mapping[5] = {0, 20, 29, 40, 60};
+	uniform_real_distribution<float> unit(0.0, 1.0);
+	bases.clear();
+	bq.clear();
+	mq.clear();
+	for (int r = 0; r < depth; r++)
+	{
+		float x = unit(rng);
+		if (unit(rng) < 0.03)
+			bases += "^I";
+		if (x < 0.02)
+			bases += "ACGT*"[rng() % 5];
+		else if (x < 0.02 + genotype * 0.98)
+			bases += (rng() & 1) ? alt : tolower(alt);
+		else
+			bases += (rng() & 1) ? '.' : ',';
+		if (unit(rng) < 0.02)
+			bases += '$';
+		if (unit(rng) < 0.02)
+			bases += "+2AC";
+		bq += (char) (35 + rng() % 40);
+		mq += (char) (33 + mapping[rng() % 5]);
+	}
+}
+
+//One pileup line, 30% of the sites carry a variant and 5% of the samples have no coverage
+inline string synthetic_line(mt19937 &rng, const string &chrom, unsigned int pos, int samples, int depth)
+{
+	static const float genotypes[3] = {0.0, 0.5, 1.0};
+	uniform_real_distribution<float> unit(0.0, 1.0);
+	normal_distribution<float> coverage(depth, depth / 3.0);
+	char ref = "ACGT"[rng() % 4];
+	char alt = "ACGT"[(ref == 'A') ? 1 + rng() % 3 : rng() % 4];
+	alt = (alt == ref) ? 'A' : alt;
+	bool variant = (unit(rng) < 0.3);
+
+	string line = chrom + "\t" + to_string(pos) + "\t" + ref;
+	string bases, bq, mq;
+	for (int i = 0; i < samples; i++)
+	{
+		int cov = (int) coverage(rng);
+		cov = (unit(rng) < 0.05) ? 0 : cov;
+		if (cov <= 0)
+		{
+			line += "\t0\t*\t*";
+			continue;
+		}
+		synthetic_sample(rng, variant ? genotypes[rng() % 3] : 0.0, alt, cov, bases, bq, mq);
+		line += "\t" + to_string(cov) + "\t" + bases + "\t" + bq + "\t" + mq;
+	}
+	return line;
+}
+
+#endif
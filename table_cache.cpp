@@ -0,0 +1,48 @@
+#include "table_cache.h"
+
+Table_Cache table_cache;
+
+Table_Cache::Table_Cache()
+{
+	Capacity = 0;
+	for (int i = 0; i < TABLE_CACHE_SHARDS; i++)
+		Shards[i].bytes = 0;
+}
+
+void Table_Cache::Set_Capacity(unsigned long long bytes)
+{
+	Capacity = bytes / TABLE_CACHE_SHARDS;
+}
+
+shared_ptr<const table_entry> Table_Cache::Find(const string &key)
+{
+	shard &s = Shard_Of(key);
+	lock_guard<mutex> guard(s.lock);
+	unordered_map<string, entry_list::iterator>::iterator it = s.index.find(key);
+	if (it == s.index.end())
+		return shared_ptr<const table_entry>();
+	s.lru.splice(s.lru.begin(), s.lru, it->second);
+	return *it->second;
+}
+
+//An entry another thread inserted first for the same key is kept
+void Table_Cache::Insert(const shared_ptr<const table_entry> &entry)
+{
+	if (entry->bytes > Capacity)
+		return;
+	shard &s = Shard_Of(entry->key);
+	lock_guard<mutex> guard(s.lock);
+	if (s.index.find(entry->key) != s.index.end())
+		return;
+
+	while (s.bytes + entry->bytes > Capacity)
+	{
+		const table_entry &last = *s.lru.back();
+		s.bytes -= last.bytes;
+		s.index.erase(last.key);
+		s.lru.pop_back();
+	}
+	s.lru.push_front(entry);
+	s.index[entry->key] = s.lru.begin();
+	s.bytes += entry->bytes;
+}
@@ -0,0 +1,74 @@
+/*
+ * table_cache.h
+ *
+ * Bounded LRU cache of the per sample scan values and likelihood tables
+ * (--table-cache), keyed by the filtered evidence: the packed reads in
+ * order, the grid and the math level. Samples whose filtered reads are the
+ * same, common at low depth and with binned qualities, copy the values of
+ * the first one into their own tables instead of computing them again.
+ * Keys are compared in full, so results never change. Entries are
+ * immutable once inserted and shared, an entry evicted while a thread
+ * copies it stays valid until the copy is done. The cache is split into
+ * shards by key hash, each with its own lock and its share of the bytes.
+ */
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "seq_obj.h"
+
+#ifndef TABLE_CACHE_H
+#define TABLE_CACHE_H
+
+#define TABLE_CACHE_SHARDS 16
+
+using namespace std;
+
+typedef struct _table_entry {
+	string key;
+	vector<internal_value> value;
+	vector<float> one;
+	vector<float> two;
+	vector<float> three;
+	unsigned long long bytes;
+} table_entry;
+
+class Table_Cache {
+public:
+	Table_Cache();
+
+	//Total bytes of the entries, 0 disables the cache
+	void Set_Capacity(unsigned long long bytes);
+
+	inline bool Enabled()
+	{
+		return Capacity > 0;
+	}
+
+	shared_ptr<const table_entry> Find(const string &key);
+	void Insert(const shared_ptr<const table_entry> &entry);
+
+private:
+	typedef list<shared_ptr<const table_entry>> entry_list;
+
+	typedef struct _shard {
+		mutex lock;
+		entry_list lru; //Most recently used first
+		unordered_map<string, entry_list::iterator> index;
+		unsigned long long bytes;
+	} shard;
+
+	unsigned long long Capacity; //Per shard
+	shard Shards[TABLE_CACHE_SHARDS];
+
+	inline shard &Shard_Of(const string &key)
+	{
+		return Shards[hash<string>()(key) % TABLE_CACHE_SHARDS];
+	}
+};
+
+extern Table_Cache table_cache;
+
+#endif